@@ -1,7 +1,11 @@
-#include "librv64i.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-typedef __int128_t int128_t;
-typedef __uint128_t uint128_t;
+#include "librv64i_internal.h"
 
 static uint64_t dram_load_8(dram_t *dram, uint64_t addr) { return (uint64_t)dram->mem[addr]; }
 static uint64_t dram_load_16(dram_t *dram, uint64_t addr) { return (uint64_t)dram->mem[addr] | (uint64_t)dram->mem[addr + 1] << 8; }
@@ -30,7 +34,7 @@ uint64_t dram_load(dram_t *dram, uint64_t addr, uint64_t size) {
     }
 }
 
-static void dram_store_8(dram_t *dram, uint64_t addr, uint64_t value) { dram->mem[addr - DRAM_BASE] = (uint8_t)(value & 0xff); }
+static void dram_store_8(dram_t *dram, uint64_t addr, uint64_t value) { dram->mem[addr] = (uint8_t)(value & 0xff); }
 static void dram_store_16(dram_t *dram, uint64_t addr, uint64_t value) {
     dram->mem[addr] = (uint8_t)(value & 0xff);
     dram->mem[addr + 1] = (uint8_t)((value >> 8) & 0xff);
@@ -66,27 +70,142 @@ void dram_store(dram_t *dram, uint64_t addr, uint64_t size, uint64_t value) {
     }
 }
 
-uint64_t bus_load(bus_t *bus, uint64_t addr, uint64_t size) {
-    if ((addr >= DRAM_BASE) && (addr + (size / 8) <= DRAM_BASE + DRAM_SIZE))
-        return dram_load(&(bus->dram), addr - DRAM_BASE, size);
-    return 0;
+#define ADDR_MISALIGNED(addr) (addr & 0x3)
+
+// an anonymous mapping, the host backs a page when the guest first touches it
+static uint8_t *dram_alloc(uint64_t size) {
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
 }
 
-void bus_store(bus_t *bus, uint64_t addr, uint64_t size, uint64_t value) {
-    if ((addr >= DRAM_BASE) && (addr + (size / 8) <= DRAM_BASE + DRAM_SIZE))
-        dram_store(&(bus->dram), addr - DRAM_BASE, size, value);
+int cpu_init(cpu_t *cpu) {
+    cpu_config_t config = {.engine = CPU_ENGINE_STEP, .dram_base = DRAM_BASE, .dram_size = DRAM_SIZE};
+    return cpu_init_config(cpu, &config);
 }
 
-#define ADDR_MISALIGNED(addr) (addr & 0x3)
+int cpu_init_config(cpu_t *cpu, const cpu_config_t *config) { return cpu_init_shared(cpu, config, -1, NULL); }
+
+int cpu_init_shared(cpu_t *cpu, const cpu_config_t *config, int icache_fd, cpu_t *owner) {
+    cpu->bus.dram.base = config->dram_base;
+    cpu->bus.dram.size = config->dram_size ? config->dram_size : DRAM_SIZE;
+    cpu->engine = config->engine;
+    memset(cpu->regs, 0, sizeof(cpu->regs));                // a0 tells the startup code if bss is clear, see cpu_load_elf
+    cpu->regs[0] = 0x00;                                    // register x0 hardwired to 0
+    cpu->regs[2] = cpu->bus.dram.base + cpu->bus.dram.size; // Set stack pointer
+    cpu->pc = cpu->bus.dram.base;                           // Set program counter to the base address
+    cpu->blocks = NULL;
+    cpu->aot = NULL;
+    cpu->symtab = NULL;
+    cpu->snap = NULL;
+    cpu->tmpl = NULL;
+    cpu->code = NULL;
+    cpu->bus.mmio = NULL;
+    cpu->owner = owner;
+    cpu->hartid = 0;
+    cpu->lr_addr = LR_NONE;
+    cpu->lr_value = 0;
+    cpu->limit = 0;
+    cpu->stop = 0;
+    cpu->stop_reason = CPU_STOP_LIMIT;
+    cpu->handlers = config->handlers;
+    cpu_stats_reset(cpu);
+
+    // a miss of a cpu sharing the decoded instructions of a template copies one page of them
+    if (icache_fd < 0) {
+        cpu->icache = (icache_entry_t *)dram_alloc(ICACHE_SIZE * sizeof(icache_entry_t));
+        if (cpu->icache)
+            cpu_icache_flush(cpu);
+    } else {
+        cpu->icache = mmap(NULL, ICACHE_SIZE * sizeof(icache_entry_t), PROT_READ | PROT_WRITE, MAP_PRIVATE, icache_fd, 0);
+        cpu->icache = cpu->icache == MAP_FAILED ? NULL : cpu->icache;
+    }
+
+    cpu->bus.guard = 0;
+    if (owner)
+        cpu->bus = owner->bus; // dram, its guard pages and the devices
+    else if (!config->guard || guard_reserve(cpu))
+        cpu->bus.dram.mem = dram_alloc(cpu->bus.dram.size);
+    return cpu->bus.dram.mem && cpu->icache && !code_init(cpu) ? 0 : -1;
+}
+
+void cpu_set_handlers(cpu_t *cpu, const cpu_handlers_t *handlers) { cpu->handlers = *handlers; }
+
+void cpu_free(cpu_t *cpu) {
+    block_cache_free(cpu);
+    aot_free(cpu);
+    symtab_free(cpu->symtab);
+    cpu->symtab = NULL;
+    snapshot_free(cpu);
+    if (cpu->icache)
+        munmap(cpu->icache, ICACHE_SIZE * sizeof(icache_entry_t));
+    cpu->icache = NULL;
+    template_put(cpu->tmpl);
+    cpu->tmpl = NULL;
+    code_free(cpu);
+    if (!cpu->owner) {
+        mmio_free(&cpu->bus);
+        if (cpu->bus.guard) {
+            guard_release(cpu);
+        } else if (cpu->bus.dram.mem) {
+            guard_forget(cpu);
+            munmap(cpu->bus.dram.mem, cpu->bus.dram.size);
+        }
+    }
+    cpu->bus.dram.mem = NULL;
+    cpu->bus.mmio = NULL;
+    cpu->owner = NULL;
+}
+
+int dram_load_file(dram_t *dram, uint64_t off, int fd, uint64_t file_off, uint64_t len) {
+    struct stat st;
+    uint64_t page = dram_page_size();
+    if (!len)
+        return 0;
+    if (fstat(fd, &st) || (S_ISREG(st.st_mode) && (uint64_t)st.st_size < file_off + len))
+        return -1;
+    // the mapping replaces that part of dram. it is page granular, the caller zeroes what lies
+    // past len in the last page unless that is past the end of the file
+    if (S_ISREG(st.st_mode) && !(off % page) && !(file_off % page) &&
+        mmap(dram->mem + off, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_off) != MAP_FAILED)
+        return 0;
+    for (uint64_t done = 0; done < len;) {
+        ssize_t n = pread(fd, dram->mem + off + done, len - done, file_off + done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+void dram_zero(dram_t *dram, uint64_t off, uint64_t len) {
+    uint64_t page = dram_page_size();
+    uint64_t first = (off + page - 1) / page * page;
+    uint64_t last = (off + len) / page * page;
+    if (first >= last || mmap(dram->mem + first, last - first, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        memset(dram->mem + off, 0, len);
+        return;
+    }
+    // whole pages are replaced by untouched ones, only the partial pages at the ends are written
+    memset(dram->mem + off, 0, first - off);
+    memset(dram->mem + last, 0, off + len - last);
+}
 
-void cpu_init(cpu_t *cpu) {
-    cpu->regs[0] = 0x00;                  // register x0 hardwired to 0
-    cpu->regs[2] = DRAM_BASE + DRAM_SIZE; // Set stack pointer
-    cpu->pc = DRAM_BASE;                  // Set program counter to the base address
+int cpu_load_image(cpu_t *cpu, const char *path, uint64_t addr) {
+    uint64_t off = addr - cpu->bus.dram.base;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ret = -1;
+    // the tail of the last page reads as 0 past the end of the file
+    if (!fstat(fd, &st) && off <= cpu->bus.dram.size && (uint64_t)st.st_size <= cpu->bus.dram.size - off)
+        ret = dram_load_file(&cpu->bus.dram, off, fd, 0, st.st_size);
+    close(fd);
+    return ret;
 }
 
 uint32_t cpu_fetch(cpu_t *cpu) {
-    uint32_t inst = bus_load(&(cpu->bus), cpu->pc, 32);
+    uint32_t inst = bus_fetch(&(cpu->bus), cpu->pc);
     cpu->pc += 4;
     return inst;
 }
@@ -123,7 +242,7 @@ static uint64_t imm_B(uint32_t inst) {
 }
 static uint64_t imm_U(uint32_t inst) {
     // imm[31:12] = inst[31:12]
-    return (int64_t)(int32_t)(inst & 0xfffff999);
+    return (int64_t)(int32_t)(inst & 0xfffff000);
 }
 static uint64_t imm_J(uint32_t inst) {
     // imm[20|10:1|11|19:12] = inst[31|30:21|20|19:12]
@@ -131,28 +250,29 @@ static uint64_t imm_J(uint32_t inst) {
            | ((inst >> 9) & 0x800)
            | ((inst >> 20) & 0x7fe);
 }
-static uint32_t shamt(uint32_t inst) {
+static uint32_t shamt(const insn_t *in) {
     // shamt(shift amount) only required for immediate shift instructions
     // sometimes 6... sometimes 7 bits. but always compatible
     // shamt = imm[6:0]
-    return (uint32_t)(imm_I(inst) & 0x3f);
+    return (uint32_t)(in->imm & 0x3f);
 }
 
-static int exec_LUI(cpu_t *cpu, uint32_t inst) {
+static int exec_LUI(cpu_t *cpu, const insn_t *in) {
     // LUI places upper 20 bits of U-immediate value to rd
-    cpu->regs[rd(inst)] = (uint64_t)(int64_t)(int32_t)(inst & 0xfffff000);
+    cpu->regs[in->rd] = in->imm;
     return 0;
 }
-static int exec_AUIPC(cpu_t *cpu, uint32_t inst) {
+static int exec_AUIPC(cpu_t *cpu, const insn_t *in) {
     // AUIPC forms a 32-bit offset from the 20 upper bits
     // of the U-immediate
-    uint64_t imm = imm_U(inst);
-    cpu->regs[rd(inst)] = ((int64_t)cpu->pc + (int64_t)imm) - 4;
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = ((int64_t)cpu->pc + (int64_t)imm) - 4;
     return 0;
 }
-static int exec_JAL(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_J(inst);
-    cpu->regs[rd(inst)] = cpu->pc;
+static int exec_JAL(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = cpu->pc;
+    cpu->regs[0] = 0; // rd == x0 is a plain jump. rv_decode gives x0 to the jumps, loads, CSR and AMO, see there
     cpu->pc = cpu->pc + (int64_t)imm - 4;
     if (ADDR_MISALIGNED(cpu->pc)) {
         //DBG("JAL pc address misalligned");
@@ -160,595 +280,783 @@ static int exec_JAL(cpu_t *cpu, uint32_t inst) {
     }
     return 0;
 }
-static int exec_JALR(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
+static int exec_JALR(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
     uint64_t tmp = cpu->pc;
-    cpu->pc = (cpu->regs[rs1(inst)] + (int64_t)imm) & 0xfffffffe;
-    cpu->regs[rd(inst)] = tmp;
+    cpu->pc = (cpu->regs[in->rs1] + (int64_t)imm) & 0xfffffffe;
+    cpu->regs[in->rd] = tmp;
+    cpu->regs[0] = 0; // see exec_JAL
     if (ADDR_MISALIGNED(cpu->pc)) {
         //DBG("JAL pc address misalligned");
         // exit(0);
     }
     return 0;
 }
-static int exec_BEQ(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_B(inst);
-    if ((int64_t)cpu->regs[rs1(inst)] == (int64_t)cpu->regs[rs2(inst)])
+static int exec_BEQ(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    if ((int64_t)cpu->regs[in->rs1] == (int64_t)cpu->regs[in->rs2])
         cpu->pc = cpu->pc + (int64_t)imm - 4;
     return 0;
 }
-static int exec_BNE(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_B(inst);
-    if (cpu->regs[rs1(inst)] != cpu->regs[rs2(inst)])
+static int exec_BNE(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    if (cpu->regs[in->rs1] != cpu->regs[in->rs2])
         cpu->pc = (cpu->pc + (int64_t)imm - 4);
     return 0;
 }
-static int exec_BLT(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_B(inst);
-    if ((int64_t)cpu->regs[rs1(inst)] < (int64_t)cpu->regs[rs2(inst)])
+static int exec_BLT(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    if ((int64_t)cpu->regs[in->rs1] < (int64_t)cpu->regs[in->rs2])
         cpu->pc = cpu->pc + (int64_t)imm - 4;
     return 0;
 }
-static int exec_BGE(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_B(inst);
-    if ((int64_t)cpu->regs[rs1(inst)] >= (int64_t)cpu->regs[rs2(inst)])
+static int exec_BGE(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    if ((int64_t)cpu->regs[in->rs1] >= (int64_t)cpu->regs[in->rs2])
         cpu->pc = cpu->pc + (int64_t)imm - 4;
     return 0;
 }
-static int exec_BLTU(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_B(inst);
-    if (cpu->regs[rs1(inst)] < cpu->regs[rs2(inst)])
+static int exec_BLTU(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    if (cpu->regs[in->rs1] < cpu->regs[in->rs2])
         cpu->pc = cpu->pc + (int64_t)imm - 4;
     return 0;
 }
-static int exec_BGEU(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_B(inst);
-    if (cpu->regs[rs1(inst)] >= cpu->regs[rs2(inst)])
+static int exec_BGEU(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    if (cpu->regs[in->rs1] >= cpu->regs[in->rs2])
         cpu->pc = (int64_t)cpu->pc + (int64_t)imm - 4;
     return 0;
 }
-static int exec_LB(cpu_t *cpu, uint32_t inst) {
+static int exec_LB(cpu_t *cpu, const insn_t *in) {
     // load 1 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = (int64_t)(int8_t)cpu_load(cpu, addr, 8);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = (int64_t)(int8_t)cpu_load(cpu, addr, 8);
+    cpu->regs[0] = 0; // rd == x0 still loads, see rv_decode
     return 0;
 }
-static int exec_LH(cpu_t *cpu, uint32_t inst) {
+static int exec_LH(cpu_t *cpu, const insn_t *in) {
     // load 2 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = (int64_t)(int16_t)cpu_load(cpu, addr, 16);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = (int64_t)(int16_t)cpu_load(cpu, addr, 16);
+    cpu->regs[0] = 0; // see exec_LB
     return 0;
 }
-static int exec_LW(cpu_t *cpu, uint32_t inst) {
+static int exec_LW(cpu_t *cpu, const insn_t *in) {
     // load 4 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = (int64_t)(int32_t)cpu_load(cpu, addr, 32);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = (int64_t)(int32_t)cpu_load(cpu, addr, 32);
+    cpu->regs[0] = 0; // see exec_LB
     return 0;
 }
-static int exec_LD(cpu_t *cpu, uint32_t inst) {
+static int exec_LD(cpu_t *cpu, const insn_t *in) {
     // load 8 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = (int64_t)cpu_load(cpu, addr, 64);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = (int64_t)cpu_load(cpu, addr, 64);
+    cpu->regs[0] = 0; // see exec_LB
     return 0;
 }
-static int exec_LBU(cpu_t *cpu, uint32_t inst) {
+static int exec_LBU(cpu_t *cpu, const insn_t *in) {
     // load unsigned 1 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = cpu_load(cpu, addr, 8);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = cpu_load(cpu, addr, 8);
+    cpu->regs[0] = 0; // see exec_LB
     return 0;
 }
-static int exec_LHU(cpu_t *cpu, uint32_t inst) {
+static int exec_LHU(cpu_t *cpu, const insn_t *in) {
     // load unsigned 2 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = cpu_load(cpu, addr, 16);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = cpu_load(cpu, addr, 16);
+    cpu->regs[0] = 0; // see exec_LB
     return 0;
 }
-static int exec_LWU(cpu_t *cpu, uint32_t inst) {
+static int exec_LWU(cpu_t *cpu, const insn_t *in) {
     // load unsigned 2 byte to rd from address in rs1
-    uint64_t imm = imm_I(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu->regs[rd(inst)] = cpu_load(cpu, addr, 32);
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu->regs[in->rd] = cpu_load(cpu, addr, 32);
+    cpu->regs[0] = 0; // see exec_LB
     return 0;
 }
-static int exec_SB(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_S(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu_store(cpu, addr, 8, cpu->regs[rs2(inst)]);
+static int exec_SB(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu_store(cpu, addr, 8, cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SH(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_S(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu_store(cpu, addr, 16, cpu->regs[rs2(inst)]);
+static int exec_SH(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu_store(cpu, addr, 16, cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SW(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_S(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu_store(cpu, addr, 32, cpu->regs[rs2(inst)]);
+static int exec_SW(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu_store(cpu, addr, 32, cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SD(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_S(inst);
-    uint64_t addr = cpu->regs[rs1(inst)] + (int64_t)imm;
-    cpu_store(cpu, addr, 64, cpu->regs[rs2(inst)]);
+static int exec_SD(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    uint64_t addr = cpu->regs[in->rs1] + (int64_t)imm;
+    cpu_store(cpu, addr, 64, cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_ADDI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] + (int64_t)imm;
+static int exec_ADDI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = cpu->regs[in->rs1] + (int64_t)imm;
     return 0;
 }
-static int exec_SLLI(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] << shamt(inst);
+static int exec_SLLI(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] << shamt(in);
     return 0;
 }
-static int exec_SLLI_64(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] << shamt(inst);
+static int exec_SLLI_64(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] << shamt(in);
     return 0;
 }
-static int exec_SLTI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = (cpu->regs[rs1(inst)] < (int64_t)imm) ? 1 : 0;
+static int exec_SLTI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = (cpu->regs[in->rs1] < (int64_t)imm) ? 1 : 0;
     return 0;
 }
-static int exec_SLTIU(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
+static int exec_SLTIU(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
     if (imm == 1) {
-        cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] == 0 ? 1 : 0;
+        cpu->regs[in->rd] = cpu->regs[in->rs1] == 0 ? 1 : 0;
         return 0;
     }
-    cpu->regs[rd(inst)] = (cpu->regs[rs1(inst)] < imm) ? 1 : 0;
+    cpu->regs[in->rd] = (cpu->regs[in->rs1] < imm) ? 1 : 0;
     return 0;
 }
-static int exec_XORI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] ^ imm;
+static int exec_XORI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = cpu->regs[in->rs1] ^ imm;
     return 0;
 }
-static int exec_SRLI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);// SRLI
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] >> imm;
+static int exec_SRLI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;// SRLI
+    cpu->regs[in->rd] = cpu->regs[in->rs1] >> imm;
     return 0;
 }
-static int exec_SRLI_64(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);// SRLI_64
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] >> imm;
+static int exec_SRLI_64(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;// SRLI_64
+    cpu->regs[in->rd] = cpu->regs[in->rs1] >> imm;
     return 0;
 }
-static int exec_SRAI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);// SRAI
-    cpu->regs[rd(inst)] = (int64_t)cpu->regs[rs1(inst)] >> imm;
+static int exec_SRAI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;// SRAI
+    cpu->regs[in->rd] = (int64_t)cpu->regs[in->rs1] >> imm;
     return 0;
 }
-static int exec_SRAI_64(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);// SRAI_64
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] >> imm;
+static int exec_SRAI_64(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;// SRAI_64
+    cpu->regs[in->rd] = cpu->regs[in->rs1] >> imm;
     return 0;
 }
-static int exec_ORI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] | imm;
+static int exec_ORI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = cpu->regs[in->rs1] | imm;
     return 0;
 }
-static int exec_ANDI(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] & imm;
+static int exec_ANDI(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = cpu->regs[in->rs1] & imm;
     return 0;
 }
-static int exec_ADD(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = ((int64_t)cpu->regs[rs1(inst)] + (int64_t)cpu->regs[rs2(inst)]);
+static int exec_ADD(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = ((int64_t)cpu->regs[in->rs1] + (int64_t)cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SUB(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = ((int64_t)cpu->regs[rs1(inst)] - (int64_t)cpu->regs[rs2(inst)]);
+static int exec_SUB(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = ((int64_t)cpu->regs[in->rs1] - (int64_t)cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SLL(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] << (int64_t)cpu->regs[rs2(inst)];
+static int exec_SLL(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] << (int64_t)cpu->regs[in->rs2];
     return 0;
 }
-static int exec_SLT(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = ((int64_t)cpu->regs[rs1(inst)] < (int64_t)cpu->regs[rs2(inst)]) ? 1 : 0;
+static int exec_SLT(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = ((int64_t)cpu->regs[in->rs1] < (int64_t)cpu->regs[in->rs2]) ? 1 : 0;
     return 0;
 }
-static int exec_SLTU(cpu_t *cpu, uint32_t inst) {
-    if (rs1(inst) == 0) {
-        cpu->regs[rd(inst)] = cpu->regs[rs2(inst)] != 0 ? 1 : 0;
+static int exec_SLTU(cpu_t *cpu, const insn_t *in) {
+    if (in->rs1 == 0) {
+        cpu->regs[in->rd] = cpu->regs[in->rs2] != 0 ? 1 : 0;
         return 0;
     }
-    cpu->regs[rd(inst)] = (cpu->regs[rs1(inst)] < cpu->regs[rs2(inst)]) ? 1 : 0;
+    cpu->regs[in->rd] = (cpu->regs[in->rs1] < cpu->regs[in->rs2]) ? 1 : 0;
+    return 0;
+}
+static int exec_XOR(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] ^ cpu->regs[in->rs2];
+    return 0;
+}
+static int exec_SRL(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] >> cpu->regs[in->rs2];
     return 0;
 }
-static int exec_XOR(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] ^ cpu->regs[rs2(inst)];
+static int exec_OR(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] | cpu->regs[in->rs2];
     return 0;
 }
-static int exec_SRL(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] >> cpu->regs[rs2(inst)];
+static int exec_AND(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = cpu->regs[in->rs1] & cpu->regs[in->rs2];
     return 0;
 }
-static int exec_OR(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] | cpu->regs[rs2(inst)];
+static int exec_FENCE(cpu_t *cpu, const insn_t *in) {
+    fence_exec(in->inst);
     return 0;
 }
-static int exec_AND(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] & cpu->regs[rs2(inst)];
+static int exec_FENCE_I(cpu_t *cpu, const insn_t *in) {
+    code_sync(cpu);
     return 0;
 }
-static int exec_FENCE(cpu_t *cpu, uint32_t inst) {
+static int exec_NOP(cpu_t *cpu, const insn_t *in) {
     return 0;
 }
-static int exec_ECALL_EBREAK(cpu_t *cpu, uint32_t inst) {
-    if (imm_I(inst) == 0x0)
-        return ECALL_cb(cpu, inst);
-    if (imm_I(inst) == 0x1)
-        return EBREAK_cb(cpu, inst);
+static int exec_ECALL_EBREAK(cpu_t *cpu, const insn_t *in) {
+    if (in->imm == 0x0) {
+        cpu->stop_reason = CPU_STOP_ECALL;
+        return handle_ecall(cpu, in->inst);
+    }
+    if (in->imm == 0x1) {
+        cpu->stop_reason = CPU_STOP_EBREAK;
+        return handle_ebreak(cpu, in->inst);
+    }
+    cpu->stop_reason = CPU_STOP_INVOP;
     return -1;
 }
-static int exec_ADDIW(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = ((int32_t)cpu->regs[rs1(inst)]) + (int32_t)imm;
+static int exec_ADDIW(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = ((int32_t)cpu->regs[in->rs1]) + (int32_t)imm;
     return 0;
 }
-static int exec_SLLIW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)(((uint32_t)cpu->regs[rs1(inst)]) << (shamt(inst) % 32));
+static int exec_SLLIW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)(((uint32_t)cpu->regs[in->rs1]) << (shamt(in) % 32));
     return 0;
 }
-static int exec_SRLIW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (uint64_t)(((uint32_t)cpu->regs[rs1(inst)]) >> (shamt(inst) % 32));
+static int exec_SRLIW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (uint64_t)(((uint32_t)cpu->regs[in->rs1]) >> (shamt(in) % 32));
     return 0;
 }
-static int exec_SRAIW(cpu_t *cpu, uint32_t inst) {
-    uint64_t imm = imm_I(inst);
-    cpu->regs[rd(inst)] = (int64_t)(((int32_t)cpu->regs[rs1(inst)]) >> (imm % 32));
+static int exec_SRAIW(cpu_t *cpu, const insn_t *in) {
+    uint64_t imm = in->imm;
+    cpu->regs[in->rd] = (int64_t)(((int32_t)cpu->regs[in->rs1]) >> (imm % 32));
     return 0;
 }
-static int exec_ADDW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)(((int32_t)cpu->regs[rs1(inst)]) + (int32_t)cpu->regs[rs2(inst)]);
+static int exec_ADDW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)(((int32_t)cpu->regs[in->rs1]) + (int32_t)cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SUBW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)(((int32_t)cpu->regs[rs1(inst)]) - (int32_t)cpu->regs[rs2(inst)]);
+static int exec_SUBW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)(((int32_t)cpu->regs[in->rs1]) - (int32_t)cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_SLLW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)((int32_t)(cpu->regs[rs1(inst)] << (cpu->regs[rs2(inst)] % 32)));
+static int exec_SLLW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)((int32_t)(cpu->regs[in->rs1] << (cpu->regs[in->rs2] % 32)));
     return 0;
 }
-static int exec_SRLW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)((int32_t)(((uint32_t)cpu->regs[rs1(inst)]) >> (cpu->regs[rs2(inst)] % 32)));
+static int exec_SRLW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)((int32_t)(((uint32_t)cpu->regs[in->rs1]) >> (cpu->regs[in->rs2] % 32)));
     return 0;
 }
-static int exec_SRAW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)((int32_t)(((int32_t)cpu->regs[rs1(inst)]) >> (cpu->regs[rs2(inst)] % 32)));
+static int exec_SRAW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)((int32_t)(((int32_t)cpu->regs[in->rs1]) >> (cpu->regs[in->rs2] % 32)));
     return 0;
 }
-static int exec_SRA(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)(((int64_t)cpu->regs[rs1(inst)]) >> (cpu->regs[rs2(inst)] % 32));
+static int exec_SRA(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)(((int64_t)cpu->regs[in->rs1]) >> (cpu->regs[in->rs2] % 32));
     return 0;
 }
 //
 // rv64 M extension
 //
-static int exec_DIV(cpu_t *cpu, uint32_t inst) {
-    if (cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = (int64_t)cpu->regs[rs1(inst)] / (int64_t)cpu->regs[rs2(inst)];
+static int exec_DIV(cpu_t *cpu, const insn_t *in) {
+    if ((int64_t)cpu->regs[in->rs2] == -1)
+        cpu->regs[in->rd] = -cpu->regs[in->rs1]; // INT64_MIN / -1 faults on the host, it is INT64_MIN
+    else if (cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = (int64_t)cpu->regs[in->rs1] / (int64_t)cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_DIVU(cpu_t *cpu, uint32_t inst) {
-    if (cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] / cpu->regs[rs2(inst)];
+static int exec_DIVU(cpu_t *cpu, const insn_t *in) {
+    if (cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = cpu->regs[in->rs1] / cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_DIVW(cpu_t *cpu, uint32_t inst) {
-    if ((int32_t)cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = (int32_t)cpu->regs[rs1(inst)] / (int32_t)cpu->regs[rs2(inst)];
+static int exec_DIVW(cpu_t *cpu, const insn_t *in) {
+    if ((int32_t)cpu->regs[in->rs2] == -1)
+        cpu->regs[in->rd] = (int64_t)(int32_t)-(uint32_t)cpu->regs[in->rs1]; // INT32_MIN / -1 faults on the host, it is INT32_MIN
+    else if ((int32_t)cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = (int32_t)cpu->regs[in->rs1] / (int32_t)cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_DIVUW(cpu_t *cpu, uint32_t inst) {
-    if ((uint32_t)cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = (uint32_t)cpu->regs[rs1(inst)] / (uint32_t)cpu->regs[rs2(inst)];
+static int exec_DIVUW(cpu_t *cpu, const insn_t *in) {
+    if ((uint32_t)cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = (uint32_t)cpu->regs[in->rs1] / (uint32_t)cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_MUL(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)cpu->regs[rs1(inst)] * (int64_t)cpu->regs[rs2(inst)];
+static int exec_MUL(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)cpu->regs[in->rs1] * (int64_t)cpu->regs[in->rs2];
     return 0;
 }
-static int exec_MULW(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (int64_t)((int32_t)cpu->regs[rs1(inst)] * (int32_t)cpu->regs[rs2(inst)]);
+static int exec_MULW(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (int64_t)((int32_t)cpu->regs[in->rs1] * (int32_t)cpu->regs[in->rs2]);
     return 0;
 }
-static int exec_MULH(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = (((int128_t)(int64_t)cpu->regs[rs1(inst)]) * ((int128_t)(int64_t)cpu->regs[rs2(inst)])) >> 64;
+static int exec_MULH(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (((int128_t)(int64_t)cpu->regs[in->rs1]) * ((int128_t)(int64_t)cpu->regs[in->rs2])) >> 64;
     return 0;
 }
-static int exec_MULHU(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = ((uint128_t)cpu->regs[rs1(inst)] * (uint128_t)cpu->regs[rs2(inst)]) >> 64;
+static int exec_MULHU(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = ((uint128_t)cpu->regs[in->rs1] * (uint128_t)cpu->regs[in->rs2]) >> 64;
     return 0;
 }
-static int exec_MULHSU(cpu_t *cpu, uint32_t inst) {
-    cpu->regs[rd(inst)] = ((int128_t)(((int128_t)(int64_t)cpu->regs[rs1(inst)]) * (uint128_t)cpu->regs[rs2(inst)])) >> 64;
+static int exec_MULHSU(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = ((int128_t)(((int128_t)(int64_t)cpu->regs[in->rs1]) * (uint128_t)cpu->regs[in->rs2])) >> 64;
     return 0;
 }
-static int exec_REM(cpu_t *cpu, uint32_t inst) {
-    if (cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = (int64_t)cpu->regs[rs1(inst)] % (int64_t)cpu->regs[rs2(inst)];
+static int exec_REM(cpu_t *cpu, const insn_t *in) {
+    if ((int64_t)cpu->regs[in->rs2] == -1)
+        cpu->regs[in->rd] = 0; // INT64_MIN % -1 faults on the host, it is 0
+    else if (cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = (int64_t)cpu->regs[in->rs1] % (int64_t)cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_REMU(cpu_t *cpu, uint32_t inst) {
-    if (cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = cpu->regs[rs1(inst)] % cpu->regs[rs2(inst)];
+static int exec_REMU(cpu_t *cpu, const insn_t *in) {
+    if (cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = cpu->regs[in->rs1] % cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_REMW(cpu_t *cpu, uint32_t inst) {
-    if ((int32_t)cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = (int64_t)((int32_t)cpu->regs[rs1(inst)] % (int32_t)cpu->regs[rs2(inst)]);
+static int exec_REMW(cpu_t *cpu, const insn_t *in) {
+    if ((int32_t)cpu->regs[in->rs2] == -1)
+        cpu->regs[in->rd] = 0; // INT32_MIN % -1 faults on the host, it is 0
+    else if ((int32_t)cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = (int64_t)((int32_t)cpu->regs[in->rs1] % (int32_t)cpu->regs[in->rs2]);
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-static int exec_REMUW(cpu_t *cpu, uint32_t inst) {
-    if ((uint32_t)cpu->regs[rs2(inst)] != 0)
-        cpu->regs[rd(inst)] = (uint32_t)cpu->regs[rs1(inst)] % (uint32_t)cpu->regs[rs2(inst)];
+static int exec_REMUW(cpu_t *cpu, const insn_t *in) {
+    if ((uint32_t)cpu->regs[in->rs2] != 0)
+        cpu->regs[in->rd] = (uint32_t)cpu->regs[in->rs1] % (uint32_t)cpu->regs[in->rs2];
     else
-        cpu->regs[rd(inst)] = -1;
+        cpu->regs[in->rd] = -1;
     return 0;
 }
-int exec_invalid(cpu_t *cpu, uint32_t inst) {
-    INVOP_cb(cpu, inst);
+static int exec_invalid(cpu_t *cpu, const insn_t *in) {
+    cpu->stop_reason = CPU_STOP_INVOP;
+    handle_invop(cpu, in->inst);
     return 1;
 }
+static int exec_CSR(cpu_t *cpu, const insn_t *in) {
+    uint64_t v;
+    if (csr_exec(cpu, in, &v))
+        return exec_invalid(cpu, in);
+    cpu->regs[in->rd] = v;
+    cpu->regs[0] = 0;
+    return 0;
+}
+//
+// rv64 A extension, see librv64i_smp.c
+//
+static int exec_AMO(cpu_t *cpu, const insn_t *in) {
+    uint64_t v;
+    if (amo_exec(cpu, in, cpu->regs[in->rs1], cpu->regs[in->rs2], &v))
+        return exec_invalid(cpu, in);
+    cpu->regs[in->rd] = v;
+    cpu->regs[0] = 0;
+    return 0;
+}
 
-int cpu_execute(cpu_t *cpu, uint32_t inst) {
+static uint8_t decode_op(uint32_t inst) {
     const int opcode = inst & 0x7f;        // opcode in bits 6..0
     const int funct3 = (inst >> 12) & 0x7; // funct3 in bits 14..12
     const int funct7 = (inst >> 25) & 0x7f; // funct7 in bits 31..25
 
-    cpu->regs[0] = 0; // x0 hardwired to 0 at each cycle
-
     switch (opcode) {
     case 0b0000011:
         switch (funct3) {
         case 0b000:
-            return exec_LB(cpu, inst); /* LB           xxxxxxx xxxxxxxxxx 000 xxxxx 0000011 */
+            return OP_LB; /* LB           xxxxxxx xxxxxxxxxx 000 xxxxx 0000011 */
         case 0b001:
-            return exec_LH(cpu, inst); /* LH           xxxxxxx xxxxxxxxxx 001 xxxxx 0000011 */
+            return OP_LH; /* LH           xxxxxxx xxxxxxxxxx 001 xxxxx 0000011 */
         case 0b010:
-            return exec_LW(cpu, inst); /* LW           xxxxxxx xxxxxxxxxx 010 xxxxx 0000011 */
+            return OP_LW; /* LW           xxxxxxx xxxxxxxxxx 010 xxxxx 0000011 */
         case 0b011:
-            return exec_LD(cpu, inst); /* LD           xxxxxxx xxxxxxxxxx 011 xxxxx 0000011 */
+            return OP_LD; /* LD           xxxxxxx xxxxxxxxxx 011 xxxxx 0000011 */
         case 0b100:
-            return exec_LBU(cpu, inst); /* LBU         xxxxxxx xxxxxxxxxx 100 xxxxx 0000011 */
+            return OP_LBU; /* LBU         xxxxxxx xxxxxxxxxx 100 xxxxx 0000011 */
         case 0b101:
-            return exec_LHU(cpu, inst); /* LHU         xxxxxxx xxxxxxxxxx 101 xxxxx 0000011 */
+            return OP_LHU; /* LHU         xxxxxxx xxxxxxxxxx 101 xxxxx 0000011 */
         case 0b110:
-            return exec_LWU(cpu, inst); /* LWU         xxxxxxx xxxxxxxxxx 110 xxxxx 0000011 */
+            return OP_LWU; /* LWU         xxxxxxx xxxxxxxxxx 110 xxxxx 0000011 */
         case 0b111:
-            return exec_invalid(cpu, inst);
-        default: return exec_invalid(cpu, inst);
+            return OP_invalid;
+        default: return OP_invalid;
         }
     case 0b0001111:
-        return exec_FENCE(cpu, inst); /* PAUSE         0000000 1000000000 000 00000 0001111 */
+        if (funct3 == 0b001)
+            return OP_FENCE_I; /* FENCE.I  xxxxxxx xxxxxxxxxx 001 xxxxx 0001111 */
+        return OP_FENCE; /* PAUSE         0000000 1000000000 000 00000 0001111 */
                                       /* FENCE.TSO     1000001 1001100000 000 00000 0001111 */
                                       /* FENCE         xxxxxxx xxxxxxxxxx 000 xxxxx 0001111 */
     case 0b0010011:
         switch (funct3) {
         case 0b000:
-            return exec_ADDI(cpu, inst); /* ADDI       xxxxxxx xxxxxxxxxx 000 xxxxx 0010011 */
+            return OP_ADDI; /* ADDI       xxxxxxx xxxxxxxxxx 000 xxxxx 0010011 */
         case 0b001:
             if (funct7 == 0b0000000)
-            return exec_SLLI(cpu, inst); /* SLLI         0000000 xxxxxxxxxx 001 xxxxx 0010011 */
+            return OP_SLLI; /* SLLI         0000000 xxxxxxxxxx 001 xxxxx 0010011 */
             if (funct7 == 0b0000001)
-            return exec_SLLI_64(cpu, inst); /* SLLI_64      000000x xxxxxxxxxx 001 xxxxx 0010011 */
-            return exec_invalid(cpu, inst);
+            return OP_SLLI_64; /* SLLI_64      000000x xxxxxxxxxx 001 xxxxx 0010011 */
+            return OP_invalid;
         case 0b010:
-            return exec_SLTI(cpu, inst); /* SLTI       xxxxxxx xxxxxxxxxx 010 xxxxx 0010011 */
+            return OP_SLTI; /* SLTI       xxxxxxx xxxxxxxxxx 010 xxxxx 0010011 */
         case 0b011:
-            return exec_SLTIU(cpu, inst); /* SLTIU     xxxxxxx xxxxxxxxxx 011 xxxxx 0010011 */
+            return OP_SLTIU; /* SLTIU     xxxxxxx xxxxxxxxxx 011 xxxxx 0010011 */
         case 0b100:
-            return exec_XORI(cpu, inst); /* XORI       xxxxxxx xxxxxxxxxx 100 xxxxx 0010011 */
+            return OP_XORI; /* XORI       xxxxxxx xxxxxxxxxx 100 xxxxx 0010011 */
         case 0b101:
             if (funct7 == 0b0000000)
-            return exec_SRLI(cpu, inst); /* SRLI       0000000 xxxxxxxxxx 101 xxxxx 0010011 */
+            return OP_SRLI; /* SRLI       0000000 xxxxxxxxxx 101 xxxxx 0010011 */
             if (funct7 == 0b0000001)
-            return exec_SRLI_64(cpu, inst); /* SRLI_64    000000x xxxxxxxxxx 101 xxxxx 0010011 */
+            return OP_SRLI_64; /* SRLI_64    000000x xxxxxxxxxx 101 xxxxx 0010011 */
             if (funct7 == 0b0100000)
-            return exec_SRAI(cpu, inst); /* SRAI       0100000 xxxxxxxxxx 101 xxxxx 0010011 */
+            return OP_SRAI; /* SRAI       0100000 xxxxxxxxxx 101 xxxxx 0010011 */
             if (funct7 == 0b0100001)
-            return exec_SRAI_64(cpu, inst); /* SRAI_64    010000x xxxxxxxxxx 101 xxxxx 0010011 */
-            return exec_invalid(cpu, inst);
+            return OP_SRAI_64; /* SRAI_64    010000x xxxxxxxxxx 101 xxxxx 0010011 */
+            return OP_invalid;
         case 0b110:
-            return exec_ORI(cpu, inst); /* ORI         xxxxxxx xxxxxxxxxx 110 xxxxx 0010011 */
+            return OP_ORI; /* ORI         xxxxxxx xxxxxxxxxx 110 xxxxx 0010011 */
         case 0b111:
-            return exec_ANDI(cpu, inst); /* ANDI       xxxxxxx xxxxxxxxxx 111 xxxxx 0010011 */
-        default: return exec_invalid(cpu, inst);
+            return OP_ANDI; /* ANDI       xxxxxxx xxxxxxxxxx 111 xxxxx 0010011 */
+        default: return OP_invalid;
         }
     case 0b0010111:
-        return exec_AUIPC(cpu, inst); /* AUIPC         xxxxxxx xxxxxxxxxx xxx xxxxx 0010111 */
+        return OP_AUIPC; /* AUIPC         xxxxxxx xxxxxxxxxx xxx xxxxx 0010111 */
     case 0b0011011:
         switch (funct3) {
         case 0b000:
-            return exec_ADDIW(cpu, inst); /* ADDIW     xxxxxxx xxxxxxxxxx 000 xxxxx 0011011 */
+            return OP_ADDIW; /* ADDIW     xxxxxxx xxxxxxxxxx 000 xxxxx 0011011 */
         case 0b001:
-            return exec_SLLIW(cpu, inst); /* SLLIW     0000000 xxxxxxxxxx 001 xxxxx 0011011 */
+            return OP_SLLIW; /* SLLIW     0000000 xxxxxxxxxx 001 xxxxx 0011011 */
         case 0b010:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b011:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b100:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b101:
             if (funct7 == 0b0000000)
-            return exec_SRLIW(cpu, inst); /* SRLIW     0000000 xxxxxxxxxx 101 xxxxx 0011011 */
+            return OP_SRLIW; /* SRLIW     0000000 xxxxxxxxxx 101 xxxxx 0011011 */
             if (funct7 == 0b0100000)
-            return exec_SRAIW(cpu, inst); /* SRAIW     0100000 xxxxxxxxxx 101 xxxxx 0011011 */
-            return exec_invalid(cpu, inst);
+            return OP_SRAIW; /* SRAIW     0100000 xxxxxxxxxx 101 xxxxx 0011011 */
+            return OP_invalid;
         case 0b110:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b111:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         }
     case 0b0100011:
         switch (funct3) {
         case 0b000:
-            return exec_SB(cpu, inst); /* SB           xxxxxxx xxxxxxxxxx 000 xxxxx 0100011 */
+            return OP_SB; /* SB           xxxxxxx xxxxxxxxxx 000 xxxxx 0100011 */
         case 0b001:
-            return exec_SH(cpu, inst); /* SH           xxxxxxx xxxxxxxxxx 001 xxxxx 0100011 */
+            return OP_SH; /* SH           xxxxxxx xxxxxxxxxx 001 xxxxx 0100011 */
         case 0b010:
-            return exec_SW(cpu, inst); /* SW           xxxxxxx xxxxxxxxxx 010 xxxxx 0100011 */
+            return OP_SW; /* SW           xxxxxxx xxxxxxxxxx 010 xxxxx 0100011 */
         case 0b011:
-            return exec_SD(cpu, inst); /* SD           xxxxxxx xxxxxxxxxx 011 xxxxx 0100011 */
+            return OP_SD; /* SD           xxxxxxx xxxxxxxxxx 011 xxxxx 0100011 */
         case 0b100:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b101:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b110:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b111:
-            return exec_invalid(cpu, inst);
-        default: return exec_invalid(cpu, inst);
+            return OP_invalid;
+        default: return OP_invalid;
         }
     case 0b0110011:
         switch (funct3) {
         case 0b000:
             if (funct7 == 0b0000000)
-            return exec_ADD(cpu, inst); /* ADD          0000000 xxxxxxxxxx 000 xxxxx 0110011 */
+            return OP_ADD; /* ADD          0000000 xxxxxxxxxx 000 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_MUL(cpu, inst); /* MUL         0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_MUL; /* MUL         0000001 xxxxxxxxxx 101 xxxxx 0110011 */
             if (funct7 == 0b0100000)
-            return exec_SUB(cpu, inst); /* SUB          0100000 xxxxxxxxxx 000 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_SUB; /* SUB          0100000 xxxxxxxxxx 000 xxxxx 0110011 */
+            return OP_invalid;
         case 0b001:
             if (funct7 == 0b0000000)
-            return exec_SLL(cpu, inst); /* SLL         0000000 xxxxxxxxxx 001 xxxxx 0110011 */
+            return OP_SLL; /* SLL         0000000 xxxxxxxxxx 001 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_MULH(cpu, inst); /* MULH        0000001 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_MULH; /* MULH        0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         case 0b010:
             if (funct7 == 0b0000000)
-            return exec_SLT(cpu, inst); /* SLT         0000000 xxxxxxxxxx 010 xxxxx 0110011 */
+            return OP_SLT; /* SLT         0000000 xxxxxxxxxx 010 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_MULHSU(cpu, inst); /* MULHSU      0000001 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_MULHSU; /* MULHSU      0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         case 0b011:
             if (funct7 == 0b0000000)
-            return exec_SLTU(cpu, inst); /* SLTU       0000000 xxxxxxxxxx 011 xxxxx 0110011 */
+            return OP_SLTU; /* SLTU       0000000 xxxxxxxxxx 011 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_MULHU(cpu, inst); /* MULHU       0000001 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_MULHU; /* MULHU       0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         case 0b100:
             if (funct7 == 0b0000000)
-            return exec_XOR(cpu, inst); /* XOR         0000000 xxxxxxxxxx 100 xxxxx 0110011 */
+            return OP_XOR; /* XOR         0000000 xxxxxxxxxx 100 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_DIV(cpu, inst); /* DIV         0000001 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_DIV; /* DIV         0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         case 0b101:
             if (funct7 == 0b0000000)
-            return exec_SRL(cpu, inst); /* SRL         0000000 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_SRL; /* SRL         0000000 xxxxxxxxxx 101 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_DIVU(cpu, inst); /* DIVU        0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_DIVU; /* DIVU        0000001 xxxxxxxxxx 101 xxxxx 0110011 */
             if (funct7 == 0b0100000)
-            return exec_SRA(cpu, inst); /* SRA         0100000 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_SRA; /* SRA         0100000 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         case 0b110:
             if (funct7 == 0b0000000)
-            return exec_OR(cpu, inst); /* OR           0000000 xxxxxxxxxx 110 xxxxx 0110011 */
+            return OP_OR; /* OR           0000000 xxxxxxxxxx 110 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_REM(cpu, inst); /* REM          0000001 xxxxxxxxxx 110 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_REM; /* REM          0000001 xxxxxxxxxx 110 xxxxx 0110011 */
+            return OP_invalid;
         case 0b111:
             if (funct7 == 0b0000000)
-            return exec_AND(cpu, inst); /* AND         0000000 xxxxxxxxxx 111 xxxxx 0110011 */
+            return OP_AND; /* AND         0000000 xxxxxxxxxx 111 xxxxx 0110011 */
             if (funct7 == 0b0000001)
-            return exec_REMU(cpu, inst); /* MULHU      0000001 xxxxxxxxxx 111 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_REMU; /* MULHU      0000001 xxxxxxxxxx 111 xxxxx 0110011 */
+            return OP_invalid;
         }
     case 0b0110111:
-        return exec_LUI(cpu, inst); /* LUI             xxxxxxx xxxxxxxxxx xxx xxxxx 0110111 */
+        return OP_LUI; /* LUI             xxxxxxx xxxxxxxxxx xxx xxxxx 0110111 */
     case 0b0111011:
         switch (funct3) {
         case 0b000:
             if (funct7 == 0b0000000)
-            return exec_ADDW(cpu, inst); /* ADDW         0000000 xxxxxxxxxx 000 xxxxx 0111011 */
+            return OP_ADDW; /* ADDW         0000000 xxxxxxxxxx 000 xxxxx 0111011 */
             if (funct7 == 0b0000001)
-            return exec_MULW(cpu, inst); /* MULW         0000001 xxxxxxxxxx 000 xxxxx 0111011 */
+            return OP_MULW; /* MULW         0000001 xxxxxxxxxx 000 xxxxx 0111011 */
             if (funct7 == 0b0100000)
-            return exec_SUBW(cpu, inst); /* SUBW         0100000 xxxxxxxxxx 000 xxxxx 0111011 */
-            return exec_invalid(cpu, inst);
+            return OP_SUBW; /* SUBW         0100000 xxxxxxxxxx 000 xxxxx 0111011 */
+            return OP_invalid;
         case 0b001:
-            return exec_SLLW(cpu, inst); /* SLLW         0000000 xxxxxxxxxx 001 xxxxx 0111011 */
+            return OP_SLLW; /* SLLW         0000000 xxxxxxxxxx 001 xxxxx 0111011 */
         case 0b010:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b011:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b100:
             if (funct7 == 0b0000001)
-            return exec_DIVW(cpu, inst); /* DIVW        0000001 xxxxxxxxxx 100 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_DIVW; /* DIVW        0000001 xxxxxxxxxx 100 xxxxx 0110011 */
+            return OP_invalid;
         case 0b101:
             if (funct7 == 0b0000000)
-            return exec_SRLW(cpu, inst); /* SRLW         0000000 xxxxxxxxxx 101 xxxxx 0111011 */
+            return OP_SRLW; /* SRLW         0000000 xxxxxxxxxx 101 xxxxx 0111011 */
             if (funct7 == 0b0000001)
-            return exec_DIVUW(cpu, inst); /* DIVUW       0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_DIVUW; /* DIVUW       0000001 xxxxxxxxxx 101 xxxxx 0110011 */
             if (funct7 == 0b0100000)
-            return exec_SRAW(cpu, inst); /* SRAW         0100000 xxxxxxxxxx 101 xxxxx 0111011 */
-            return exec_invalid(cpu, inst);
+            return OP_SRAW; /* SRAW         0100000 xxxxxxxxxx 101 xxxxx 0111011 */
+            return OP_invalid;
         case 0b110:
             if (funct7 == 0b0000001)
-            return exec_REMW(cpu, inst); /* REMW        0000001 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_REMW; /* REMW        0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         case 0b111:
             if (funct7 == 0b0000001)
-            return exec_REMUW(cpu, inst); /* REMUW       0000001 xxxxxxxxxx 101 xxxxx 0110011 */
-            return exec_invalid(cpu, inst);
+            return OP_REMUW; /* REMUW       0000001 xxxxxxxxxx 101 xxxxx 0110011 */
+            return OP_invalid;
         }
     case 0b1100011:
         switch (funct3) {
         case 0b000:
-            return exec_BEQ(cpu, inst); /* BEQ         xxxxxxx xxxxxxxxxx 000 xxxxx 1100011 */
+            return OP_BEQ; /* BEQ         xxxxxxx xxxxxxxxxx 000 xxxxx 1100011 */
         case 0b001:
-            return exec_BNE(cpu, inst); /* BNE         xxxxxxx xxxxxxxxxx 001 xxxxx 1100011 */
+            return OP_BNE; /* BNE         xxxxxxx xxxxxxxxxx 001 xxxxx 1100011 */
         case 0b010:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b011:
-            return exec_invalid(cpu, inst);
+            return OP_invalid;
         case 0b100:
-            return exec_BLT(cpu, inst); /* BLT         xxxxxxx xxxxxxxxxx 100 xxxxx 1100011 */
+            return OP_BLT; /* BLT         xxxxxxx xxxxxxxxxx 100 xxxxx 1100011 */
         case 0b101:
-            return exec_BGE(cpu, inst); /* BGE         xxxxxxx xxxxxxxxxx 101 xxxxx 1100011 */
+            return OP_BGE; /* BGE         xxxxxxx xxxxxxxxxx 101 xxxxx 1100011 */
         case 0b110:
-            return exec_BLTU(cpu, inst); /* BLTU       xxxxxxx xxxxxxxxxx 110 xxxxx 1100011 */
+            return OP_BLTU; /* BLTU       xxxxxxx xxxxxxxxxx 110 xxxxx 1100011 */
         case 0b111:
-            return exec_BGEU(cpu, inst); /* BGEU       xxxxxxx xxxxxxxxxx 111 xxxxx 1100011 */
-        default: return exec_invalid(cpu, inst);
+            return OP_BGEU; /* BGEU       xxxxxxx xxxxxxxxxx 111 xxxxx 1100011 */
+        default: return OP_invalid;
         }
     case 0b1100111:
-        return exec_JALR(cpu, inst); /* JALR           xxxxxxx xxxxxxxxxx 000 xxxxx 1100111 */
+        return OP_JALR; /* JALR           xxxxxxx xxxxxxxxxx 000 xxxxx 1100111 */
     case 0b1101111:
-        return exec_JAL(cpu, inst); /* JAL             xxxxxxx xxxxxxxxxx xxx xxxxx 1101111 */
+        return OP_JAL; /* JAL             xxxxxxx xxxxxxxxxx xxx xxxxx 1101111 */
+    case 0b0101111:
+        return OP_AMO; /* LR, SC, AMO*   xxxxxxx xxxxxxxxxx 01x xxxxx 0101111 */
     case 0b1110011:
-        return exec_ECALL_EBREAK(cpu, inst); /* ECALL  0000000 0000000000 000 00000 1110011 */
+        if (funct3 != 0b000)
+            return OP_CSR; /* CSRR*      xxxxxxx xxxxxxxxxx xxx xxxxx 1110011 */
+        return OP_ECALL_EBREAK; /* ECALL  0000000 0000000000 000 00000 1110011 */
                                              /* EBREAK 0000000 0000100000 000 00000 1110011 */
-    default: return exec_invalid(cpu, inst);
+    default: return OP_invalid;
     }
-    return 1;
+    return OP_invalid;
+}
+
+const exec_fn rv_exec_table[OP_COUNT] = {
+#define EXEC_ENTRY(name) exec_##name,
+    RV_OPS(EXEC_ENTRY)
+#undef EXEC_ENTRY
+};
+
+void rv_decode(uint32_t inst, insn_t *in) {
+    in->inst = inst;
+    in->rd = rd(inst);
+    in->rs1 = rs1(inst);
+    in->rs2 = rs2(inst);
+    switch (inst & 0x7f) {
+    case 0b0100011: in->imm = imm_S(inst); break;                                      // stores
+    case 0b1100011: in->imm = imm_B(inst); break;                                      // branches
+    case 0b0010111: in->imm = imm_U(inst); break;                                      // AUIPC
+    case 0b0110111: in->imm = (uint64_t)(int64_t)(int32_t)(inst & 0xfffff000); break; // LUI
+    case 0b1101111: in->imm = imm_J(inst); break;                                      // JAL
+    default: in->imm = imm_I(inst); break;
+    }
+    in->op = decode_op(inst);
+    // arithmetic has no effect besides rd, so with rd == x0 it has none at all. x0 then stays 0
+    // without being reset before each instruction. loads stay, the access is visible as soon as
+    // the bus has more than dram behind it, they and the other handlers given x0 (the jumps, CSR
+    // and AMO) put the 0 back themselves
+    if (in->rd == 0 && in->op != OP_invalid) {
+        switch (inst & 0x7f) {
+        case 0b0010011: // OP-IMM
+        case 0b0010111: // AUIPC
+        case 0b0011011: // OP-IMM-32
+        case 0b0110011: // OP
+        case 0b0110111: // LUI
+        case 0b0111011: in->op = OP_NOP; break; // OP-32
+        }
+    }
+    in->fn = rv_exec_table[in->op];
+}
+
+int cpu_execute(cpu_t *cpu, uint32_t inst) {
+    insn_t in;
+    rv_decode(inst, &in);
+    return in.fn(cpu, &in);
+}
+
+int cpu_step(cpu_t *cpu) {
+    icache_entry_t *e = &cpu->icache[(cpu->pc >> 2) & (ICACHE_SIZE - 1)];
+    if (e->pc == cpu->pc) {
+        cpu->stats.icache_hits++;
+    } else {
+        cpu->stats.icache_misses++;
+        code_mark(cpu, cpu->pc);
+        e->pc = cpu->pc;
+        rv_decode(bus_fetch(&(cpu->bus), cpu->pc), &e->in);
+    }
+    cpu->stats.instret++;
+    cpu->pc += 4;
+    return e->in.fn(cpu, &e->in);
+}
+
+void cpu_icache_flush(cpu_t *cpu) {
+    for (int i = 0; i < ICACHE_SIZE; i++)
+        cpu->icache[i].pc = 1;
+    block_cache_flush(cpu);
+    if (cpu->code)
+        code_clear(cpu);
+}
+
+void cpu_stats_get(cpu_t *cpu, cpu_stats_t *stats) { *stats = cpu->stats; }
+
+uint64_t dram_page_size(void) { return sysconf(_SC_PAGESIZE); }
+
+int dram_resident(const dram_t *dram, uint64_t page, uint64_t n, unsigned char *vec) {
+#if defined(__linux__)
+    uint64_t size = dram_page_size();
+    return mincore(dram->mem + page * size, n * size, vec);
+#else
+    return -1;
+#endif
+}
+
+uint64_t cpu_dram_resident(cpu_t *cpu) {
+    uint64_t size = dram_page_size();
+    uint64_t pages = (cpu->bus.dram.size + size - 1) / size;
+    uint64_t resident = 0;
+    unsigned char vec[256];
+    for (uint64_t i = 0; i < pages; i += sizeof(vec)) {
+        uint64_t n = pages - i < sizeof(vec) ? pages - i : sizeof(vec);
+        if (dram_resident(&cpu->bus.dram, i, n, vec))
+            return cpu->bus.dram.size;
+        for (uint64_t k = 0; k < n; k++)
+            resident += vec[k] & 1;
+    }
+    return resident * size;
+}
+
+void cpu_stats_reset(cpu_t *cpu) {
+    cpu->stats = (cpu_stats_t){0};
+    mmio_reset(&cpu->bus);
+}
+
+void cpu_stop(cpu_t *cpu) {
+    cpu->stop = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // pairs with the one in cpu_run
+    __atomic_store_n(&cpu->limit, 0, __ATOMIC_RELAXED); // the engines only compare against the limit in their inner loops
+}
+
+cpu_result_t cpu_run(cpu_t *cpu, uint64_t max_instructions) {
+    uint64_t start = cpu->stats.instret;
+    int ret = 0;
+
+    cpu->regs[0] = 0; // the engines never reset it themselves, in case the caller filled regs[] wholesale
+    __atomic_store_n(&cpu->limit, max_instructions > UINT64_MAX - start ? UINT64_MAX : start + max_instructions, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // a cpu_stop from another thread either sees the new limit or we see its flag
+    if (!cpu->stop) {
+        switch (cpu->engine) {
+        case CPU_ENGINE_THREADED: ret = cpu_run_threaded(cpu); break;
+        case CPU_ENGINE_BLOCK:
+        case CPU_ENGINE_JIT: ret = cpu_run_block(cpu); break;
+        case CPU_ENGINE_STEP:
+        default:
+            while (!ret && cpu->stats.instret < run_limit(cpu))
+                ret = cpu_step(cpu);
+            break;
+        }
+    }
+
+    cpu_result_t r = {.stop = CPU_STOP_LIMIT, .ret = ret, .instret = cpu->stats.instret - start};
+    if (ret) {
+        r.stop = cpu->stop_reason;
+    } else if (cpu->stop) {
+        r.stop = CPU_STOP_REQUEST;
+        cpu->stop = 0;
+    }
+    return r;
 }
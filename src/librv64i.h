@@ -3,33 +3,318 @@
 
 #include <stdint.h>
 
-// 1 MiB DRAM
+// default dram, 1 MiB at address 0. see cpu_config_t.dram_base and dram_size
 #define DRAM_SIZE 1024 * 1024 * 1
 #define DRAM_BASE 0x00000000
 
 typedef struct dram_t {
-    uint8_t mem[DRAM_SIZE];
+    uint8_t *mem;  // size bytes, allocated by cpu_init_config. host pages are backed on first touch
+    uint64_t base; // guest address of mem[0]
+    uint64_t size;
 } dram_t;
 
 typedef struct bus_t {
     struct dram_t dram;
+    int guard;           // mem is the start of a guard page reservation, see cpu_config_t.guard
+    struct mmio_t *mmio; // devices from cpu_device_add, NULL without
 } bus_t;
 
+// devices a cpu can have, see cpu_device_add
+#define CPU_MAX_DEVICES 255
+
+// decoded instruction cache, direct mapped on the pc
+#define ICACHE_SIZE 8192
+
+struct cpu_t;
+struct insn_t;
+typedef int (*exec_fn)(struct cpu_t *cpu, const struct insn_t *in);
+
+// an instruction with its operands extracted once by the decoder
+typedef struct insn_t {
+    exec_fn fn;    // handler selected by the decoder
+    uint64_t imm;  // sign extended immediate of the instruction format
+    uint32_t inst; // raw encoding, handed to cpu_handlers_t
+    uint8_t op;    // OP_ index, used by engines that do not call fn
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+} insn_t;
+
+typedef struct icache_entry_t {
+    uint64_t pc; // tag, odd value marks an empty slot
+    insn_t in;
+} icache_entry_t;
+
+// instruction pairs the block translator executes as one micro op
+typedef enum cpu_fuse_t {
+    CPU_FUSE_LUI_ADDI,   // LUI + ADDI/ADDIW, constant
+    CPU_FUSE_AUIPC_JALR, // far call or jump
+    CPU_FUSE_AUIPC_ADDR, // AUIPC + ADDI/LD/LW/LWU, pc relative address
+    CPU_FUSE_SLLI_SRLI,  // zero extension
+    CPU_FUSE_CMP_BRANCH, // SLT/SLTU/SLTI/SLTIU + BEQ/BNE against x0
+    CPU_FUSE_COUNT,
+} cpu_fuse_t;
+
+typedef struct cpu_stats_t {
+    uint64_t instret;           // instructions executed
+    uint64_t icache_hits;       // cpu_step found the decoded instruction
+    uint64_t icache_misses;     // cpu_step had to fetch and decode
+    uint64_t blocks_translated; // basic blocks decoded into micro ops
+    uint64_t block_lookups;     // block entered through the hash table
+    uint64_t block_chained;     // block entered through a patched link of its predecessor
+    uint64_t traces_compiled;   // hot loops compiled as one trace by CPU_ENGINE_JIT
+    uint64_t fused[CPU_FUSE_COUNT]; // fused pairs executed, by pattern
+    uint64_t jalr_inline;       // JALR target was the last one of its site
+    uint64_t jalr_ras;          // return target came from the return address stack
+    uint64_t jalr_table;        // JALR target found in the indirect branch target table
+    uint64_t jalr_lookups;      // JALR target needed a full block lookup
+    uint64_t guard_faults;      // accesses outside dram caught by the guard pages
+    uint64_t pages_restored;    // dram pages cpu_restore copied back
+    uint64_t code_invalidated;  // dram pages whose decoded or translated code was dropped after a store to them
+} cpu_stats_t;
+
+// counters of one JALR instruction, see cpu_jalr_sites
+typedef struct cpu_jalr_site_t {
+    uint64_t pc;
+    uint64_t hits;   // target found in the inline cache, return address stack or table
+    uint64_t misses; // full block lookup
+} cpu_jalr_site_t;
+
+// a memory mapped device for cpu_device_add. read and write get the offset of the access into
+// the region and its size in bytes, 1, 2, 4 or 8. without read loads return 0, without write
+// stores are dropped
+typedef struct cpu_device_t {
+    uint64_t base; // guest address
+    uint64_t size;
+    uint64_t (*read)(void *ctx, uint64_t off, int size);
+    void (*write)(void *ctx, uint64_t off, int size, uint64_t value);
+    void *ctx;
+} cpu_device_t;
+
+// accesses of one device, see cpu_device_stats
+typedef struct cpu_device_stats_t {
+    uint64_t reads;
+    uint64_t writes;
+} cpu_device_stats_t;
+
+typedef enum cpu_engine_t {
+    CPU_ENGINE_STEP,     // cpu_step in a loop, one call through the handler table per instruction
+    CPU_ENGINE_THREADED, // direct threaded dispatch with the registers held in locals
+    CPU_ENGINE_BLOCK,    // translated basic blocks, chained to their successors
+    CPU_ENGINE_JIT,      // CPU_ENGINE_BLOCK with hot blocks compiled to native code, x86-64 hosts only
+} cpu_engine_t;
+
+// why cpu_run returned
+typedef enum cpu_stop_t {
+    CPU_STOP_LIMIT,   // max_instructions retired
+    CPU_STOP_ECALL,   // the ecall handler returned non zero
+    CPU_STOP_EBREAK,  // the ebreak handler returned non zero
+    CPU_STOP_INVOP,   // invalid instruction, after the invop handler
+    CPU_STOP_REQUEST, // cpu_stop was called
+    CPU_STOP_ERROR,   // the engine could not allocate memory
+} cpu_stop_t;
+
+typedef struct cpu_result_t {
+    cpu_stop_t stop;
+    int ret;          // value returned by the handler that stopped the cpu
+    uint64_t instret; // instructions retired by this cpu_run
+} cpu_result_t;
+
+// a function, object or label of the image from cpu_load_elf
+typedef struct cpu_symbol_t {
+    uint64_t addr;
+    uint64_t size; // 0 for labels, they cover everything up to the next symbol
+    const char *name;
+} cpu_symbol_t;
+
+// what the ECALL, EBREAK and invalid instructions of a cpu call, each with ctx. ecall and ebreak
+// return non zero to make cpu_run return, without one the cpu stops there. invop may be NULL.
+// every cpu has its own, so guests with different ones can run side by side
+typedef struct cpu_handlers_t {
+    int (*ecall)(void *ctx, struct cpu_t *cpu, uint32_t inst);
+    int (*ebreak)(void *ctx, struct cpu_t *cpu, uint32_t inst);
+    int (*invop)(void *ctx, struct cpu_t *cpu, uint32_t inst);
+    void *ctx;
+} cpu_handlers_t;
+
+typedef struct cpu_config_t {
+    cpu_engine_t engine; // used by cpu_run
+    uint64_t dram_base;  // guest address of dram, DRAM_BASE is 0 like a zeroed config
+    uint64_t dram_size;  // bytes of dram, 0 selects DRAM_SIZE. only the pages the guest touches cost host memory
+    // reserve 4 GiB of host address space for dram, of which dram_size is backed. loads and stores
+    // then skip the range check: the low 32 bits of the address select the byte, and an access
+    // outside dram faults on the host and is turned into a load of 0 or a dropped store. an access
+    // that straddles the end of dram reads or writes the part inside. linux x86-64 and a dram_size of
+    // whole pages up to 4 GiB only, ignored otherwise.
+    // the guard pages, the dirty pages of cpu_snapshot and the code pages of FENCE.I are caught by
+    // SIGSEGV and SIGTRAP handlers of the whole process, installed when the first cpu needs them.
+    // they pass the signals that are not about the dram of a cpu on to the handlers installed before.
+    // a handler the program installs later has to do the same, or the first store to a protected
+    // page kills the process. without guard and cpu_snapshot nothing is installed or protected, and
+    // FENCE.I drops all decoded code. the handlers know 4096 cpus at a time, a cpu after that runs
+    // as if the host had no support for them. they are the only state the library keeps outside cpu_t
+    int guard;
+    cpu_handlers_t handlers;
+} cpu_config_t;
+
 typedef struct cpu_t {
     uint64_t regs[32]; // 32 64-bit registers (x0-x31)
     uint64_t pc;       // 64-bit program counter
     struct bus_t bus;  // cpu_t connected to bus_t
+    icache_entry_t *icache; // ICACHE_SIZE entries, mapped copy on write from the template for cpu_init_template
+    cpu_stats_t stats;
+    cpu_engine_t engine;
+    struct block_cache_t *blocks; // translated basic blocks, allocated on first use
+    struct aot_t *aot;            // native code from cpu_aot_load
+    struct symtab_t *symtab;      // symbols of the image from cpu_load_elf
+    struct snapshot_t *snap;      // from cpu_snapshot
+    struct cpu_template_t *tmpl;  // from cpu_init_template
+    struct codemap_t *code;       // pages with decoded or translated code, see FENCE.I
+    struct cpu_t *owner;          // the cpu whose dram and devices a hart of cpu_init_hart shares, NULL for that one
+    uint64_t hartid;              // mhartid
+    uint64_t lr_addr;             // address reserved by LR, odd without a reservation
+    uint64_t lr_value;            // what LR loaded, SC only stores if dram still holds it
+    uint64_t limit;               // cpu_run returns before stats.instret goes past it, atomic, cpu_stop sets it to 0
+    volatile int stop;            // set by cpu_stop, cleared when cpu_run returns CPU_STOP_REQUEST
+    cpu_stop_t stop_reason;       // set by the instruction that returned non zero
+    cpu_handlers_t handlers;      // from cpu_config_t.handlers or cpu_set_handlers
 } cpu_t;
 
 uint64_t dram_load(dram_t *dram, uint64_t addr, uint64_t size);
 void dram_store(dram_t *dram, uint64_t addr, uint64_t size, uint64_t value);
 uint64_t dram_load_bin(dram_t *dram, uint64_t addr, void *data, uint64_t datalen);
 
-void cpu_init(struct cpu_t *cpu);
+// allocate dram and reset the cpu, returns -1 when dram could not be allocated. cpu_init has no handlers
+int cpu_init(struct cpu_t *cpu);
+int cpu_init_config(struct cpu_t *cpu, const cpu_config_t *config);
+// replace the handlers, not while cpu_run runs the cpu
+void cpu_set_handlers(struct cpu_t *cpu, const cpu_handlers_t *handlers);
+// release dram and what the engines allocated, the cpu_t itself is owned by the caller
+void cpu_free(struct cpu_t *cpu);
+// put the file at path into dram at guest address addr. a regular file at a page aligned address
+// is mapped copy on write instead of read, so only the pages the guest uses are read from disk and
+// cpus running the same image share them in the page cache. returns -1 if it does not fit in dram
+int cpu_load_image(struct cpu_t *cpu, const char *path, uint64_t addr);
+// load an ELF64 RISC-V executable. the PT_LOAD segments go to their addresses, mapped like
+// cpu_load_image where the file layout allows, bss is zeroed on the host, the pc is set to
+// e_entry and a0 to 1, which tells the startup code that bss is clear. the symbol table is kept
+// for cpu_symbol_find. returns -1 if the file is no such executable or a segment is outside dram
+int cpu_load_elf(struct cpu_t *cpu, const char *path);
+// the symbol of the cpu_load_elf image that addr is in, NULL if there is none
+const cpu_symbol_t *cpu_symbol_find(struct cpu_t *cpu, uint64_t addr);
 uint32_t cpu_fetch(struct cpu_t *cpu);
 int cpu_execute(struct cpu_t *cpu, uint32_t inst);
+int cpu_step(struct cpu_t *cpu);
+// execute with the configured engine until max_instructions are retired, a handler returns
+// non zero or cpu_stop is called. can be called again to continue where it stopped
+cpu_result_t cpu_run(struct cpu_t *cpu, uint64_t max_instructions);
+// make cpu_run return CPU_STOP_REQUEST, from a handler or another thread. the engines
+// notice it at the next block boundary or taken branch
+void cpu_stop(struct cpu_t *cpu);
+
+// remember registers, pc and dram for cpu_restore, replacing an earlier snapshot. load the image
+// before, dram is write protected from here on and the first store to each page is caught once
+// (x86-64 linux, elsewhere cpu_restore copies all of dram). returns -1 when out of memory
+int cpu_snapshot(struct cpu_t *cpu);
+// go back to the snapshot, copying only the dram pages stored to since the snapshot or the last
+// restore. translated code is kept except for the code pages stored to, see FENCE.I, and all of it goes where
+// stores are not tracked (harts, other hosts). -1 without a snapshot
+int cpu_restore(struct cpu_t *cpu);
+// write registers, pc and the non zero pages of dram to a snapshot file
+int cpu_snapshot_write(struct cpu_t *cpu, const char *path);
+// the dram_base and dram_size a snapshot file was written with, for the config of the cpu to load it into
+int cpu_snapshot_config(const char *path, cpu_config_t *config);
+// continue from a snapshot file: registers and pc are set, its pages are mapped copy on write into
+// dram and the rest of dram is zeroed. drops the cpu_snapshot. -1 if the dram layout differs
+int cpu_snapshot_load(struct cpu_t *cpu, const char *path);
+
+// templates for running many cpus of the same image. cpu_template_new takes registers, pc and dram
+// of a loaded (or already warmed up) cpu, its decoded instructions and its cpu_aot_load translation.
+// cpus started from it with cpu_init_template share the dram pages until they store to them, the
+// decoded instructions page by page until they miss in the icache, and the translated code. so an
+// instance costs the pages it writes, not the image. code it modifies needs FENCE.I. the cpu the template was
+// taken from stays usable, the template lives until it and all its cpus are freed
+typedef struct cpu_template_t cpu_template_t;
+cpu_template_t *cpu_template_new(struct cpu_t *cpu);
+void cpu_template_free(cpu_template_t *t);
+// like cpu_init_config with the engine, dram layout and handlers of the template's cpu, starting where it was
+int cpu_init_template(struct cpu_t *cpu, cpu_template_t *t);
+
+// harts: more cpus on the dram and devices of cpu, for guests that run one thread of their own
+// on each. the hart starts with the registers and pc of cpu and mhartid set to hartid, so startup
+// code can give each hart its own stack. it has its own engine state, starts with the handlers
+// of cpu and shares its cpu_aot_load translation. cpu_snapshot of a hart copies all of dram back. cpu is freed last
+int cpu_init_hart(struct cpu_t *hart, struct cpu_t *cpu, uint64_t hartid);
+// run the n cpus (harts of one cpu) at the same time on a host thread each, cpus[0] on the calling
+// one, until all of them returned. results[i] is what cpu_run(cpus[i], max_instructions) returned,
+// a handler that stops the guest calls cpu_stop for the other harts. -1 if a thread could not start
+int cpu_run_harts(struct cpu_t **cpus, int n, uint64_t max_instructions, cpu_result_t *results);
+// deterministic harts: the n cpus take turns on the calling thread in the order of cpus, each
+// running quantum instructions per turn, until all of them stopped. the same image and inputs
+// always give the same interleaving, a smaller quantum interleaves finer at the cost of more
+// switches. results[i] is how cpus[i] stopped, instret what it retired over all its turns. -1 if
+// quantum is 0 or out of memory
+int cpu_run_harts_quantum(struct cpu_t **cpus, int n, uint64_t max_instructions, uint64_t quantum, cpu_result_t *results);
+
+// lock step: the n cpus run in groups of CPU_LANES on the calling thread, each group as one
+// instruction stream with the registers of its cpus side by side in host vectors, until each of
+// them stopped or retired max_instructions. for many guests of one image on different inputs:
+// the cpus need the same code at the same addresses (from one template, say) and must not
+// modify it or wait for each other. where they branch apart the group runs the lanes at the
+// lowest pc first and joins the others when it gets to theirs. results[i] is how cpus[i]
+// stopped, as from cpu_run. -1 if n < 1
+#define CPU_LANES 8
+int cpu_run_lanes(struct cpu_t **cpus, int n, uint64_t max_instructions, cpu_result_t *results);
+
+// scheduler for batches of guests: jobs (independent cpus, or harts) run on a pool of worker
+// threads in slices of quantum instructions. every worker has a deque of jobs, it runs the newest
+// of its own and steals the oldest of another one when it has none left. a job ends when its cpu
+// stops for another reason than the slice, or after max_instructions. an ecall handler returning
+// CPU_SCHED_WAIT gives the worker up for a blocking host call: the job waits, pc past the ecall,
+// until cpu_sched_wake puts it back, from any thread
+#define CPU_SCHED_WAIT 0x7fffffff
+typedef struct cpu_sched_t cpu_sched_t;
+typedef struct cpu_job_stats_t {
+    uint64_t instret;    // instructions retired over all slices
+    uint64_t run_ns;     // wall time spent in cpu_run
+    uint64_t slices;     // cpu_run calls
+    uint64_t migrations; // slices on another worker than the one before
+} cpu_job_stats_t;
+// workers threads, the number of online cores when 0. NULL if quantum is 0 or out of memory
+cpu_sched_t *cpu_sched_new(int workers, uint64_t quantum);
+// add a job before cpu_sched_run, returns its number or -1 when out of memory
+int cpu_sched_add(cpu_sched_t *s, struct cpu_t *cpu, uint64_t max_instructions);
+// run all jobs until they ended, on the calling thread and workers - 1 more. -1 if out of memory
+int cpu_sched_run(cpu_sched_t *s);
+// continue job after its ecall handler returned CPU_SCHED_WAIT, a0 and the like set by the host
+void cpu_sched_wake(cpu_sched_t *s, int job);
+// how job ended, and what it cost. -1 if there is no such job
+int cpu_sched_result(cpu_sched_t *s, int job, cpu_result_t *result, cpu_job_stats_t *stats);
+void cpu_sched_free(cpu_sched_t *s);
+
+// map a device into the guest address space. devices own the 4 KiB pages they touch, two of them
+// can not share a page and none can overlap dram. loads and stores that miss dram go to the device
+// of their page, in O(1), an access that is not entirely inside that device reads 0 or is dropped.
+// instructions are never fetched from a device, a load into x0 reaches it and only drops the value.
+// returns the device number, -1 on overlap, with CPU_MAX_DEVICES devices, when out of memory
+// or with cpu_config_t.guard, where accesses outside dram are not checked
+int cpu_device_add(struct cpu_t *cpu, const cpu_device_t *dev);
+// the counters of device n since cpu_device_add or cpu_stats_reset, -1 if there is no such device
+int cpu_device_stats(struct cpu_t *cpu, int n, cpu_device_stats_t *stats);
+
+// drop all decoded instructions and translated blocks. needed after code in dram was changed behind the cpu's back
+void cpu_icache_flush(struct cpu_t *cpu);
+// translate the image loaded in dram ahead of time to a shared object cached as image.aot.so,
+// used by CPU_ENGINE_BLOCK and CPU_ENGINE_JIT. image is the file it was loaded from. the compiler
+// is the program $CC names, cc without, run without a shell
+int cpu_aot_load(struct cpu_t *cpu, const char *image);
+void cpu_stats_get(struct cpu_t *cpu, cpu_stats_t *stats);
+// bytes of dram backed by host memory, the pages the guest touched and the pages of an image from
+// cpu_load_image that are in the page cache. dram.size where the host can not tell
+uint64_t cpu_dram_resident(struct cpu_t *cpu);
+// per site JALR counters of CPU_ENGINE_BLOCK and CPU_ENGINE_JIT since the last flush.
+// fills up to max sites, returns how many there are
+uint64_t cpu_jalr_sites(struct cpu_t *cpu, cpu_jalr_site_t *sites, uint64_t max);
+void cpu_stats_reset(struct cpu_t *cpu);
 
-extern int ECALL_cb(cpu_t *cpu, uint32_t inst);
-extern int EBREAK_cb(cpu_t *cpu, uint32_t inst);
-extern int INVOP_cb(cpu_t *cpu, uint32_t inst);
 #endif
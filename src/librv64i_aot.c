@@ -0,0 +1,468 @@
+#define _GNU_SOURCE // dladdr
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// ahead of time translation. the code reachable from the entry point is discovered by
+// following the direct branches, jumps and call return addresses of the image in dram,
+// and emitted as one C function with a label per basic block. direct control flow is a
+// goto, JALR goes through a switch over all discovered block addresses. the C file is
+// compiled with the host compiler ($CC, default cc) into image.aot.so next to the
+// image and loaded with dlopen. the compiler is run directly, not through the shell, so
+// $CC names a program and takes no arguments of its own. the shared object records a
+// hash of dram and of the memory layout, so later runs of the same image reuse it
+// without translating.
+//
+// the native code returns whenever it reaches an address it does not know (an
+// undiscovered JALR target) or an ECALL/EBREAK/atomic/invalid instruction, and the block
+// engine takes over from there until it is back at translated code. it also returns
+// before a block that would take stats.instret past cpu->limit. that limit is read with
+// acquire, so the host compiler loads dram again in every block and a loop waiting for
+// a store of another hart sees it.
+//
+// cpus loading the same image at once translate under file names of their own and rename
+// the shared object into place, so neither sees a half written one.
+
+#define AOT_VERSION 8
+
+// what the generated code calls for accesses outside dram, the devices of cpu_device_add
+typedef struct aot_io_t {
+    void *bus;
+    uint64_t (*load)(void *bus, uint64_t addr, uint64_t size);
+    void (*store)(void *bus, uint64_t addr, uint64_t size, uint64_t value);
+} aot_io_t;
+
+typedef uint64_t (*aot_fn)(uint64_t *regs, uint64_t *pc, uint8_t *mem, uint64_t instret, const volatile uint64_t *limit, const aot_io_t *io);
+
+struct aot_t {
+    void *handle;
+    aot_fn run;
+};
+
+// fnv-1a a word at a time, n is a multiple of 8
+static uint64_t aot_hash_words(uint64_t h, const uint8_t *p, uint64_t n) {
+    for (uint64_t i = 0; i < n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t aot_hash(cpu_t *cpu) {
+    // over dram and the constants the generated code was built with
+    const dram_t *dram = &cpu->bus.dram;
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint64_t key[4] = {AOT_VERSION, dram->base, dram->size, cpu->bus.guard};
+    h = aot_hash_words(h, (const uint8_t *)key, sizeof(key));
+
+    // a page the guest never touched is all zero words, each of them only multiplies by the
+    // prime. such pages are skipped without reading them, dram can be large and sparse
+    uint64_t page = dram_page_size();
+    uint64_t pages = dram->size / page;
+    uint64_t skip = 1;
+    for (uint64_t i = 0; i < page / 8; i++)
+        skip *= 0x100000001b3ull;
+    unsigned char vec[256];
+    for (uint64_t first = 0; first < pages; first += sizeof(vec)) {
+        uint64_t n = pages - first < sizeof(vec) ? pages - first : sizeof(vec);
+        int known = !dram_resident(dram, first, n, vec);
+        for (uint64_t k = 0; k < n; k++)
+            h = known && !(vec[k] & 1) ? h * skip : aot_hash_words(h, dram->mem + (first + k) * page, page);
+    }
+    uint64_t i = pages * page;
+    uint64_t words = (dram->size - i) & ~7ull;
+    h = aot_hash_words(h, dram->mem + i, words);
+    for (i += words; i < dram->size; i++)
+        h = (h ^ dram->mem[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static int aot_in_dram(const dram_t *dram, uint64_t pc) { return pc - dram->base < dram->size && !(pc & 3); }
+
+static int aot_is_branch(uint8_t op) { return op >= OP_BEQ && op <= OP_BGEU; }
+
+// left to the interpreter. the atomics and CSRs are rare enough to not be worth inlining
+static int aot_is_trap(uint8_t op) { return op == OP_ECALL_EBREAK || op == OP_CSR || op == OP_AMO || op == OP_FENCE_I || op == OP_invalid; }
+
+// mark pc as the start of a block, and queue it for discovery
+static void aot_add(const dram_t *dram, uint8_t *starts, uint64_t *work, size_t *nwork, uint64_t pc) {
+    if (!aot_in_dram(dram, pc) || starts[(pc - dram->base) / 4])
+        return;
+    starts[(pc - dram->base) / 4] = 1;
+    work[(*nwork)++] = pc;
+}
+
+static void aot_discover(cpu_t *cpu, uint8_t *starts) {
+    const dram_t *dram = &cpu->bus.dram;
+    uint64_t *work = malloc(dram->size / 4 * sizeof(uint64_t));
+    uint8_t *seen = calloc(dram->size / 4, 1);
+    size_t nwork = 0;
+    if (!work || !seen)
+        goto out;
+
+    aot_add(dram, starts, work, &nwork, cpu->pc);
+    while (nwork) {
+        for (uint64_t pc = work[--nwork]; aot_in_dram(dram, pc) && !seen[(pc - dram->base) / 4]; pc += 4) {
+            insn_t in;
+            seen[(pc - dram->base) / 4] = 1;
+            rv_decode(bus_load(&(cpu->bus), pc, 32), &in);
+            if (aot_is_branch(in.op) || in.op == OP_JAL) {
+                aot_add(dram, starts, work, &nwork, pc + (int64_t)in.imm);
+                aot_add(dram, starts, work, &nwork, pc + 4); // not taken, or where a call returns
+                break;
+            }
+            if (in.op == OP_JALR || (aot_is_trap(in.op) && in.op != OP_invalid)) {
+                aot_add(dram, starts, work, &nwork, pc + 4);
+                break;
+            }
+            if (in.op == OP_invalid)
+                break;
+        }
+    }
+out:
+    free(work);
+    free(seen);
+}
+
+static void aot_goto(FILE *f, const dram_t *dram, const uint8_t *starts, uint64_t pc) {
+    if (aot_in_dram(dram, pc) && starts[(pc - dram->base) / 4])
+        fprintf(f, "goto L_%" PRIx64 ";", pc);
+    else
+        fprintf(f, "{ pc = 0x%" PRIx64 "ull; goto out; }", pc);
+}
+
+// one instruction, the expressions are the ones of the interpreter handlers
+static void aot_emit(FILE *f, const dram_t *dram, const uint8_t *starts, uint64_t pc, const insn_t *in) {
+    char rd[8], rs1[8], rs2[8], imm[32];
+    snprintf(rd, sizeof(rd), in->rd ? "x%d" : "sink", in->rd);
+    snprintf(rs1, sizeof(rs1), "x%d", in->rs1);
+    snprintf(rs2, sizeof(rs2), "x%d", in->rs2);
+    snprintf(imm, sizeof(imm), "0x%" PRIx64 "ull", in->imm);
+
+    // rv_decode turned everything else that writes x0 into OP_NOP, a load into x0 goes to sink
+    if (in->op == OP_NOP)
+        return;
+
+    fprintf(f, "    ");
+    switch (in->op) {
+    case OP_LUI: fprintf(f, "%s = %s;", rd, imm); break;
+    case OP_AUIPC: fprintf(f, "%s = 0x%" PRIx64 "ull;", rd, (uint64_t)(((int64_t)pc + 4 + (int64_t)in->imm) - 4)); break;
+    case OP_JAL:
+        if (in->rd)
+            fprintf(f, "%s = 0x%" PRIx64 "ull; ", rd, pc + 4);
+        aot_goto(f, dram, starts, pc + (int64_t)in->imm);
+        break;
+    case OP_JALR:
+        fprintf(f, "pc = (%s + (int64_t)%s) & 0xfffffffe; ", rs1, imm);
+        if (in->rd)
+            fprintf(f, "%s = 0x%" PRIx64 "ull; ", rd, pc + 4);
+        fprintf(f, "goto dispatch;");
+        break;
+    case OP_BEQ: fprintf(f, "if ((int64_t)%s == (int64_t)%s) ", rs1, rs2); break;
+    case OP_BNE: fprintf(f, "if (%s != %s) ", rs1, rs2); break;
+    case OP_BLT: fprintf(f, "if ((int64_t)%s < (int64_t)%s) ", rs1, rs2); break;
+    case OP_BGE: fprintf(f, "if ((int64_t)%s >= (int64_t)%s) ", rs1, rs2); break;
+    case OP_BLTU: fprintf(f, "if (%s < %s) ", rs1, rs2); break;
+    case OP_BGEU: fprintf(f, "if (%s >= %s) ", rs1, rs2); break;
+    case OP_LB: fprintf(f, "%s = (int64_t)(int8_t)ld(mem, io, %s + (int64_t)%s, 1);", rd, rs1, imm); break;
+    case OP_LH: fprintf(f, "%s = (int64_t)(int16_t)ld(mem, io, %s + (int64_t)%s, 2);", rd, rs1, imm); break;
+    case OP_LW: fprintf(f, "%s = (int64_t)(int32_t)ld(mem, io, %s + (int64_t)%s, 4);", rd, rs1, imm); break;
+    case OP_LD: fprintf(f, "%s = ld(mem, io, %s + (int64_t)%s, 8);", rd, rs1, imm); break;
+    case OP_LBU: fprintf(f, "%s = ld(mem, io, %s + (int64_t)%s, 1);", rd, rs1, imm); break;
+    case OP_LHU: fprintf(f, "%s = ld(mem, io, %s + (int64_t)%s, 2);", rd, rs1, imm); break;
+    case OP_LWU: fprintf(f, "%s = ld(mem, io, %s + (int64_t)%s, 4);", rd, rs1, imm); break;
+    case OP_SB: fprintf(f, "st(mem, io, %s + (int64_t)%s, 1, %s);", rs1, imm, rs2); break;
+    case OP_SH: fprintf(f, "st(mem, io, %s + (int64_t)%s, 2, %s);", rs1, imm, rs2); break;
+    case OP_SW: fprintf(f, "st(mem, io, %s + (int64_t)%s, 4, %s);", rs1, imm, rs2); break;
+    case OP_SD: fprintf(f, "st(mem, io, %s + (int64_t)%s, 8, %s);", rs1, imm, rs2); break;
+    case OP_ADDI: fprintf(f, "%s = %s + (int64_t)%s;", rd, rs1, imm); break;
+    case OP_SLLI:
+    case OP_SLLI_64: fprintf(f, "%s = %s << (uint32_t)(%s & 0x3f);", rd, rs1, imm); break;
+    case OP_SLTI: fprintf(f, "%s = (%s < (int64_t)%s) ? 1 : 0;", rd, rs1, imm); break;
+    case OP_SLTIU: fprintf(f, "%s = (%s < %s) ? 1 : 0;", rd, rs1, imm); break;
+    case OP_XORI: fprintf(f, "%s = %s ^ %s;", rd, rs1, imm); break;
+    // the interpreter shifts by the whole immediate, which the host masks to 6 bits
+    case OP_SRLI:
+    case OP_SRLI_64:
+    case OP_SRAI_64: fprintf(f, "%s = %s >> (%s & 0x3f);", rd, rs1, imm); break;
+    case OP_SRAI: fprintf(f, "%s = (int64_t)%s >> (%s & 0x3f);", rd, rs1, imm); break;
+    case OP_ORI: fprintf(f, "%s = %s | %s;", rd, rs1, imm); break;
+    case OP_ANDI: fprintf(f, "%s = %s & %s;", rd, rs1, imm); break;
+    case OP_ADD: fprintf(f, "%s = %s + %s;", rd, rs1, rs2); break;
+    case OP_SUB: fprintf(f, "%s = %s - %s;", rd, rs1, rs2); break;
+    case OP_SLL: fprintf(f, "%s = %s << (%s & 0x3f);", rd, rs1, rs2); break;
+    case OP_SLT: fprintf(f, "%s = ((int64_t)%s < (int64_t)%s) ? 1 : 0;", rd, rs1, rs2); break;
+    case OP_SLTU: fprintf(f, "%s = (%s < %s) ? 1 : 0;", rd, rs1, rs2); break;
+    case OP_XOR: fprintf(f, "%s = %s ^ %s;", rd, rs1, rs2); break;
+    case OP_SRL: fprintf(f, "%s = %s >> (%s & 0x3f);", rd, rs1, rs2); break;
+    case OP_OR: fprintf(f, "%s = %s | %s;", rd, rs1, rs2); break;
+    case OP_AND: fprintf(f, "%s = %s & %s;", rd, rs1, rs2); break;
+    case OP_FENCE: fprintf(f, "__atomic_thread_fence(%s);", fence_store_load(in->inst) ? "__ATOMIC_SEQ_CST" : "__ATOMIC_ACQ_REL"); break;
+    case OP_ADDIW: fprintf(f, "%s = (int64_t)(int32_t)(uint32_t)(%s + %s);", rd, rs1, imm); break;
+    case OP_SLLIW: fprintf(f, "%s = (uint32_t)%s << ((uint32_t)(%s & 0x3f) %% 32);", rd, rs1, imm); break;
+    case OP_SRLIW: fprintf(f, "%s = (uint32_t)%s >> ((uint32_t)(%s & 0x3f) %% 32);", rd, rs1, imm); break;
+    case OP_SRAIW: fprintf(f, "%s = (int64_t)((int32_t)%s >> (%s %% 32));", rd, rs1, imm); break;
+    case OP_ADDW: fprintf(f, "%s = (int64_t)(int32_t)(uint32_t)(%s + %s);", rd, rs1, rs2); break;
+    case OP_SUBW: fprintf(f, "%s = (int64_t)(int32_t)(uint32_t)(%s - %s);", rd, rs1, rs2); break;
+    case OP_SLLW: fprintf(f, "%s = (int64_t)(int32_t)(uint32_t)(%s << (%s %% 32));", rd, rs1, rs2); break;
+    case OP_SRLW: fprintf(f, "%s = (int64_t)(int32_t)((uint32_t)%s >> (%s %% 32));", rd, rs1, rs2); break;
+    case OP_SRAW: fprintf(f, "%s = (int64_t)((int32_t)%s >> (%s %% 32));", rd, rs1, rs2); break;
+    case OP_SRA: fprintf(f, "%s = (int64_t)%s >> (%s %% 32);", rd, rs1, rs2); break;
+    case OP_DIV: fprintf(f, "%s = (int64_t)%s == -1 ? -%s : %s != 0 ? (uint64_t)((int64_t)%s / (int64_t)%s) : (uint64_t)-1;", rd, rs2, rs1, rs2, rs1, rs2); break;
+    case OP_DIVU: fprintf(f, "%s = %s != 0 ? %s / %s : (uint64_t)-1;", rd, rs2, rs1, rs2); break;
+    case OP_DIVW: fprintf(f, "%s = (int32_t)%s == -1 ? (uint64_t)(int64_t)(int32_t)-(uint32_t)%s : (int32_t)%s != 0 ? (uint64_t)(int64_t)((int32_t)%s / (int32_t)%s) : (uint64_t)-1;", rd, rs2, rs1, rs2, rs1, rs2); break;
+    case OP_DIVUW: fprintf(f, "%s = (uint32_t)%s != 0 ? (uint64_t)((uint32_t)%s / (uint32_t)%s) : (uint64_t)-1;", rd, rs2, rs1, rs2); break;
+    case OP_MUL: fprintf(f, "%s = %s * %s;", rd, rs1, rs2); break;
+    case OP_MULW: fprintf(f, "%s = (int64_t)(int32_t)((uint32_t)%s * (uint32_t)%s);", rd, rs1, rs2); break;
+    case OP_MULH: fprintf(f, "%s = (((int128_t)(int64_t)%s) * ((int128_t)(int64_t)%s)) >> 64;", rd, rs1, rs2); break;
+    case OP_MULHU: fprintf(f, "%s = ((uint128_t)%s * (uint128_t)%s) >> 64;", rd, rs1, rs2); break;
+    case OP_MULHSU: fprintf(f, "%s = ((int128_t)(((int128_t)(int64_t)%s) * (uint128_t)%s)) >> 64;", rd, rs1, rs2); break;
+    case OP_REM: fprintf(f, "%s = (int64_t)%s == -1 ? 0 : %s != 0 ? (uint64_t)((int64_t)%s %% (int64_t)%s) : (uint64_t)-1;", rd, rs2, rs2, rs1, rs2); break;
+    case OP_REMU: fprintf(f, "%s = %s != 0 ? %s %% %s : (uint64_t)-1;", rd, rs2, rs1, rs2); break;
+    case OP_REMW: fprintf(f, "%s = (int32_t)%s == -1 ? 0 : (int32_t)%s != 0 ? (uint64_t)(int64_t)((int32_t)%s %% (int32_t)%s) : (uint64_t)-1;", rd, rs2, rs2, rs1, rs2); break;
+    case OP_REMUW: fprintf(f, "%s = (uint32_t)%s != 0 ? (uint64_t)((uint32_t)%s %% (uint32_t)%s) : (uint64_t)-1;", rd, rs2, rs1, rs2); break;
+    }
+    if (aot_is_branch(in->op)) {
+        aot_goto(f, dram, starts, pc + (int64_t)in->imm);
+        fprintf(f, "\n    ");
+        aot_goto(f, dram, starts, pc + 4);
+    }
+    fprintf(f, "\n");
+}
+
+static int aot_generate(cpu_t *cpu, const char *path, uint64_t hash) {
+    const dram_t *dram = &cpu->bus.dram;
+    uint64_t words = dram->size / 4;
+    uint8_t *starts = calloc(words, 1);
+    FILE *f = fopen(path, "w");
+    if (!starts || !f) {
+        free(starts);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    aot_discover(cpu, starts);
+
+    fprintf(f, "#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(f, "typedef __int128_t int128_t;\ntypedef __uint128_t uint128_t;\n\n");
+    fprintf(f, "#define DRAM_BASE 0x%" PRIx64 "ull\n#define DRAM_SIZE 0x%" PRIx64 "ull\n\n", dram->base, dram->size);
+    fprintf(f, "const uint64_t rv_aot_hash = 0x%" PRIx64 "ull;\n\n", hash);
+    // guest memory is little endian, a plain memcpy on little endian hosts. with guard pages
+    // every offset is in range, see bus_ptr
+    fprintf(f, "#define GUARD %d\n\n", cpu->bus.guard);
+    fprintf(f, "typedef struct io_t {\n"
+               "    void *bus;\n"
+               "    uint64_t (*load)(void *bus, uint64_t addr, uint64_t size);\n"
+               "    void (*store)(void *bus, uint64_t addr, uint64_t size, uint64_t value);\n"
+               "} io_t;\n\n");
+    // the devices are out of line and cold, a call on the dram path would make the host compiler
+    // keep the guest registers around it
+    fprintf(f, "static __attribute__((noinline, cold)) uint64_t io_ld(const io_t *io, uint64_t addr, uint64_t n) { return io->load(io->bus, addr, 8 * n); }\n"
+               "static __attribute__((noinline, cold)) void io_st(const io_t *io, uint64_t addr, uint64_t n, uint64_t v) { io->store(io->bus, addr, 8 * n, v); }\n\n");
+    fprintf(f, "static inline __attribute__((always_inline)) uint64_t ld(uint8_t *mem, const io_t *io, uint64_t addr, uint64_t n) {\n"
+               "    uint64_t v = 0;\n"
+               "    if (GUARD)\n"
+               "        addr = DRAM_BASE + (uint32_t)(addr - DRAM_BASE);\n"
+               "    if (__builtin_expect(GUARD || addr - DRAM_BASE <= DRAM_SIZE - n, 1)) {\n"
+               "#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__\n"
+               "        memcpy(&v, mem + addr - DRAM_BASE, n);\n"
+               "#else\n"
+               "        for (uint64_t i = 0; i < n; i++)\n"
+               "            v |= (uint64_t)mem[addr - DRAM_BASE + i] << (8 * i);\n"
+               "#endif\n"
+               "    } else {\n"
+               "        v = io_ld(io, addr, n);\n"
+               "    }\n"
+               "    return v;\n"
+               "}\n\n");
+    fprintf(f, "static inline __attribute__((always_inline)) void st(uint8_t *mem, const io_t *io, uint64_t addr, uint64_t n, uint64_t v) {\n"
+               "    if (GUARD)\n"
+               "        addr = DRAM_BASE + (uint32_t)(addr - DRAM_BASE);\n"
+               "    if (__builtin_expect(GUARD || addr - DRAM_BASE <= DRAM_SIZE - n, 1)) {\n"
+               "#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__\n"
+               "        memcpy(mem + addr - DRAM_BASE, &v, n);\n"
+               "#else\n"
+               "        for (uint64_t i = 0; i < n; i++)\n"
+               "            mem[addr - DRAM_BASE + i] = v >> (8 * i);\n"
+               "#endif\n"
+               "    } else {\n"
+               "        io_st(io, addr, n, v);\n"
+               "    }\n"
+               "}\n\n");
+    fprintf(f, "uint64_t rv_aot_run(uint64_t *regs, uint64_t *pcp, uint8_t *mem, uint64_t instret, const volatile uint64_t *limit, const io_t *io) {\n");
+    // the registers are separate locals, so the host compiler can keep them in registers
+    fprintf(f, "    uint64_t pc = *pcp;\n    uint64_t ic = 0;\n    const uint64_t x0 = 0;\n    uint64_t sink;\n");
+    for (int i = 1; i < 32; i++)
+        fprintf(f, "    uint64_t x%d = regs[%d];\n", i, i);
+    fprintf(f, "dispatch:\n    switch (pc) {\n");
+    for (uint64_t w = 0; w < words; w++)
+        if (starts[w])
+            fprintf(f, "    case 0x%" PRIx64 "ull: goto L_%" PRIx64 ";\n", dram->base + 4 * w, dram->base + 4 * w);
+    fprintf(f, "    default: goto out;\n    }\n");
+
+    for (uint64_t w = 0; w < words; w++) {
+        if (!starts[w])
+            continue;
+        uint64_t start = dram->base + 4 * w;
+        uint64_t pc = start;
+        insn_t in;
+        uint32_t n = 0;
+        int trap = 0;
+
+        // count the instructions up to the end of the block, a trap is left to the interpreter
+        for (;;) {
+            if (!aot_in_dram(dram, pc) || (pc != start && starts[(pc - dram->base) / 4]))
+                break;
+            rv_decode(bus_load(&(cpu->bus), pc, 32), &in);
+            if ((trap = aot_is_trap(in.op)))
+                break;
+            n++;
+            pc += 4;
+            if (aot_is_branch(in.op) || in.op == OP_JAL || in.op == OP_JALR)
+                break;
+        }
+
+        fprintf(f, "L_%" PRIx64 ":\n", start);
+        if (n)
+            fprintf(f, "    if (instret + ic + %u > __atomic_load_n(limit, __ATOMIC_ACQUIRE)) { pc = 0x%" PRIx64 "ull; goto out; }\n    ic += %u;\n", n, start, n);
+        pc = start;
+        for (uint32_t i = 0; i < n; i++, pc += 4) {
+            rv_decode(bus_load(&(cpu->bus), pc, 32), &in);
+            aot_emit(f, dram, starts, pc, &in);
+        }
+        if (trap)
+            fprintf(f, "    pc = 0x%" PRIx64 "ull;\n    goto out;\n", pc);
+        else if (!n || !(aot_is_branch(in.op) || in.op == OP_JAL || in.op == OP_JALR)) {
+            fprintf(f, "    ");
+            aot_goto(f, dram, starts, pc);
+            fprintf(f, "\n");
+        }
+    }
+    fprintf(f, "out:\n    regs[0] = 0;\n");
+    for (int i = 1; i < 32; i++)
+        fprintf(f, "    regs[%d] = x%d;\n", i, i);
+    fprintf(f, "    *pcp = pc;\n    return ic;\n}\n");
+    free(starts);
+    return fclose(f) ? -1 : 0;
+}
+
+static int aot_open(cpu_t *cpu, const char *so, uint64_t hash) {
+    void *handle = dlopen(so, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+        return -1;
+    const uint64_t *h = dlsym(handle, "rv_aot_hash");
+    aot_fn run = (aot_fn)dlsym(handle, "rv_aot_run");
+    if (!h || !run || *h != hash) {
+        dlclose(handle);
+        return -1;
+    }
+    cpu->aot = malloc(sizeof(aot_t));
+    if (!cpu->aot) {
+        dlclose(handle);
+        return -1;
+    }
+    cpu->aot->handle = handle;
+    cpu->aot->run = run;
+    return 0;
+}
+
+// cc -O2 -shared -fPIC -o so src, 0 if it succeeded
+static int aot_compile(const char *so, const char *src) {
+    const char *cc = getenv("CC");
+    char *argv[] = {(char *)(cc && *cc ? cc : "cc"), "-O2", "-shared", "-fPIC", "-o", (char *)so, (char *)src, NULL};
+    int status;
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (!pid) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR)
+            return -1;
+    return WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+int cpu_aot_load(cpu_t *cpu, const char *image) {
+    size_t len = strlen(image) + 64;
+    char *so = malloc(len);
+    char *src = malloc(len);
+    char *tmp = malloc(len);
+    uint64_t hash = aot_hash(cpu);
+    int ret = -1;
+
+    aot_free(cpu);
+    if (!so || !src || !tmp)
+        goto out;
+    // dlopen searches the library path for names without a slash
+    snprintf(so, len, "%s%s.aot.so", strchr(image, '/') ? "" : "./", image);
+    // the pid and the cpu make the temporary names unique
+    snprintf(src, len, "%s.aot.%d.%p.c", image, (int)getpid(), (void *)cpu);
+    snprintf(tmp, len, "%s.aot.%d.%p.so", image, (int)getpid(), (void *)cpu);
+
+    // an up to date translation from an earlier run
+    if (!aot_open(cpu, so, hash)) {
+        ret = 0;
+        goto out;
+    }
+
+    if (aot_generate(cpu, src, hash))
+        goto out;
+    if (!aot_compile(tmp, src) && !rename(tmp, so))
+        ret = aot_open(cpu, so, hash);
+    remove(src);
+    remove(tmp);
+out:
+    free(so);
+    free(src);
+    free(tmp);
+    return ret;
+}
+
+static uint64_t aot_mmio_load(void *bus, uint64_t addr, uint64_t size) { return ((bus_t *)bus)->mmio ? mmio_load(bus, addr, size) : 0; }
+
+static void aot_mmio_store(void *bus, uint64_t addr, uint64_t size, uint64_t value) {
+    if (((bus_t *)bus)->mmio)
+        mmio_store(bus, addr, size, value);
+}
+
+uint64_t aot_run(cpu_t *cpu) {
+    aot_io_t io = {&cpu->bus, aot_mmio_load, aot_mmio_store};
+    uint64_t n = cpu->aot->run(cpu->regs, &cpu->pc, cpu->bus.dram.mem, cpu->stats.instret, &cpu->limit, &io);
+    cpu->stats.instret += n;
+    return n;
+}
+
+aot_t *aot_dup(const aot_t *aot) {
+    // dlopen of a loaded object only counts a reference, the code is not mapped twice
+    Dl_info info;
+    aot_t *dup = malloc(sizeof(aot_t));
+    if (!dup || !dladdr((void *)aot->run, &info) || !(dup->handle = dlopen(info.dli_fname, RTLD_NOW | RTLD_LOCAL))) {
+        free(dup);
+        return NULL;
+    }
+    dup->run = aot->run;
+    return dup;
+}
+
+void aot_close(aot_t *aot) {
+    if (!aot)
+        return;
+    dlclose(aot->handle);
+    free(aot);
+}
+
+void aot_free(cpu_t *cpu) {
+    aot_close(cpu->aot);
+    cpu->aot = NULL;
+}
@@ -0,0 +1,782 @@
+#include <stdlib.h>
+
+#include "librv64i_internal.h"
+
+// basic block translation. straight line code is decoded once into an array of micro ops
+// that ends with the first instruction that can change the control flow (branches,
+// JAL/JALR, ECALL/EBREAK, FENCE). blocks are cached by their start pc and keep a link
+// to the successors they went to, so a hot loop goes from block to block without a
+// hash lookup. instructions are counted once per block.
+//
+// with CPU_ENGINE_JIT a block that ran JIT_THRESHOLD times is compiled to native code,
+// and exits of native blocks are patched to jump straight into compiled successors.
+// the first time a compiled block is reached through a backward jump it is taken as a
+// loop header: one iteration is recorded in the interpreter and compiled as a trace,
+// which then replaces the native code of the header.
+//
+// JALR targets are resolved in three steps before the hash table: the last target of
+// the site (its link[1], in native code an inline compare and jump), the return address
+// stack for returns, and a direct mapped table of indirect targets.
+
+#define BLOCK_HASH_SIZE 4096
+#define IBTC_SIZE 1024 // indirect branch target table
+
+// blocks run this often in the interpreter before the jit compiles them
+#define JIT_THRESHOLD 16
+
+typedef struct ibtc_entry_t {
+    uint64_t pc; // odd when empty
+    block_t *b;
+} ibtc_entry_t;
+
+typedef struct block_cache_t {
+    block_t *hash[BLOCK_HASH_SIZE];
+    uint64_t flushes; // lets the run loop notice a flush from inside a callback
+    jit_t *jit;       // native code buffer, CPU_ENGINE_JIT only
+    block_t *head;    // loop header whose iteration is being recorded
+    block_t *trace[TRACE_MAX_BLOCKS];
+    int trace_n;
+    ras_t ras; // the jit pushes and pops it from native code as well
+    ibtc_entry_t ibtc[IBTC_SIZE];
+} block_cache_t;
+
+static int is_link(int r) { return r == 1 || r == 5; }
+
+static uint32_t block_flow(const insn_t *u) {
+    uint32_t flow = 0;
+    if ((u->op == OP_JAL || u->op == OP_JALR || u->op == OP_FUSED_JALR) && is_link(u->rd))
+        flow |= BLOCK_CALL;
+    else if (u->op == OP_JALR && is_link(u->rs1))
+        flow |= BLOCK_RETURN;
+    if (u->op == OP_JALR)
+        flow |= BLOCK_INDIRECT; // AUIPC+JALR has a constant target
+    return flow;
+}
+
+static int block_ends(uint8_t op) {
+    switch (op) {
+    case OP_BEQ:
+    case OP_BNE:
+    case OP_BLT:
+    case OP_BGE:
+    case OP_BLTU:
+    case OP_BGEU:
+    case OP_JAL:
+    case OP_JALR:
+    case OP_ECALL_EBREAK:
+    case OP_CSR:
+    case OP_AMO:
+    case OP_FENCE:
+    case OP_FENCE_I:
+    case OP_invalid:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+//
+// superinstructions. the first instruction of a pair always writes a register other
+// than x0, which the second reads
+//
+
+static int exec_FUSED_LOAD(cpu_t *cpu, const insn_t *in) {
+    uint64_t addr = in->imm + (int64_t)(int32_t)in->inst;
+    cpu->regs[in->rs1] = in->imm;
+    if (in->rs2 == OP_LD)
+        cpu->regs[in->rd] = bus_load(&(cpu->bus), addr, 64);
+    else if (in->rs2 == OP_LW)
+        cpu->regs[in->rd] = (int64_t)(int32_t)bus_load(&(cpu->bus), addr, 32);
+    else
+        cpu->regs[in->rd] = bus_load(&(cpu->bus), addr, 32);
+    return 0;
+}
+
+static int exec_FUSED_JALR(cpu_t *cpu, const insn_t *in) {
+    uint64_t tmp = cpu->pc;
+    cpu->regs[in->rs1] = in->imm;
+    cpu->pc = (in->imm + (int64_t)(int32_t)in->inst) & 0xfffffffe;
+    cpu->regs[in->rd] = tmp;
+    cpu->regs[0] = 0; // see exec_JAL
+    return 0;
+}
+
+static int exec_FUSED_ZEXT(cpu_t *cpu, const insn_t *in) {
+    cpu->regs[in->rd] = (cpu->regs[in->rs1] << (in->imm & 0x3f)) >> in->inst;
+    return 0;
+}
+
+static int exec_FUSED_CMP_BRANCH(cpu_t *cpu, const insn_t *in) {
+    uint64_t a = cpu->regs[in->rs1];
+    uint64_t v;
+    switch ((in->inst >> 16) & 0xff) {
+    case OP_SLT: v = (int64_t)a < (int64_t)cpu->regs[in->rs2]; break;
+    case OP_SLTU: v = a < cpu->regs[in->rs2]; break;
+    // SLTI compares unsigned, like its handler
+    default: v = a < in->imm; break;
+    }
+    cpu->regs[in->rd] = v;
+    if (v == (in->inst >> 24))
+        cpu->pc = cpu->pc + (int16_t)in->inst - 4;
+    return 0;
+}
+
+int block_unfuse(const insn_t *u, insn_t out[2]) {
+    insn_t *a = &out[0];
+    insn_t *b = &out[1];
+
+    *a = *u;
+    if (u->op < OP_COUNT)
+        return 1;
+    *b = *u;
+    switch (u->op) {
+    case OP_FUSED_LOAD:
+    case OP_FUSED_JALR:
+        a->op = OP_LUI;
+        a->rd = u->rs1;
+        b->op = u->op == OP_FUSED_JALR ? OP_JALR : u->rs2;
+        b->imm = (int64_t)(int32_t)u->inst;
+        break;
+    case OP_FUSED_ZEXT:
+        a->op = OP_SLLI;
+        b->op = OP_SRLI;
+        b->rs1 = u->rd;
+        b->imm = u->inst;
+        break;
+    case OP_FUSED_CMP_BRANCH:
+        a->op = (u->inst >> 16) & 0xff;
+        b->op = u->inst >> 24 ? OP_BNE : OP_BEQ;
+        b->rs1 = u->rd;
+        b->rs2 = 0;
+        b->imm = (int64_t)(int16_t)u->inst;
+        break;
+    }
+    a->fn = rv_exec_table[a->op];
+    b->fn = rv_exec_table[b->op];
+    return 2;
+}
+
+// merge the pair at uops[i], uops[i + 1] into uops[i]. auipc tells which LUIs were AUIPC
+static int block_fuse_pair(insn_t *a, const insn_t *c, int auipc, int last, uint8_t *fused) {
+    if (a->rd == 0)
+        return 0;
+    if (a->op == OP_LUI && c->rs1 == a->rd) {
+        if ((c->op == OP_ADDI || c->op == OP_ADDIW) && c->rd == a->rd) {
+            a->imm = a->imm + (int64_t)c->imm;
+            if (c->op == OP_ADDIW)
+                a->imm = (int64_t)(int32_t)(uint32_t)a->imm;
+            fused[auipc ? CPU_FUSE_AUIPC_ADDR : CPU_FUSE_LUI_ADDI]++;
+            return 1;
+        }
+        if (!auipc)
+            return 0;
+        // exec_FUSED_LOAD would write x0, a load into x0 stays on its own
+        if (c->op == OP_JALR || ((c->op == OP_LD || c->op == OP_LW || c->op == OP_LWU) && c->rd)) {
+            a->rs1 = a->rd;
+            a->rd = c->rd;
+            a->rs2 = c->op;
+            a->inst = (uint32_t)c->imm;
+            a->op = c->op == OP_JALR ? OP_FUSED_JALR : OP_FUSED_LOAD;
+            a->fn = c->op == OP_JALR ? exec_FUSED_JALR : exec_FUSED_LOAD;
+            fused[c->op == OP_JALR ? CPU_FUSE_AUIPC_JALR : CPU_FUSE_AUIPC_ADDR]++;
+            return 1;
+        }
+        return 0;
+    }
+    if ((a->op == OP_SLLI || a->op == OP_SLLI_64) && (c->op == OP_SRLI || c->op == OP_SRLI_64) && c->rs1 == a->rd && c->rd == a->rd) {
+        a->inst = c->imm;
+        a->op = OP_FUSED_ZEXT;
+        a->fn = exec_FUSED_ZEXT;
+        fused[CPU_FUSE_SLLI_SRLI]++;
+        return 1;
+    }
+    if ((a->op == OP_SLT || a->op == OP_SLTU || a->op == OP_SLTI || a->op == OP_SLTIU) && last && (c->op == OP_BEQ || c->op == OP_BNE) &&
+        ((c->rs1 == a->rd && c->rs2 == 0) || (c->rs2 == a->rd && c->rs1 == 0)) && c->imm + 0x1000 < 0x2000) {
+        a->inst = (uint16_t)c->imm | (uint32_t)a->op << 16 | (uint32_t)(c->op == OP_BNE) << 24;
+        a->op = OP_FUSED_CMP_BRANCH;
+        a->fn = exec_FUSED_CMP_BRANCH;
+        fused[CPU_FUSE_CMP_BRANCH]++;
+        return 1;
+    }
+    return 0;
+}
+
+// fold instruction pairs into superinstructions, returns the new number of micro ops
+static uint32_t block_fuse(insn_t *uops, uint32_t n, const uint8_t *auipc, uint8_t *fused) {
+    uint8_t was_auipc[BLOCK_MAX_INSNS];
+    uint32_t out = 0;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (out && block_fuse_pair(&uops[out - 1], &uops[i], was_auipc[out - 1], i + 1 == n, fused))
+            continue; // the result may pair with the next one again
+        was_auipc[out] = auipc[i];
+        uops[out++] = uops[i];
+    }
+    return out;
+}
+
+static block_t *block_translate(cpu_t *cpu, uint64_t pc) {
+    insn_t uops[BLOCK_MAX_INSNS];
+    uint8_t auipc[BLOCK_MAX_INSNS];
+    uint8_t fused[CPU_FUSE_COUNT] = {0};
+    uint64_t addr = pc;
+    uint32_t n = 0;
+
+    while (n < BLOCK_MAX_INSNS) {
+        insn_t *in = &uops[n];
+        auipc[n++] = 0;
+        code_mark(cpu, addr);
+        rv_decode(bus_fetch(&(cpu->bus), addr), in);
+        addr += 4;
+        if (in->op == OP_AUIPC) {
+            // cpu->pc is only up to date for the last micro op, so AUIPC becomes a constant
+            in->imm = ((int64_t)addr + (int64_t)in->imm) - 4;
+            in->op = OP_LUI;
+            in->fn = rv_exec_table[OP_LUI];
+            auipc[n - 1] = 1;
+        }
+        if (block_ends(in->op))
+            break;
+    }
+    uint32_t insns = n;
+    n = block_fuse(uops, n, auipc, fused);
+
+    block_t *b = malloc(sizeof(block_t) + (n + 1) * sizeof(insn_t));
+    if (!b)
+        return NULL;
+    b->pc = pc;
+    b->end = addr;
+    b->link[0] = NULL;
+    b->link[1] = NULL;
+    b->n = n;
+    b->insns = insns;
+    b->nfused = insns - n;
+    for (int i = 0; i < CPU_FUSE_COUNT; i++)
+        b->fused[i] = fused[i];
+    b->count = 0;
+    b->traced = 0;
+    b->code = NULL;
+    b->patch[0] = NULL;
+    b->patch[1] = NULL;
+    b->flow = block_flow(&uops[n - 1]);
+    b->ret = NULL;
+    b->ic[0] = NULL;
+    b->jalr_hits = 0;
+    b->jalr_misses = 0;
+    for (uint32_t i = 0; i < n; i++)
+        b->uops[i] = uops[i];
+    b->uops[n] = (insn_t){.op = OP_BLOCK_END};
+    cpu->stats.blocks_translated++;
+    return b;
+}
+
+static block_t *block_lookup(cpu_t *cpu, uint64_t pc) {
+    block_cache_t *cache = cpu->blocks;
+    block_t **head = &cache->hash[(pc >> 2) & (BLOCK_HASH_SIZE - 1)];
+
+    cpu->stats.block_lookups++;
+    for (block_t *b = *head; b; b = b->hnext)
+        if (b->pc == pc)
+            return b;
+
+    block_t *b = block_translate(cpu, pc);
+    if (!b)
+        return NULL;
+    b->hnext = *head;
+    *head = b;
+    return b;
+}
+
+void block_cache_flush(cpu_t *cpu) {
+    block_cache_t *cache = cpu->blocks;
+    if (!cache)
+        return;
+    for (int i = 0; i < BLOCK_HASH_SIZE; i++) {
+        block_t *b = cache->hash[i];
+        while (b) {
+            block_t *next = b->hnext;
+            free(b);
+            b = next;
+        }
+        cache->hash[i] = NULL;
+    }
+    if (cache->jit)
+        jit_reset(cache->jit);
+    cache->head = NULL;
+    for (int i = 0; i < RAS_SIZE; i++)
+        cache->ras.e[i].pc = 1;
+    for (int i = 0; i < IBTC_SIZE; i++)
+        cache->ibtc[i].pc = 1;
+    cache->flushes++;
+}
+
+uint64_t cpu_jalr_sites(cpu_t *cpu, cpu_jalr_site_t *sites, uint64_t max) {
+    uint64_t n = 0;
+    for (int i = 0; cpu->blocks && i < BLOCK_HASH_SIZE; i++) {
+        for (block_t *b = cpu->blocks->hash[i]; b; b = b->hnext) {
+            if (!(b->flow & BLOCK_INDIRECT))
+                continue;
+            if (n < max)
+                sites[n] = (cpu_jalr_site_t){.pc = b->end - 4, .hits = b->jalr_hits, .misses = b->jalr_misses};
+            n++;
+        }
+    }
+    return n;
+}
+
+static void ras_push(block_cache_t *cache, block_t *b) {
+    cache->ras.top++;
+    cache->ras.e[cache->ras.top % RAS_SIZE].pc = b->end;
+    cache->ras.e[cache->ras.top % RAS_SIZE].caller = b;
+}
+
+// the block a JALR at the end of b went to
+static block_t *block_indirect(cpu_t *cpu, block_t *b) {
+    block_cache_t *cache = cpu->blocks;
+    uint64_t pc = cpu->pc;
+    block_t *next = b->link[1];
+
+    if (b->flow & BLOCK_RETURN) {
+        // pops even if the inline cache knows the target, like native code does
+        ras_entry_t *e = &cache->ras.e[cache->ras.top-- % RAS_SIZE];
+        if (!(next && next->pc == pc) && e->pc == pc) {
+            if (!e->caller->ret || e->caller->ret->pc != pc) {
+                e->caller->ret = block_lookup(cpu, pc);
+                b->jalr_misses++;
+                cpu->stats.jalr_lookups++;
+            } else {
+                b->jalr_hits++;
+                cpu->stats.jalr_ras++;
+            }
+            return b->link[1] = e->caller->ret;
+        }
+    }
+    if (next && next->pc == pc) {
+        b->jalr_hits++;
+        cpu->stats.jalr_inline++;
+        return next;
+    }
+    ibtc_entry_t *t = &cache->ibtc[(pc >> 2) & (IBTC_SIZE - 1)];
+    if (t->pc == pc) {
+        b->jalr_hits++;
+        cpu->stats.jalr_table++;
+        return b->link[1] = t->b;
+    }
+    next = block_lookup(cpu, pc);
+    if (next) {
+        t->pc = pc;
+        t->b = next;
+    }
+    b->jalr_misses++;
+    cpu->stats.jalr_lookups++;
+    return b->link[1] = next;
+}
+
+void block_cache_free(cpu_t *cpu) {
+    block_cache_flush(cpu);
+    if (cpu->blocks)
+        jit_free(cpu->blocks->jit);
+    free(cpu->blocks);
+    cpu->blocks = NULL;
+}
+
+// cpu_run returns, the recording would not continue where it stopped. try again next time
+static void trace_abort(block_cache_t *cache) {
+    if (cache->head) {
+        cache->head->traced = 0;
+        cache->head = NULL;
+    }
+}
+
+// the rest of a time slice that does not hold the next whole block, one instruction at a time
+static int run_steps(cpu_t *cpu) {
+    trace_abort(cpu->blocks);
+    while (cpu->stats.instret < run_limit(cpu)) {
+        int ret = cpu_step(cpu);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+// the micro ops of a block end with a computed goto to the next one, like the threaded
+// interpreter, and the block with its control op or the OP_BLOCK_END after the last one. from
+// there the link to the successor is followed right away, only a link that is not set yet or a
+// JALR goes through a lookup. the limit is checked once per block. cpu->pc is the address of
+// the block while it runs, the control ops set it to where it went. instret and the chained
+// blocks are counted in locals and written back before a handler can look at them
+
+#define RD x[u->rd]
+#define RS1 x[u->rs1]
+#define RS2 x[u->rs2]
+#define IMM u->imm
+
+#define LOAD(size) bus_load(&(cpu->bus), RS1 + (int64_t)IMM, size)
+#define STORE(size) bus_store(&(cpu->bus), RS1 + (int64_t)IMM, size, RS2)
+
+#define NEXT(stmt)                                                                                                                                             \
+    do {                                                                                                                                                       \
+        stmt;                                                                                                                                                  \
+        u++;                                                                                                                                                   \
+        goto *labels[u->op];                                                                                                                                   \
+    } while (0)
+
+// a conditional branch ends the block, not taken it goes on to link[0]
+#define BRANCH(cond)                                                                                                                                           \
+    do {                                                                                                                                                       \
+        if (cond) {                                                                                                                                            \
+            cpu->pc = b->end + (int64_t)IMM - 4;                                                                                                               \
+            goto leave;                                                                                                                                        \
+        }                                                                                                                                                      \
+        goto fall;                                                                                                                                             \
+    } while (0)
+
+// the handler of the last micro op sees the pc after it and the counters
+#define SYNC()                                                                                                                                                 \
+    do {                                                                                                                                                       \
+        cpu->pc = b->end;                                                                                                                                      \
+        cpu->stats.instret = instret;                                                                                                                          \
+        cpu->stats.block_chained += chained;                                                                                                                   \
+        chained = 0;                                                                                                                                           \
+    } while (0)
+
+static int block_run(cpu_t *cpu, block_t *b) {
+    static const void *const labels[OP_BLOCK_END + 1] = {
+#define OP_LABEL(name) &&op_##name,
+        RV_OPS(OP_LABEL)
+#undef OP_LABEL
+        &&op_FUSED_LOAD,
+        &&op_FUSED_JALR,
+        &&op_FUSED_ZEXT,
+        &&op_FUSED_CMP_BRANCH,
+        &&op_BLOCK_END,
+    };
+    block_cache_t *cache = cpu->blocks;
+    uint64_t flushes = cache->flushes;
+    uint64_t instret = cpu->stats.instret;
+    uint64_t chained = 0;
+    uint64_t *x = cpu->regs;
+    const insn_t *u;
+    block_t *next;
+    int ret;
+    goto enter;
+
+op_LUI:
+    NEXT(RD = IMM);
+op_JAL:
+    cpu->pc = b->end + (int64_t)IMM - 4;
+    RD = b->end;
+    x[0] = 0;
+    goto leave;
+op_JALR:
+    cpu->pc = (RS1 + (int64_t)IMM) & 0xfffffffe;
+    RD = b->end;
+    x[0] = 0;
+    goto leave;
+op_BEQ:
+    BRANCH((int64_t)RS1 == (int64_t)RS2);
+op_BNE:
+    BRANCH(RS1 != RS2);
+op_BLT:
+    BRANCH((int64_t)RS1 < (int64_t)RS2);
+op_BGE:
+    BRANCH((int64_t)RS1 >= (int64_t)RS2);
+op_BLTU:
+    BRANCH(RS1 < RS2);
+op_BGEU:
+    BRANCH(RS1 >= RS2);
+op_LB:
+    NEXT(RD = (int64_t)(int8_t)LOAD(8); x[0] = 0);
+op_LH:
+    NEXT(RD = (int64_t)(int16_t)LOAD(16); x[0] = 0);
+op_LW:
+    NEXT(RD = (int64_t)(int32_t)LOAD(32); x[0] = 0);
+op_LD:
+    NEXT(RD = (int64_t)LOAD(64); x[0] = 0);
+op_LBU:
+    NEXT(RD = LOAD(8); x[0] = 0);
+op_LHU:
+    NEXT(RD = LOAD(16); x[0] = 0);
+op_LWU:
+    NEXT(RD = LOAD(32); x[0] = 0);
+op_SB:
+    NEXT(STORE(8));
+op_SH:
+    NEXT(STORE(16));
+op_SW:
+    NEXT(STORE(32));
+op_SD:
+    NEXT(STORE(64));
+op_ADDI:
+    NEXT(RD = RS1 + (int64_t)IMM);
+op_SLLI:
+op_SLLI_64:
+    NEXT(RD = RS1 << (uint32_t)(IMM & 0x3f));
+op_SLTI:
+    NEXT(RD = (RS1 < (int64_t)IMM) ? 1 : 0);
+op_SLTIU:
+    if (IMM == 1)
+        NEXT(RD = RS1 == 0 ? 1 : 0);
+    NEXT(RD = (RS1 < IMM) ? 1 : 0);
+op_XORI:
+    NEXT(RD = RS1 ^ IMM);
+op_SRLI:
+op_SRLI_64:
+op_SRAI_64:
+    NEXT(RD = RS1 >> IMM);
+op_SRAI:
+    NEXT(RD = (int64_t)RS1 >> IMM);
+op_ORI:
+    NEXT(RD = RS1 | IMM);
+op_ANDI:
+    NEXT(RD = RS1 & IMM);
+op_ADD:
+    NEXT(RD = ((int64_t)RS1 + (int64_t)RS2));
+op_SUB:
+    NEXT(RD = ((int64_t)RS1 - (int64_t)RS2));
+op_SLL:
+    NEXT(RD = RS1 << (int64_t)RS2);
+op_SLT:
+    NEXT(RD = ((int64_t)RS1 < (int64_t)RS2) ? 1 : 0);
+op_SLTU:
+    if (u->rs1 == 0)
+        NEXT(RD = RS2 != 0 ? 1 : 0);
+    NEXT(RD = (RS1 < RS2) ? 1 : 0);
+op_XOR:
+    NEXT(RD = RS1 ^ RS2);
+op_SRL:
+    NEXT(RD = RS1 >> RS2);
+op_OR:
+    NEXT(RD = RS1 | RS2);
+op_AND:
+    NEXT(RD = RS1 & RS2);
+op_ADDIW:
+    NEXT(RD = ((int32_t)RS1) + (int32_t)IMM);
+op_SLLIW:
+    NEXT(RD = (int64_t)(((uint32_t)RS1) << ((uint32_t)(IMM & 0x3f) % 32)));
+op_SRLIW:
+    NEXT(RD = (uint64_t)(((uint32_t)RS1) >> ((uint32_t)(IMM & 0x3f) % 32)));
+op_SRAIW:
+    NEXT(RD = (int64_t)(((int32_t)RS1) >> (IMM % 32)));
+op_ADDW:
+    NEXT(RD = (int64_t)(((int32_t)RS1) + (int32_t)RS2));
+op_SUBW:
+    NEXT(RD = (int64_t)(((int32_t)RS1) - (int32_t)RS2));
+op_SLLW:
+    NEXT(RD = (int64_t)((int32_t)(RS1 << (RS2 % 32))));
+op_SRLW:
+    NEXT(RD = (int64_t)((int32_t)(((uint32_t)RS1) >> (RS2 % 32))));
+op_SRAW:
+    NEXT(RD = (int64_t)((int32_t)(((int32_t)RS1) >> (RS2 % 32))));
+op_SRA:
+    NEXT(RD = (int64_t)(((int64_t)RS1) >> (RS2 % 32)));
+op_MUL:
+    NEXT(RD = (int64_t)RS1 * (int64_t)RS2);
+op_MULW:
+    NEXT(RD = (int64_t)((int32_t)RS1 * (int32_t)RS2));
+op_MULH:
+    NEXT(RD = (((int128_t)(int64_t)RS1) * ((int128_t)(int64_t)RS2)) >> 64);
+op_MULHU:
+    NEXT(RD = ((uint128_t)RS1 * (uint128_t)RS2) >> 64);
+op_MULHSU:
+    NEXT(RD = ((int128_t)(((int128_t)(int64_t)RS1) * (uint128_t)RS2)) >> 64);
+// divisions and AUIPC, which never gets here, a block has it as a constant LUI
+op_DIV:
+op_DIVU:
+op_DIVW:
+op_DIVUW:
+op_REM:
+op_REMU:
+op_REMW:
+op_REMUW:
+op_AUIPC:
+    NEXT(u->fn(cpu, u));
+op_NOP:
+    NEXT();
+op_FUSED_LOAD:
+    NEXT(exec_FUSED_LOAD(cpu, u));
+op_FUSED_ZEXT:
+    NEXT(exec_FUSED_ZEXT(cpu, u));
+op_FUSED_JALR:
+    cpu->pc = b->end;
+    exec_FUSED_JALR(cpu, u);
+    goto leave;
+op_FUSED_CMP_BRANCH:
+    cpu->pc = b->end;
+    exec_FUSED_CMP_BRANCH(cpu, u);
+    goto leave;
+op_FENCE:
+op_FENCE_I:
+op_ECALL_EBREAK:
+op_CSR:
+op_AMO:
+op_invalid:
+    SYNC();
+    ret = u->fn(cpu, u);
+    if (ret)
+        return ret;
+    instret = cpu->stats.instret;
+    if (cache->flushes != flushes) {
+        // a callback or FENCE.I dropped the cache, b is gone
+        flushes = cache->flushes;
+        b = block_lookup(cpu, cpu->pc);
+        goto enter;
+    }
+    goto leave;
+op_BLOCK_END:
+fall:
+    // link[0] is NULL or the block at b->end
+    cpu->pc = b->end;
+    next = b->link[0];
+    if (next)
+        chained++;
+    else
+        next = b->link[0] = block_lookup(cpu, b->end);
+    b = next;
+    goto enter;
+leave:
+    next = b->link[cpu->pc != b->end];
+    if (b->flow & BLOCK_CALL)
+        ras_push(cache, b);
+    if (b->flow & BLOCK_INDIRECT)
+        next = block_indirect(cpu, b);
+    else if (next && next->pc == cpu->pc)
+        chained++;
+    else
+        next = b->link[cpu->pc != b->end] = block_lookup(cpu, cpu->pc);
+    b = next;
+enter:
+    if (!b || instret + b->insns > run_limit(cpu)) {
+        cpu->stats.instret = instret;
+        cpu->stats.block_chained += chained;
+        if (b)
+            return run_steps(cpu);
+        cpu->stop_reason = CPU_STOP_ERROR;
+        return -1;
+    }
+    instret += b->insns;
+    if (b->nfused)
+        for (int i = 0; i < CPU_FUSE_COUNT; i++)
+            cpu->stats.fused[i] += b->fused[i];
+    u = b->uops;
+    goto *labels[u->op];
+}
+
+int cpu_run_block(cpu_t *cpu) {
+    if (!cpu->blocks) {
+        cpu->blocks = calloc(1, sizeof(block_cache_t));
+        if (!cpu->blocks) {
+            cpu->stop_reason = CPU_STOP_ERROR;
+            return -1;
+        }
+        block_cache_flush(cpu); // marks the ras and ibtc entries empty
+    }
+    block_cache_t *cache = cpu->blocks;
+    if (cpu->engine == CPU_ENGINE_JIT && !cache->jit)
+        cache->jit = jit_new(&cache->ras, &cpu->bus); // NULL leaves everything to the interpreter
+
+    block_t *b = block_lookup(cpu, cpu->pc);
+    if (!cache->jit && !cpu->aot)
+        return block_run(cpu, b);
+    int interpret = 0; // native code of b refused to start, the budget is too small for it
+    for (;;) {
+        if (cpu->aot && !cache->head && aot_run(cpu))
+            b = block_lookup(cpu, cpu->pc); // translated code ran up to something it does not cover
+        if (!b) {
+            cpu->stop_reason = CPU_STOP_ERROR;
+            return -1;
+        }
+        if (cpu->stats.instret + b->insns > run_limit(cpu))
+            return run_steps(cpu);
+
+        const insn_t *u = b->uops;
+        const insn_t *last = u + b->n - 1;
+        uint64_t flushes = cache->flushes;
+        int exit = -1;
+        int ret;
+
+        if (cache->jit && !b->code && ++b->count >= JIT_THRESHOLD && jit_compile(cache->jit, b)) {
+            // code buffer full, start over
+            block_cache_flush(cpu);
+            b = block_lookup(cpu, cpu->pc);
+            continue;
+        }
+
+        if (cache->head) {
+            // recording runs in the interpreter and ends when the loop is back at its header
+            if (b == cache->head && cache->trace_n) {
+                if (!jit_compile_trace(cache->jit, cache->trace, cache->trace_n))
+                    cpu->stats.traces_compiled++;
+                cache->head = NULL;
+            } else if (cache->trace_n == TRACE_MAX_BLOCKS) {
+                cache->head = NULL;
+            } else {
+                cache->trace[cache->trace_n++] = b;
+            }
+        }
+
+        if (b->code && !cache->head && !interpret) {
+            // runs until a block exit that is not linked yet, b is the block that left
+            uint64_t r = jit_enter(cache->jit, cpu, b->code);
+            b = (block_t *)(uintptr_t)(r & ~(uint64_t)JIT_EXIT_MASK);
+            exit = r & JIT_EXIT_MASK;
+            ret = 0;
+            if (exit == JIT_EXIT_LIMIT) {
+                // b did not start, cpu->pc is its address
+                interpret = 1;
+                continue;
+            }
+            if (exit == JIT_EXIT_TRAP) {
+                u = &b->uops[b->n - 1];
+                cpu->pc = b->end;
+                ret = u->fn(cpu, u);
+            }
+        } else {
+            // only the last micro op can jump or stop, the others never look at cpu->pc
+            for (; u < last; u++)
+                u->fn(cpu, u);
+            cpu->pc = b->end;
+            cpu->stats.instret += b->insns;
+            if (b->nfused)
+                for (int i = 0; i < CPU_FUSE_COUNT; i++)
+                    cpu->stats.fused[i] += b->fused[i];
+            ret = u->fn(cpu, u);
+            interpret = 0;
+        }
+        if (ret) {
+            trace_abort(cache);
+            return ret;
+        }
+
+        if (cache->flushes != flushes) {
+            // a callback dropped the cache, b is gone
+            b = block_lookup(cpu, cpu->pc);
+            continue;
+        }
+
+        int slot = cpu->pc != b->end;
+        block_t *next = b->link[slot];
+        if (exit < 0 && (b->flow & BLOCK_CALL))
+            ras_push(cache, b); // native code pushes by itself
+        if (b->flow & BLOCK_INDIRECT) {
+            next = block_indirect(cpu, b);
+            if (next && next->code && exit == JIT_EXIT_JUMP && b->ic[0])
+                jit_retarget(b, next);
+        } else if (next && next->pc == cpu->pc) {
+            cpu->stats.block_chained++;
+        } else {
+            next = block_lookup(cpu, cpu->pc);
+            b->link[slot] = next;
+        }
+        if (next && next->code && !next->traced && slot && next->pc <= b->pc && !cache->head) {
+            // backward jump to compiled code, record the loop before linking to it
+            next->traced = 1;
+            cache->head = next;
+            cache->trace_n = 0;
+        } else if (next && next->code && exit >= 0 && exit < JIT_EXIT_TRAP && b->patch[exit] && b->target[exit] == next->pc) {
+            // native code can go on to native code without coming back here
+            jit_link(b, exit, next);
+        }
+        b = next;
+    }
+}
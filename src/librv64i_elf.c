@@ -0,0 +1,167 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// ELF64 executables for the guest. the PT_LOAD segments are placed at their addresses in
+// dram through dram_load_file, so the usual page aligned layout of a linked executable is
+// mapped copy on write like cpu_load_image does it. bss is zeroed here instead of by the
+// startup code, and the functions and objects of the symbol table are kept sorted by
+// address for cpu_symbol_find.
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+struct symtab_t {
+    cpu_symbol_t *syms; // by address, the largest of equal addresses last
+    uint64_t count;
+    char *names; // string table of the image, syms point into it
+};
+
+static int elf_read(int fd, void *buf, uint64_t len, uint64_t off) {
+    for (uint64_t done = 0; done < len;) {
+        ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, off + done);
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// count entries of size bytes at off, NULL if there are none or the file is too short
+static void *elf_table(int fd, uint64_t off, uint64_t count, uint64_t size) {
+    if (!count || count > UINT32_MAX)
+        return NULL;
+    void *p = malloc(count * size);
+    if (p && elf_read(fd, p, count * size, off)) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static int elf_sym_cmp(const void *a, const void *b) {
+    const cpu_symbol_t *x = a;
+    const cpu_symbol_t *y = b;
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    return x->size < y->size ? -1 : x->size > y->size;
+}
+
+// named code and data of the first SHT_SYMTAB, labels included. NULL for a stripped image
+static symtab_t *elf_symtab(int fd, const Elf64_Ehdr *eh) {
+    Elf64_Shdr *sh = NULL;
+    Elf64_Sym *sym = NULL;
+    symtab_t *st = NULL;
+    uint64_t nsym = 0;
+    int i;
+
+    if (eh->e_shentsize != sizeof(Elf64_Shdr) || !(sh = elf_table(fd, eh->e_shoff, eh->e_shnum, sizeof(Elf64_Shdr))))
+        return NULL;
+    for (i = 0; i < eh->e_shnum && !(sh[i].sh_type == SHT_SYMTAB && sh[i].sh_link < eh->e_shnum); i++)
+        ;
+    if (i == eh->e_shnum)
+        goto out;
+    nsym = sh[i].sh_size / sizeof(Elf64_Sym);
+    const Elf64_Shdr *str = &sh[sh[i].sh_link];
+    if (!(sym = elf_table(fd, sh[i].sh_offset, nsym, sizeof(Elf64_Sym))) || !(st = calloc(1, sizeof(symtab_t))) ||
+        !(st->names = malloc(str->sh_size + 1)) || elf_read(fd, st->names, str->sh_size, str->sh_offset) ||
+        !(st->syms = malloc(nsym * sizeof(cpu_symbol_t)))) {
+        symtab_free(st);
+        st = NULL;
+        goto out;
+    }
+    st->names[str->sh_size] = 0;
+    for (uint64_t k = 0; k < nsym; k++) {
+        int type = ELF64_ST_TYPE(sym[k].st_info);
+        const char *name = sym[k].st_name < str->sh_size ? st->names + sym[k].st_name : "";
+        // sections, files, absolute linker script values and mapping symbols ($x, $d) say nothing about the code
+        if ((type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE) || !*name || *name == '$' || sym[k].st_shndx == SHN_UNDEF ||
+            sym[k].st_shndx >= SHN_LORESERVE)
+            continue;
+        st->syms[st->count++] = (cpu_symbol_t){.addr = sym[k].st_value, .size = sym[k].st_size, .name = name};
+    }
+    qsort(st->syms, st->count, sizeof(cpu_symbol_t), elf_sym_cmp);
+out:
+    free(sh);
+    free(sym);
+    return st;
+}
+
+void symtab_free(symtab_t *st) {
+    if (!st)
+        return;
+    free(st->syms);
+    free(st->names);
+    free(st);
+}
+
+int cpu_load_elf(cpu_t *cpu, const char *path) {
+    dram_t *dram = &cpu->bus.dram;
+    uint64_t page = dram_page_size();
+    Elf64_Ehdr eh;
+    Elf64_Phdr *ph = NULL;
+    int ret = -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (elf_read(fd, &eh, sizeof(eh), 0) || memcmp(eh.e_ident, ELFMAG, SELFMAG) || eh.e_ident[EI_CLASS] != ELFCLASS64 ||
+        eh.e_ident[EI_DATA] != ELFDATA2LSB || eh.e_machine != EM_RISCV || eh.e_type != ET_EXEC || eh.e_phentsize != sizeof(Elf64_Phdr) ||
+        !(ph = elf_table(fd, eh.e_phoff, eh.e_phnum, sizeof(Elf64_Phdr))))
+        goto out;
+
+    // all segments have to fit before dram is changed
+    for (int i = 0; i < eh.e_phnum; i++) {
+        uint64_t off = ph[i].p_vaddr - dram->base;
+        if (ph[i].p_type == PT_LOAD && (ph[i].p_filesz > ph[i].p_memsz || off > dram->size || ph[i].p_memsz > dram->size - off))
+            goto out;
+    }
+    for (int i = 0; i < eh.e_phnum; i++) {
+        if (ph[i].p_type != PT_LOAD)
+            continue;
+        uint64_t off = ph[i].p_vaddr - dram->base;
+        uint64_t end = off + ph[i].p_memsz;
+        if (dram_load_file(dram, off, fd, ph[i].p_offset, ph[i].p_filesz))
+            goto out;
+        // bss, and when the segment was mapped the file bytes after it in its last page. the segments
+        // are sorted by address, a later one that starts in that page is loaded after this
+        uint64_t tail = (off + ph[i].p_filesz + page - 1) / page * page;
+        if (tail > dram->size)
+            tail = dram->size;
+        for (int k = i + 1; k < eh.e_phnum; k++)
+            if (ph[k].p_type == PT_LOAD && ph[k].p_vaddr - dram->base >= end && ph[k].p_vaddr - dram->base < tail)
+                tail = ph[k].p_vaddr - dram->base;
+        dram_zero(dram, off + ph[i].p_filesz, (end > tail ? end : tail) - (off + ph[i].p_filesz));
+    }
+
+    symtab_free(cpu->symtab);
+    cpu->symtab = elf_symtab(fd, &eh);
+    cpu->pc = eh.e_entry;
+    cpu->regs[10] = 1; // a0: bss is clear, see test/startup.rv64i.s
+    ret = 0;
+out:
+    free(ph);
+    close(fd);
+    return ret;
+}
+
+const cpu_symbol_t *cpu_symbol_find(cpu_t *cpu, uint64_t addr) {
+    const symtab_t *st = cpu->symtab;
+    if (!st || !st->count || addr < st->syms[0].addr)
+        return NULL;
+    // the last symbol at or below addr
+    uint64_t lo = 0;
+    uint64_t hi = st->count;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (st->syms[mid].addr <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const cpu_symbol_t *s = &st->syms[lo];
+    return !s->size || addr - s->addr < s->size ? s : NULL;
+}
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE // REG_ERR and REG_EFL of the signal context
+
+#include "librv64i_internal.h"
+
+// host page protection of dram: the guard page reservation of cpu_config_t.guard, and the
+// write protection that tracks the pages stored to after cpu_snapshot.
+//
+// the guest offset is truncated to 32 bits and used as is, so the host address space
+// behind dram must cover all of them: 4 GiB plus a page for an access at the very end.
+// only dram is read/write, the rest is PROT_NONE and faults. the SIGSEGV handler makes
+// a faulting load read 0 by mapping the (zero filled) page read only, later loads of
+// it do not fault again. a faulting store is let through onto the page with the trap
+// flag set, and the SIGTRAP after that one instruction throws the page's contents away
+// again. both work for the interpreters and native code alike, without knowing which
+// host instruction faulted. faults outside any guard reservation go to the handler
+// that was installed before.
+//
+// a tracked dram is read only, the first store to a page faults, marks the page dirty in
+// the snapshot and makes it writable. cpu_restore protects the dirty pages again. pages
+// with decoded code are protected the same way, see librv64i_smc.c, a store to one marks
+// it written for the next FENCE.I.
+//
+// this is the state the library keeps for the whole process: the handlers, the ones they
+// replaced, and the table the handlers find the cpu of a faulting address in. only cpus
+// with guard pages or a tracked snapshot are in it, GUARD_MAX_CPUS at a time. a cpu that
+// does not fit runs as if the host had no support, a fault looks at the slots up to the
+// highest one ever taken.
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#define GUARD_PAGE 4096
+#define GUARD_SIZE ((1ull << 32) + GUARD_PAGE)
+#define GUARD_MAX_CPUS 4096
+#define EFL_TF 0x100 // trap after the next instruction
+#define ERR_WRITE 2  // page fault error code: the access was a write
+
+static cpu_t *guard_cpus[GUARD_MAX_CPUS]; // reservations and tracked drams the handlers know about
+static int guard_used;                    // guard_cpus[guard_used] and after were never taken
+static struct sigaction guard_old_segv;
+static struct sigaction guard_old_trap;
+static __thread uint8_t *guard_pending[2]; // pages a dropped store is being stepped over, two if it straddles
+
+static uint8_t *guard_page(void *addr) { return (uint8_t *)((uintptr_t)addr & ~(uintptr_t)(GUARD_PAGE - 1)); }
+
+static cpu_t *guard_find(uint8_t *addr) {
+    int used = __atomic_load_n(&guard_used, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < used; i++) {
+        cpu_t *cpu = __atomic_load_n(&guard_cpus[i], __ATOMIC_ACQUIRE);
+        if (cpu && addr >= cpu->bus.dram.mem && addr < cpu->bus.dram.mem + (cpu->bus.guard ? GUARD_SIZE : cpu->bus.dram.size))
+            return cpu;
+    }
+    return NULL;
+}
+
+// hand a signal that is not ours to whoever had it before
+static void guard_chain(const struct sigaction *old, int sig, siginfo_t *si, void *ctx) {
+    if (old->sa_flags & SA_SIGINFO) {
+        old->sa_sigaction(sig, si, ctx);
+    } else if (old->sa_handler == SIG_DFL) {
+        signal(sig, SIG_DFL); // a fault happens again when we return, a trap has to be raised
+        if (sig == SIGTRAP)
+            raise(sig);
+    } else if (old->sa_handler != SIG_IGN) {
+        old->sa_handler(sig);
+    }
+}
+
+static void guard_segv(int sig, siginfo_t *si, void *ctx) {
+    ucontext_t *uc = ctx;
+    cpu_t *cpu = guard_find(si->si_addr);
+    if (!cpu || guard_pending[1]) {
+        guard_chain(&guard_old_segv, sig, si, ctx);
+        return;
+    }
+    uint8_t *page = guard_page(si->si_addr);
+    snapshot_t *snap = cpu->snap;
+    uint64_t i = (page - cpu->bus.dram.mem) / GUARD_PAGE;
+    int hit = code_written(cpu, i);
+    if (snap && snap->tracked && i < snap->pages) {
+        __atomic_fetch_or(&snap->dirty[i / 64], 1ull << (i % 64), __ATOMIC_RELAXED);
+        hit = 1;
+    }
+    if (hit) {
+        mprotect(page, GUARD_PAGE, PROT_READ | PROT_WRITE);
+        return;
+    }
+    if (!cpu->bus.guard) {
+        guard_chain(&guard_old_segv, sig, si, ctx);
+        return;
+    }
+    cpu->stats.guard_faults++;
+    if (uc->uc_mcontext.gregs[REG_ERR] & ERR_WRITE) {
+        mprotect(page, GUARD_PAGE, PROT_READ | PROT_WRITE);
+        guard_pending[guard_pending[0] ? 1 : 0] = page;
+        uc->uc_mcontext.gregs[REG_EFL] |= EFL_TF;
+    } else {
+        mprotect(page, GUARD_PAGE, PROT_READ);
+    }
+}
+
+static void guard_trap(int sig, siginfo_t *si, void *ctx) {
+    ucontext_t *uc = ctx;
+    if (!guard_pending[0]) {
+        guard_chain(&guard_old_trap, sig, si, ctx);
+        return;
+    }
+    for (int i = 0; i < 2 && guard_pending[i]; i++) {
+        madvise(guard_pending[i], GUARD_PAGE, MADV_DONTNEED); // private anonymous memory reads as zeros again
+        mprotect(guard_pending[i], GUARD_PAGE, PROT_READ);
+        guard_pending[i] = NULL;
+    }
+    uc->uc_mcontext.gregs[REG_EFL] &= ~EFL_TF;
+}
+
+static int guard_install(void) {
+    static int installed;
+    if (__atomic_exchange_n(&installed, 1, __ATOMIC_ACQ_REL))
+        return 0;
+    struct sigaction sa = {0};
+    sa.sa_sigaction = guard_segv;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, &guard_old_segv))
+        return -1;
+    sa.sa_sigaction = guard_trap;
+    return sigaction(SIGTRAP, &sa, &guard_old_trap);
+}
+
+static int guard_register(cpu_t *cpu) {
+    for (int i = 0; i < GUARD_MAX_CPUS; i++) {
+        cpu_t *none = NULL;
+        if (__atomic_load_n(&guard_cpus[i], __ATOMIC_RELAXED) == cpu)
+            return 0;
+        if (__atomic_compare_exchange_n(&guard_cpus[i], &none, cpu, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            int used = __atomic_load_n(&guard_used, __ATOMIC_RELAXED);
+            while (used <= i && !__atomic_compare_exchange_n(&guard_used, &used, i + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+            return 0;
+        }
+    }
+    return -1; // more cpus than the handlers keep track of
+}
+
+static void guard_unregister(cpu_t *cpu) {
+    int used = __atomic_load_n(&guard_used, __ATOMIC_RELAXED);
+    for (int i = 0; i < used; i++)
+        if (__atomic_load_n(&guard_cpus[i], __ATOMIC_RELAXED) == cpu)
+            __atomic_store_n(&guard_cpus[i], NULL, __ATOMIC_RELEASE);
+}
+
+int guard_reserve(cpu_t *cpu) {
+    // the end of dram has to be a page boundary for the first byte after it to fault
+    if (cpu->bus.dram.size > GUARD_SIZE - GUARD_PAGE || cpu->bus.dram.size % GUARD_PAGE || guard_install())
+        return -1;
+    uint8_t *mem = mmap(NULL, GUARD_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+    cpu->bus.dram.mem = mem;
+    if (mprotect(mem, cpu->bus.dram.size, PROT_READ | PROT_WRITE) || guard_register(cpu)) {
+        munmap(mem, GUARD_SIZE);
+        cpu->bus.dram.mem = NULL;
+        return -1;
+    }
+    cpu->bus.guard = 1;
+    return 0;
+}
+
+void guard_release(cpu_t *cpu) {
+    guard_unregister(cpu);
+    munmap(cpu->bus.dram.mem, GUARD_SIZE);
+}
+
+int guard_watch(cpu_t *cpu) { return guard_install() || guard_register(cpu) ? -1 : 0; }
+
+void guard_forget(cpu_t *cpu) { guard_unregister(cpu); }
+
+int guard_track(cpu_t *cpu) {
+    if (guard_watch(cpu) || mprotect(cpu->bus.dram.mem, cpu->bus.dram.size, PROT_READ))
+        return -1;
+    return 0;
+}
+
+void guard_untrack(cpu_t *cpu) { mprotect(cpu->bus.dram.mem, cpu->bus.dram.size, PROT_READ | PROT_WRITE); }
+
+void guard_protect(cpu_t *cpu, uint64_t off, uint64_t len) { mprotect(cpu->bus.dram.mem + off, len, PROT_READ); }
+void guard_unprotect(cpu_t *cpu, uint64_t off, uint64_t len) { mprotect(cpu->bus.dram.mem + off, len, PROT_READ | PROT_WRITE); }
+
+#else
+
+// no guard pages on this host, dram is range checked. stores are not tracked, cpu_restore copies all of dram
+// and FENCE.I drops all translations
+
+int guard_reserve(cpu_t *cpu) { return -1; }
+void guard_release(cpu_t *cpu) {}
+int guard_track(cpu_t *cpu) { return -1; }
+void guard_untrack(cpu_t *cpu) {}
+void guard_protect(cpu_t *cpu, uint64_t off, uint64_t len) {}
+void guard_unprotect(cpu_t *cpu, uint64_t off, uint64_t len) {}
+int guard_watch(cpu_t *cpu) { return -1; }
+void guard_forget(cpu_t *cpu) {}
+
+#endif
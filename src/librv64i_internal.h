@@ -0,0 +1,301 @@
+#ifndef LIBRISC_INTERNAL_H
+#define LIBRISC_INTERNAL_H
+
+// shared between the execution engines of the library, not part of the api
+
+#include <stdio.h>
+#include <string.h>
+
+#include "librv64i.h"
+
+// every instruction the decoder knows. the order defines the OP_ enum
+#define RV_OPS(X)                                                                                                                                              \
+    X(invalid)                                                                                                                                                 \
+    X(LB) X(LH) X(LW) X(LD) X(LBU) X(LHU) X(LWU)                                                                                                               \
+    X(FENCE) X(FENCE_I)                                                                                                                                        \
+    X(ADDI) X(SLLI) X(SLLI_64) X(SLTI) X(SLTIU) X(XORI) X(SRLI) X(SRLI_64) X(SRAI) X(SRAI_64) X(ORI) X(ANDI)                                                   \
+    X(AUIPC)                                                                                                                                                   \
+    X(ADDIW) X(SLLIW) X(SRLIW) X(SRAIW)                                                                                                                        \
+    X(SB) X(SH) X(SW) X(SD)                                                                                                                                    \
+    X(ADD) X(MUL) X(SUB) X(SLL) X(MULH) X(SLT) X(MULHSU) X(SLTU) X(MULHU) X(XOR) X(DIV) X(SRL) X(DIVU) X(SRA) X(OR) X(REM) X(AND) X(REMU)                     \
+    X(LUI)                                                                                                                                                     \
+    X(ADDW) X(MULW) X(SUBW) X(SLLW) X(DIVW) X(SRLW) X(DIVUW) X(SRAW) X(REMW) X(REMUW)                                                                          \
+    X(BEQ) X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU)                                                                                                                \
+    X(JALR) X(JAL)                                                                                                                                             \
+    X(ECALL_EBREAK) X(CSR)                                                                                                                                     \
+    X(AMO) /* rv64 A: LR, SC and the AMOs, .W and .D */                                                                                                        \
+    X(NOP) /* rewritten by rv_decode: an instruction that only writes x0 */
+
+enum {
+#define OP_ENUM(name) OP_##name,
+    RV_OPS(OP_ENUM)
+#undef OP_ENUM
+        OP_COUNT
+};
+
+typedef __int128_t int128_t;
+typedef __uint128_t uint128_t;
+
+// guard page backing of dram, see librv64i_guard.c
+// sets cpu->bus.dram.mem and guard, returns -1 when the host has no support
+int guard_reserve(cpu_t *cpu);
+void guard_release(cpu_t *cpu);
+// write protect dram so the first store to each page marks it in cpu->snap->dirty, -1 when the
+// host can not. guard_protect protects pages again after cpu_restore wrote them back
+int guard_track(cpu_t *cpu);
+void guard_untrack(cpu_t *cpu);
+void guard_protect(cpu_t *cpu, uint64_t off, uint64_t len);
+void guard_unprotect(cpu_t *cpu, uint64_t off, uint64_t len);
+// let the fault handler see stores to write protected pages of dram, -1 when the host can not.
+// guard_forget when the cpu goes away
+int guard_watch(cpu_t *cpu);
+void guard_forget(cpu_t *cpu);
+
+// dram pages that decoded instructions or translated blocks were made from, see librv64i_smc.c
+typedef struct codemap_t {
+    uint64_t pages;   // of 1 << shift bytes
+    int shift;        // log2 of dram_page_size
+    int tracked;      // code pages are write protected, otherwise FENCE.I drops every translation
+    uint64_t *code;   // bitmap of the pages with translations
+    uint64_t *written; // bitmap of code pages stored to since, set by the fault handler
+} codemap_t;
+
+int code_init(cpu_t *cpu);
+void code_free(cpu_t *cpu);
+// cpu_snapshot made dram read only and the fault handler knows the cpu, protect code pages from now on
+void code_track(cpu_t *cpu);
+void code_page_add(cpu_t *cpu, uint64_t page);
+// protect the page of dram at addr before something is decoded from it
+static inline void code_mark(cpu_t *cpu, uint64_t addr) {
+    codemap_t *c = cpu->code;
+    uint64_t page = (addr - cpu->bus.dram.base) >> c->shift;
+    if (page < c->pages && !(c->code[page / 64] & (1ull << (page % 64))))
+        code_page_add(cpu, page);
+}
+// a store to page faulted, returns 0 if it holds no code
+int code_written(cpu_t *cpu, uint64_t page);
+// drop the translations of the written pages, or of all pages when stores are not tracked. FENCE.I
+void code_sync(cpu_t *cpu);
+// forget every code page, the translations were dropped
+void code_clear(cpu_t *cpu);
+// write protect the code pages again after all of dram was made writable
+void code_protect(cpu_t *cpu);
+
+// the state cpu_restore returns to, see librv64i_snapshot.c
+typedef struct snapshot_t {
+    uint64_t regs[32];
+    uint64_t pc;
+    uint8_t *mem;    // copy of dram
+    uint64_t pages;  // dram pages of dram_page_size bytes
+    uint64_t *dirty; // bitmap of the pages stored to since the snapshot or the last restore
+    int tracked;     // stores set dirty, otherwise every page is restored
+} snapshot_t;
+
+void snapshot_free(cpu_t *cpu);
+// the snapshot file format, to and from an open file
+int snapshot_write(cpu_t *cpu, FILE *f);
+int snapshot_load(cpu_t *cpu, int fd);
+
+// what the cpus of a template share, see librv64i_template.c
+struct cpu_template_t {
+    int refs;            // the creator and every cpu started from it
+    cpu_config_t config; // engine, dram layout and guard of the cpus
+    int fd;              // registers, pc and dram in the snapshot file format
+    int icache_fd;       // the decoded instructions of the cpu
+    uint64_t *code;      // the codemap_t.code bitmap of the cpu, the pages they were decoded from
+    struct aot_t *aot;   // NULL without a translation
+};
+
+void template_put(cpu_template_t *t);
+
+// symbols of the image from cpu_load_elf, see librv64i_elf.c
+typedef struct symtab_t symtab_t;
+void symtab_free(symtab_t *st);
+
+// host pages backing dram. dram_resident sets bit 0 of vec[i] if page + i has been touched and
+// returns -1 where the host can not tell. pages that were never touched read as 0
+uint64_t dram_page_size(void);
+int dram_resident(const dram_t *dram, uint64_t page, uint64_t n, unsigned char *vec);
+// len bytes of fd from file_off to dram at off, both in range. mapped copy on write when they are page
+// aligned, read otherwise. returns -1 if the file is shorter
+int dram_load_file(dram_t *dram, uint64_t off, int fd, uint64_t file_off, uint64_t len);
+// zero len bytes at off, whole pages are swapped for untouched ones
+void dram_zero(dram_t *dram, uint64_t off, uint64_t len);
+
+// host pointer to the n bytes of dram at guest address addr, NULL if any of them is outside
+static inline uint8_t *bus_ptr(bus_t *bus, uint64_t addr, uint64_t n) {
+    if (bus->guard)
+        return bus->dram.mem + (uint32_t)(addr - bus->dram.base); // the host faults outside dram
+    if (addr - bus->dram.base > bus->dram.size - n)
+        return NULL;
+    return bus->dram.mem + (addr - bus->dram.base);
+}
+
+// devices of cpu_device_add, see librv64i_mmio.c. the accesses that missed dram, size in bits
+uint64_t mmio_load(bus_t *bus, uint64_t addr, uint64_t size);
+void mmio_store(bus_t *bus, uint64_t addr, uint64_t size, uint64_t value);
+void mmio_reset(bus_t *bus);
+void mmio_free(bus_t *bus);
+// an empty device table if there is none, so harts sharing the bus see the devices added later
+int mmio_share(bus_t *bus);
+
+// harts sharing the dram and devices of one cpu, see librv64i_smp.c
+#define LR_NONE 1 // cpu_t.lr_addr without a reservation, LR addresses are aligned
+// LR, SC or an AMO with rs1 = a and rs2 = b, the value for rd in *v. -1 if the address is not aligned or not in dram
+int amo_exec(cpu_t *cpu, const insn_t *in, uint64_t a, uint64_t b, uint64_t *v);
+// a CSR instruction, the value for rd in *v. only reads of mhartid, -1 for anything else
+int csr_exec(cpu_t *cpu, const insn_t *in, uint64_t *v);
+// FENCE orders earlier stores before later loads, the one order a TSO host like x86-64 does not keep
+// by itself. FENCE.TSO does not ask for it
+static inline int fence_store_load(uint32_t inst) { return (inst >> 28) != 0x8 && (inst >> 24 & 1) && (inst >> 21 & 1); }
+// the host fence for FENCE inst
+static inline void fence_exec(uint32_t inst) {
+    if (fence_store_load(inst))
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    else
+        __atomic_thread_fence(__ATOMIC_ACQ_REL);
+}
+
+// guest memory is little endian, so on little endian hosts an access is one (unaligned) host
+// load or store. elsewhere dram_load/dram_store put the bytes together. size is in bits and a
+// constant at every call site. dram is one range check, what misses it goes to the devices,
+// without one loads return 0 and stores are dropped
+static inline uint64_t bus_load(bus_t *bus, uint64_t addr, uint64_t size) {
+    uint8_t *p = bus_ptr(bus, addr, size / 8);
+    uint64_t v = 0;
+    if (!p)
+        return bus->mmio ? mmio_load(bus, addr, size) : 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&v, p, size / 8);
+#else
+    v = dram_load(&bus->dram, addr - bus->dram.base, size);
+#endif
+    return v;
+}
+
+static inline void bus_store(bus_t *bus, uint64_t addr, uint64_t size, uint64_t value) {
+    uint8_t *p = bus_ptr(bus, addr, size / 8);
+    if (!p) {
+        if (bus->mmio)
+            mmio_store(bus, addr, size, value);
+        return;
+    }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(p, &value, size / 8);
+#else
+    dram_store(&bus->dram, addr - bus->dram.base, size, value);
+#endif
+}
+
+// instructions come from dram only, reading a device for them could have side effects
+static inline uint32_t bus_fetch(bus_t *bus, uint64_t addr) { return bus_ptr(bus, addr, 4) ? bus_load(bus, addr, 32) : 0; }
+
+// the cpu_handlers_t of the cpu, a missing ecall or ebreak handler stops it
+static inline int handle_ecall(cpu_t *cpu, uint32_t inst) { return cpu->handlers.ecall ? cpu->handlers.ecall(cpu->handlers.ctx, cpu, inst) : 1; }
+static inline int handle_ebreak(cpu_t *cpu, uint32_t inst) { return cpu->handlers.ebreak ? cpu->handlers.ebreak(cpu->handlers.ctx, cpu, inst) : 1; }
+static inline void handle_invop(cpu_t *cpu, uint32_t inst) {
+    if (cpu->handlers.invop)
+        cpu->handlers.invop(cpu->handlers.ctx, cpu, inst);
+}
+
+void rv_decode(uint32_t inst, insn_t *in);
+// cpu_init_config, with the icache mapped copy on write from icache_fd unless that is -1, and with the
+// dram and devices of owner unless that is NULL
+int cpu_init_shared(cpu_t *cpu, const cpu_config_t *config, int icache_fd, cpu_t *owner);
+extern const exec_fn rv_exec_table[OP_COUNT];
+
+// cpu->limit, cpu_stop sets it from other threads
+static inline uint64_t run_limit(const cpu_t *cpu) { return __atomic_load_n(&cpu->limit, __ATOMIC_RELAXED); }
+
+int cpu_run_threaded(cpu_t *cpu);
+
+// a translated basic block, see librv64i_block.c
+#define BLOCK_MAX_INSNS 64
+#define TRACE_MAX_BLOCKS 8 // blocks in one recorded loop iteration
+
+// superinstructions of the block translator, see block_fuse. never seen by the other engines
+enum {
+    OP_FUSED_LOAD = OP_COUNT, // rs1 = imm, rd = load rs2 (LD/LW/LWU) from imm + (int32_t)inst
+    OP_FUSED_JALR,            // rs1 = imm, jump to (imm + (int32_t)inst) & ~1, rd = return address
+    OP_FUSED_ZEXT,            // rd = (rs1 << imm) >> inst
+    OP_FUSED_CMP_BRANCH,      // rd = compare, branch on rd. inst: offset, compare op << 16, BNE << 24
+    OP_BLOCK_END,             // after the last micro op of a block, not counted in block_t.n
+};
+
+// how the last instruction of a block leaves it, for the indirect branch target cache
+#define BLOCK_CALL 1     // JAL/JALR writing the return address to x1 or x5
+#define BLOCK_RETURN 2   // JALR through x1 or x5 that does not link
+#define BLOCK_INDIRECT 4 // JALR with a computed target
+
+typedef struct block_t {
+    uint64_t pc;             // guest address of the first instruction
+    uint64_t end;            // guest address after the last instruction
+    struct block_t *hnext;   // hash chain
+    struct block_t *link[2]; // successors, [0] continues at end, [1] went anywhere else
+    uint32_t n;              // number of micro ops
+    uint32_t insns;          // number of instructions
+    uint32_t nfused;         // fused pairs, per pattern in fused
+    uint8_t fused[CPU_FUSE_COUNT];
+    uint32_t count;          // executions in the interpreter, for the jit
+    uint32_t traced;         // a trace starting here was recorded (or tried)
+    void *code;              // native code once compiled
+    uint8_t *patch[2];       // rel32 of the native exits to chain, NULL for computed targets
+    uint64_t target[2];      // guest address the native exits go to
+    uint32_t flow;           // BLOCK_CALL, BLOCK_RETURN, BLOCK_INDIRECT
+    struct block_t *ret;     // BLOCK_CALL: the block at end, where the callee returns to
+    uint8_t *ic[2];          // BLOCK_INDIRECT: imm64 and rel32 of the native inline cache, see jit_retarget
+    uint64_t jalr_hits;      // BLOCK_INDIRECT: target found without a full lookup
+    uint64_t jalr_misses;
+    insn_t uops[];
+} block_t;
+
+// return address stack. calls push their block, a return that goes to where the top
+// entry's call returns to takes the block from there. top wraps around
+#define RAS_SIZE 16
+typedef struct ras_entry_t {
+    uint64_t pc; // return address, odd when empty
+    block_t *caller;
+} ras_entry_t;
+
+typedef struct ras_t {
+    uint64_t top;
+    ras_entry_t e[RAS_SIZE];
+} ras_t;
+
+int cpu_run_block(cpu_t *cpu);
+// the two micro ops a superinstruction stands for, returns 1 and copies u for anything else
+int block_unfuse(const insn_t *u, insn_t out[2]);
+void block_cache_flush(cpu_t *cpu);
+void block_cache_free(cpu_t *cpu);
+
+// native code generation for hot blocks, see librv64i_jit_x86_64.c
+typedef struct jit_t jit_t;
+
+// value returned by jit_enter: the block that left native code, or'ed with the exit taken
+#define JIT_EXIT_NEXT 0 // continues at b->end
+#define JIT_EXIT_JUMP 1 // b->target[1], or a computed JALR target already in cpu->pc
+#define JIT_EXIT_TRAP 2 // native code stops before the last micro op, the caller executes it
+#define JIT_EXIT_LIMIT 3 // the block did not start, it would go past cpu->limit
+#define JIT_EXIT_MASK 3
+
+jit_t *jit_new(ras_t *ras, const bus_t *bus);
+void jit_free(jit_t *jit);
+void jit_reset(jit_t *jit);
+int jit_compile(jit_t *jit, block_t *b);
+int jit_compile_trace(jit_t *jit, block_t **blocks, int n);
+uint64_t jit_enter(jit_t *jit, cpu_t *cpu, void *code);
+void jit_link(block_t *from, int exit, block_t *to);
+// point the inline cache of the JALR that ends from at to
+void jit_retarget(block_t *from, block_t *to);
+
+// ahead of time translated image, see librv64i_aot.c
+typedef struct aot_t aot_t;
+
+// run translated code from cpu->pc, returns the number of instructions executed (0: pc is not translated)
+uint64_t aot_run(cpu_t *cpu);
+void aot_free(cpu_t *cpu);
+// another reference to the same shared object, NULL if it could not be opened again
+aot_t *aot_dup(const aot_t *aot);
+void aot_close(aot_t *aot);
+
+#endif
@@ -0,0 +1,1253 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "librv64i_internal.h"
+
+// x86-64 code generation for hot basic blocks.
+//
+// rbx holds the cpu_t pointer for as long as native code runs and the guest registers
+// are read and written at their place in cpu->regs, rbp holds cpu->bus.dram.mem.
+// rax, rcx and rdx are scratch.
+// all blocks share one frame: jit_enter pushes rbx and rbp and jumps into the block, every
+// exit stores the next pc, and either jumps straight into the native code of the
+// successor (once jit_link patched it) or returns the block and exit to the caller.
+// ECALL/EBREAK, CSRs, atomics and invalid instructions are not compiled, the block
+// returns before them and the caller executes them with the interpreter handler, which
+// calls the cpu_handlers_t of the cpu as usual.
+// calls push the return address stack of the block engine from native code, and a
+// JALR compares its target with the last one of the site before it returns to the
+// dispatcher, which resolves it and points the compare at the new target.
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_UOP_SIZE 128 // upper bound of the code emitted for one micro op
+#define JIT_MAX_EXIT_SIZE 192 // a JALR with its ras push, inline cache and exit
+
+struct jit_t {
+    uint8_t *base; // rwx mapping
+    uint8_t *end;
+    uint8_t *p;        // next free byte
+    uint8_t *enter;    // push rbx; push rbp; mov rbx, rdi; mov rbp, [rbx + OFF_MEM]; jmp rsi
+    uint8_t *epilogue; // pop rbp; pop rbx; ret
+    // what the trace compiler knows while emitting, see jit_compile_trace
+    uint32_t known;     // guest registers with a constant value, x0 always
+    uint64_t val[32];   // their values
+    uint32_t safe;      // base registers whose accesses were range checked before the loop
+    ras_t *ras;         // return address stack of the block engine
+    int guard;          // dram is a guard page reservation, accesses are not range checked
+    uint64_t dram_base; // guest layout of the cpu the code is for
+    uint64_t dram_size;
+};
+
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RBP = 5 };
+
+// condition codes for jcc/setcc
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_NS = 0x9, CC_L = 0xc, CC_GE = 0xd };
+
+// group 1 alu extensions for 81 /ext, and the matching 01 /r style opcodes
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+// group 2 shift extensions for c1 /ext and d3 /ext
+enum { SH_SHL = 4, SH_SHR = 5, SH_SAR = 7 };
+
+#define OFF_REG(i) (int32_t)(offsetof(cpu_t, regs) + 8 * (i))
+#define OFF_PC (int32_t)offsetof(cpu_t, pc)
+#define OFF_MEM (int32_t)offsetof(cpu_t, bus.dram.mem)
+#define OFF_INSTRET (int32_t)offsetof(cpu_t, stats.instret)
+#define OFF_LIMIT (int32_t)offsetof(cpu_t, limit)
+
+static int fits32(int64_t v) { return v == (int32_t)v; }
+
+static void emit8(jit_t *j, uint8_t b) { *j->p++ = b; }
+
+static void emit32(jit_t *j, uint32_t v) {
+    memcpy(j->p, &v, 4);
+    j->p += 4;
+}
+
+static void emit64(jit_t *j, uint64_t v) {
+    memcpy(j->p, &v, 8);
+    j->p += 8;
+}
+
+static void rex_w(jit_t *j, int w) {
+    if (w)
+        emit8(j, 0x48);
+}
+
+// modrm for [rbx + disp32]
+static void modrm_rbx(jit_t *j, int reg, int32_t disp) {
+    emit8(j, 0x80 | reg << 3 | RBX);
+    emit32(j, disp);
+}
+
+// modrm for [rcx + disp32]
+static void modrm_rcx(jit_t *j, int reg, int32_t disp) {
+    emit8(j, 0x80 | reg << 3 | RCX);
+    emit32(j, disp);
+}
+
+// modrm + sib for [rbp + rax + disp32], a dram access
+static void modrm_mem(jit_t *j, int reg, int32_t disp) {
+    emit8(j, 0x80 | reg << 3 | 4);
+    emit8(j, 0x00 | RAX << 3 | RBP);
+    emit32(j, disp);
+}
+
+static void mov_imm(jit_t *j, int r, uint64_t v);
+
+// r = guest register, x0 reads as 0. w = 0 loads the low 32 bits, zero extended
+static void load_reg(jit_t *j, int r, int guest, int w) {
+    if (guest == 0) {
+        emit8(j, 0x31); // xor r32, r32
+        emit8(j, 0xc0 | r << 3 | r);
+        return;
+    }
+    if (j->known >> guest & 1) {
+        mov_imm(j, r, w ? j->val[guest] : (uint32_t)j->val[guest]);
+        return;
+    }
+    rex_w(j, w);
+    emit8(j, 0x8b); // mov r, [rbx + disp32]
+    modrm_rbx(j, r, OFF_REG(guest));
+}
+
+// guest register = r, writes to x0 are dropped
+static void store_reg(jit_t *j, int r, int guest) {
+    if (guest == 0)
+        return;
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov [rbx + disp32], r
+    modrm_rbx(j, r, OFF_REG(guest));
+}
+
+static void mov_imm(jit_t *j, int r, uint64_t v) {
+    if (fits32(v)) {
+        emit8(j, 0x48);
+        emit8(j, 0xc7); // mov r64, simm32
+        emit8(j, 0xc0 | r);
+        emit32(j, v);
+    } else {
+        emit8(j, 0x48);
+        emit8(j, 0xb8 | r); // movabs r64, imm64
+        emit64(j, v);
+    }
+}
+
+static void alu_imm(jit_t *j, int ext, int r, int32_t imm, int w) {
+    rex_w(j, w);
+    emit8(j, 0x81);
+    emit8(j, 0xc0 | ext << 3 | r);
+    emit32(j, imm);
+}
+
+static void alu_rr(jit_t *j, int ext, int dst, int src, int w) {
+    rex_w(j, w);
+    emit8(j, ext << 3 | 0x01); // add/or/and/sub/xor/cmp r/m, r
+    emit8(j, 0xc0 | src << 3 | dst);
+}
+
+static void shift_imm(jit_t *j, int ext, int r, int n, int w) {
+    rex_w(j, w);
+    emit8(j, 0xc1);
+    emit8(j, 0xc0 | ext << 3 | r);
+    emit8(j, n);
+}
+
+static void shift_cl(jit_t *j, int ext, int r, int w) {
+    rex_w(j, w);
+    emit8(j, 0xd3);
+    emit8(j, 0xc0 | ext << 3 | r);
+}
+
+// one operand group 3: 3 neg, 4 mul, 5 imul, 6 div, 7 idiv
+static void muldiv(jit_t *j, int ext, int r, int w) {
+    rex_w(j, w);
+    emit8(j, 0xf7);
+    emit8(j, 0xc0 | ext << 3 | r);
+}
+
+static void movsxd(jit_t *j, int dst, int src) {
+    emit8(j, 0x48);
+    emit8(j, 0x63);
+    emit8(j, 0xc0 | dst << 3 | src);
+}
+
+static void mov_rr(jit_t *j, int dst, int src, int w) {
+    rex_w(j, w);
+    emit8(j, 0x89);
+    emit8(j, 0xc0 | src << 3 | dst);
+}
+
+static void test_rr(jit_t *j, int r, int w) {
+    rex_w(j, w);
+    emit8(j, 0x85);
+    emit8(j, 0xc0 | r << 3 | r);
+}
+
+// eax = cc ? 1 : 0
+static void setcc(jit_t *j, int cc) {
+    emit8(j, 0x0f);
+    emit8(j, 0x90 | cc); // setcc al
+    emit8(j, 0xc0);
+    emit8(j, 0x0f);
+    emit8(j, 0xb6); // movzx eax, al
+    emit8(j, 0xc0);
+}
+
+// forward jumps with an 8 bit displacement, fixed up by bind8
+static uint8_t *jcc8(jit_t *j, int cc) {
+    emit8(j, 0x70 | cc);
+    emit8(j, 0);
+    return j->p - 1;
+}
+
+static uint8_t *jmp8(jit_t *j) {
+    emit8(j, 0xeb);
+    emit8(j, 0);
+    return j->p - 1;
+}
+
+static void bind8(jit_t *j, uint8_t *at) {
+    if (at)
+        *at = (uint8_t)(j->p - (at + 1));
+}
+
+static uint8_t *jcc32(jit_t *j, int cc) {
+    emit8(j, 0x0f);
+    emit8(j, 0x80 | cc);
+    emit32(j, 0);
+    return j->p - 4;
+}
+
+static void bind32(uint8_t *at, uint8_t *to) {
+    int32_t rel = (int32_t)(to - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+static uint8_t *jmp32(jit_t *j, uint8_t *to) {
+    emit8(j, 0xe9);
+    emit32(j, 0);
+    bind32(j->p - 4, to);
+    return j->p - 4;
+}
+
+// rax = the offset of rs1 + imm into dram
+static void dram_offset(jit_t *j) {
+    if (!j->dram_base)
+        return;
+    if (fits32(j->dram_base)) {
+        alu_imm(j, ALU_SUB, RAX, (int32_t)j->dram_base, 1);
+    } else {
+        mov_imm(j, RCX, j->dram_base);
+        alu_rr(j, ALU_SUB, RAX, RCX, 1);
+    }
+}
+
+// rax = the offset of rs1 + imm into dram, and jumps to the fixup in out if the access of
+// size bits is outside dram, exactly like the range check in bus_ptr. returns the
+// displacement that addresses the dram byte from [rbp + rax]
+static int32_t mem_addr(jit_t *j, const insn_t *u, uint64_t size, uint8_t **out) {
+    *out = NULL;
+    if (j->guard) {
+        // the low 32 bits of the offset, the guard pages catch the rest
+        load_reg(j, RAX, u->rs1, 1);
+        if (u->imm)
+            alu_imm(j, ALU_ADD, RAX, (int32_t)u->imm, 1);
+        dram_offset(j);
+        emit8(j, 0x89); // mov eax, eax
+        emit8(j, 0xc0);
+        return 0;
+    }
+    if (j->safe >> u->rs1 & 1) {
+        // checked once for the whole loop
+        load_reg(j, RAX, u->rs1, 1);
+        dram_offset(j);
+        return (int32_t)u->imm;
+    }
+    if (j->known >> u->rs1 & 1) {
+        uint64_t addr = j->val[u->rs1] + (int64_t)u->imm;
+        if (addr - j->dram_base <= j->dram_size - size / 8) {
+            mov_imm(j, RAX, addr - j->dram_base);
+            return 0;
+        }
+    }
+    load_reg(j, RAX, u->rs1, 1);
+    if (u->imm)
+        alu_imm(j, ALU_ADD, RAX, (int32_t)u->imm, 1);
+    dram_offset(j);
+    // the last offset the access fits at, rax + size / 8 could wrap
+    uint64_t last = j->dram_size - size / 8;
+    if (last <= INT32_MAX) {
+        alu_imm(j, ALU_CMP, RAX, (int32_t)last, 1);
+    } else {
+        mov_imm(j, RCX, last);
+        alu_rr(j, ALU_CMP, RAX, RCX, 1);
+    }
+    *out = jcc8(j, CC_A);
+    return 0;
+}
+
+// accesses outside dram go to the devices of cpu_device_add. off is the dram offset from
+// mem_addr, a load sign extends when bit 0 of size is set
+static uint64_t jit_mmio_load(cpu_t *cpu, uint64_t off, uint64_t size) {
+    uint64_t bits = size & ~1ull;
+    uint64_t v = cpu->bus.mmio ? mmio_load(&cpu->bus, cpu->bus.dram.base + off, bits) : 0;
+    if (size & 1 && bits < 64)
+        v = (uint64_t)((int64_t)(v << (64 - bits)) >> (64 - bits));
+    return v;
+}
+
+static void jit_mmio_store(cpu_t *cpu, uint64_t off, uint64_t size, uint64_t value) {
+    if (cpu->bus.mmio)
+        mmio_store(&cpu->bus, cpu->bus.dram.base + off, size, value);
+}
+
+// rax = fn(cpu, rax, size, rcx). rsp is 8 bytes off the 16 byte alignment of a call after the
+// two pushes of jit_enter. rbx and rbp are callee saved, the guest registers are in memory
+static void emit_call(jit_t *j, void *fn, uint32_t size) {
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov rdi, rbx
+    emit8(j, 0xdf);
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov rsi, rax
+    emit8(j, 0xc6);
+    emit8(j, 0xba); // mov edx, imm32
+    emit32(j, size);
+    emit8(j, 0x48);
+    emit8(j, 0x83); // sub rsp, 8
+    emit8(j, 0xec);
+    emit8(j, 8);
+    mov_imm(j, RAX, (uint64_t)(uintptr_t)fn);
+    emit8(j, 0xff); // call rax
+    emit8(j, 0xd0);
+    emit8(j, 0x48);
+    emit8(j, 0x83); // add rsp, 8
+    emit8(j, 0xc4);
+    emit8(j, 8);
+}
+
+static void emit_load(jit_t *j, const insn_t *u, uint64_t size, int sign) {
+    uint8_t *out;
+    int32_t disp = mem_addr(j, u, size, &out);
+    switch (size) {
+    case 8:
+        if (sign) {
+            emit8(j, 0x48);
+            emit8(j, 0x0f);
+            emit8(j, 0xbe); // movsx rax, byte
+        } else {
+            emit8(j, 0x0f);
+            emit8(j, 0xb6); // movzx eax, byte
+        }
+        break;
+    case 16:
+        if (sign) {
+            emit8(j, 0x48);
+            emit8(j, 0x0f);
+            emit8(j, 0xbf); // movsx rax, word
+        } else {
+            emit8(j, 0x0f);
+            emit8(j, 0xb7); // movzx eax, word
+        }
+        break;
+    case 32:
+        if (sign) {
+            emit8(j, 0x48);
+            emit8(j, 0x63); // movsxd rax, dword
+        } else {
+            emit8(j, 0x8b); // mov eax, dword
+        }
+        break;
+    default:
+        emit8(j, 0x48);
+        emit8(j, 0x8b); // mov rax, qword
+    }
+    modrm_mem(j, RAX, disp);
+    if (out) {
+        uint8_t *done = jmp8(j);
+        bind8(j, out);
+        emit_call(j, (void *)jit_mmio_load, size | sign);
+        bind8(j, done);
+    }
+    store_reg(j, RAX, u->rd);
+}
+
+static void emit_store(jit_t *j, const insn_t *u, uint64_t size) {
+    uint8_t *out;
+    int32_t disp = mem_addr(j, u, size, &out);
+    load_reg(j, RCX, u->rs2, 1);
+    switch (size) {
+    case 8:
+        emit8(j, 0x88); // mov byte, cl
+        break;
+    case 16:
+        emit8(j, 0x66);
+        emit8(j, 0x89); // mov word, cx
+        break;
+    case 32:
+        emit8(j, 0x89); // mov dword, ecx
+        break;
+    default:
+        emit8(j, 0x48);
+        emit8(j, 0x89); // mov qword, rcx
+    }
+    modrm_mem(j, RCX, disp);
+    if (out) {
+        uint8_t *done = jmp8(j);
+        bind8(j, out);
+        load_reg(j, RCX, u->rs2, 1);
+        emit_call(j, (void *)jit_mmio_store, size);
+        bind8(j, done);
+    }
+}
+
+static void emit_op_imm(jit_t *j, const insn_t *u, int ext) {
+    load_reg(j, RAX, u->rs1, 1);
+    alu_imm(j, ext, RAX, (int32_t)u->imm, 1);
+    store_reg(j, RAX, u->rd);
+}
+
+static void emit_op(jit_t *j, const insn_t *u, int ext) {
+    load_reg(j, RAX, u->rs1, 1);
+    load_reg(j, RCX, u->rs2, 1);
+    alu_rr(j, ext, RAX, RCX, 1);
+    store_reg(j, RAX, u->rd);
+}
+
+static void emit_op_32(jit_t *j, const insn_t *u, int ext) {
+    load_reg(j, RAX, u->rs1, 0);
+    load_reg(j, RCX, u->rs2, 0);
+    alu_rr(j, ext, RAX, RCX, 0);
+    movsxd(j, RAX, RAX);
+    store_reg(j, RAX, u->rd);
+}
+
+static void emit_shift_imm(jit_t *j, const insn_t *u, int ext, int n, int w) {
+    load_reg(j, RAX, u->rs1, w);
+    if (n)
+        shift_imm(j, ext, RAX, n, w);
+    store_reg(j, RAX, u->rd);
+}
+
+// shift by rs2, the hardware masks the count to 5 or 6 bits like the interpreter does
+static void emit_shift(jit_t *j, const insn_t *u, int ext, int w, int mask31) {
+    load_reg(j, RAX, u->rs1, w);
+    load_reg(j, RCX, u->rs2, 0);
+    if (mask31)
+        alu_imm(j, ALU_AND, RCX, 31, 0);
+    shift_cl(j, ext, RAX, w);
+    if (!w)
+        movsxd(j, RAX, RAX);
+    store_reg(j, RAX, u->rd);
+}
+
+static void emit_set(jit_t *j, const insn_t *u, int cc, int imm) {
+    load_reg(j, RAX, u->rs1, 1);
+    if (imm) {
+        alu_imm(j, ALU_CMP, RAX, (int32_t)u->imm, 1);
+    } else {
+        load_reg(j, RCX, u->rs2, 1);
+        alu_rr(j, ALU_CMP, RAX, RCX, 1);
+    }
+    setcc(j, cc);
+    store_reg(j, RAX, u->rd);
+}
+
+// div: 6 unsigned, 7 signed. rem takes the result from rdx. divide by zero gives -1
+static void emit_div(jit_t *j, const insn_t *u, int ext, int rem, int w) {
+    load_reg(j, RAX, u->rs1, w);
+    load_reg(j, RCX, u->rs2, w);
+    test_rr(j, RCX, w);
+    uint8_t *zero = jcc8(j, CC_E);
+    uint8_t *divide = NULL;
+    if (ext == 7) {
+        // idiv of the most negative value by -1 faults, x / -1 is -x and x % -1 is 0 without it
+        alu_imm(j, ALU_CMP, RCX, -1, w);
+        divide = jcc8(j, CC_NE);
+        if (rem)
+            mov_imm(j, RAX, 0);
+        else
+            muldiv(j, 3, RAX, w);
+        uint8_t *minus = jmp8(j);
+        bind8(j, divide);
+        divide = minus;
+        rex_w(j, w);
+        emit8(j, 0x99); // cqo / cdq
+    } else {
+        load_reg(j, RDX, 0, 0);
+    }
+    muldiv(j, ext, RCX, w);
+    if (rem)
+        mov_rr(j, RAX, RDX, w);
+    if (divide)
+        bind8(j, divide);
+    if (!w && ext == 7)
+        movsxd(j, RAX, RAX);
+    uint8_t *done = jmp8(j);
+    bind8(j, zero);
+    mov_imm(j, RAX, (uint64_t)-1);
+    bind8(j, done);
+    store_reg(j, RAX, u->rd);
+}
+
+// high half of the 128 bit product: 4 mul, 5 imul, or signed rs1 times unsigned rs2
+static void emit_mulh(jit_t *j, const insn_t *u, int ext, int su) {
+    load_reg(j, RAX, u->rs1, 1);
+    load_reg(j, RCX, u->rs2, 1);
+    muldiv(j, ext, RCX, 1);
+    if (su) {
+        load_reg(j, RAX, u->rs1, 1);
+        test_rr(j, RAX, 1);
+        uint8_t *pos = jcc8(j, CC_NS);
+        alu_rr(j, ALU_SUB, RDX, RCX, 1);
+        bind8(j, pos);
+    }
+    store_reg(j, RDX, u->rd);
+}
+
+// leave native code through exit, with cpu->pc = target unless the pc is computed.
+// chainable exits start with a jump that jit_link can point at the successor
+static void emit_exit(jit_t *j, block_t *b, int exit, uint64_t target, int chain) {
+    if (chain) {
+        if (fits32(target)) {
+            emit8(j, 0x48);
+            emit8(j, 0xc7); // mov qword [rbx + pc], simm32
+            modrm_rbx(j, 0, OFF_PC);
+            emit32(j, target);
+        } else {
+            mov_imm(j, RAX, target);
+            emit8(j, 0x48);
+            emit8(j, 0x89);
+            modrm_rbx(j, RAX, OFF_PC);
+        }
+        b->patch[exit] = jmp32(j, j->p + 5);
+        b->target[exit] = target;
+    }
+    mov_imm(j, RAX, (uint64_t)(uintptr_t)b | exit);
+    jmp32(j, j->epilogue);
+}
+
+static void emit_uop(jit_t *j, const insn_t *u) {
+    switch (u->op) {
+    case OP_LUI: mov_imm(j, RAX, u->imm); store_reg(j, RAX, u->rd); break;
+    case OP_LB: emit_load(j, u, 8, 1); break;
+    case OP_LH: emit_load(j, u, 16, 1); break;
+    case OP_LW: emit_load(j, u, 32, 1); break;
+    case OP_LD: emit_load(j, u, 64, 0); break;
+    case OP_LBU: emit_load(j, u, 8, 0); break;
+    case OP_LHU: emit_load(j, u, 16, 0); break;
+    case OP_LWU: emit_load(j, u, 32, 0); break;
+    case OP_SB: emit_store(j, u, 8); break;
+    case OP_SH: emit_store(j, u, 16); break;
+    case OP_SW: emit_store(j, u, 32); break;
+    case OP_SD: emit_store(j, u, 64); break;
+    case OP_ADDI: emit_op_imm(j, u, ALU_ADD); break;
+    case OP_XORI: emit_op_imm(j, u, ALU_XOR); break;
+    case OP_ORI: emit_op_imm(j, u, ALU_OR); break;
+    case OP_ANDI: emit_op_imm(j, u, ALU_AND); break;
+    // SLTI compares unsigned against the sign extended immediate, just like SLTIU
+    case OP_SLTI:
+    case OP_SLTIU: emit_set(j, u, CC_B, 1); break;
+    case OP_SLLI:
+    case OP_SLLI_64: emit_shift_imm(j, u, SH_SHL, u->imm & 0x3f, 1); break;
+    case OP_SRLI:
+    case OP_SRLI_64:
+    case OP_SRAI_64: emit_shift_imm(j, u, SH_SHR, u->imm & 0x3f, 1); break;
+    case OP_SRAI: emit_shift_imm(j, u, SH_SAR, u->imm & 0x3f, 1); break;
+    case OP_ADDIW:
+        load_reg(j, RAX, u->rs1, 0);
+        alu_imm(j, ALU_ADD, RAX, (int32_t)u->imm, 0);
+        movsxd(j, RAX, RAX);
+        store_reg(j, RAX, u->rd);
+        break;
+    // the 32 bit loads zero extend, SLLIW and SRLIW keep it that way
+    case OP_SLLIW: emit_shift_imm(j, u, SH_SHL, (u->imm & 0x3f) % 32, 0); break;
+    case OP_SRLIW: emit_shift_imm(j, u, SH_SHR, (u->imm & 0x3f) % 32, 0); break;
+    case OP_SRAIW:
+        load_reg(j, RAX, u->rs1, 0);
+        shift_imm(j, SH_SAR, RAX, u->imm % 32, 0);
+        movsxd(j, RAX, RAX);
+        store_reg(j, RAX, u->rd);
+        break;
+    case OP_ADD: emit_op(j, u, ALU_ADD); break;
+    case OP_SUB: emit_op(j, u, ALU_SUB); break;
+    case OP_XOR: emit_op(j, u, ALU_XOR); break;
+    case OP_OR: emit_op(j, u, ALU_OR); break;
+    case OP_AND: emit_op(j, u, ALU_AND); break;
+    case OP_SLT: emit_set(j, u, CC_L, 0); break;
+    case OP_SLTU: emit_set(j, u, CC_B, 0); break;
+    case OP_SLL: emit_shift(j, u, SH_SHL, 1, 0); break;
+    case OP_SRL: emit_shift(j, u, SH_SHR, 1, 0); break;
+    case OP_SRA: emit_shift(j, u, SH_SAR, 1, 1); break;
+    case OP_ADDW: emit_op_32(j, u, ALU_ADD); break;
+    case OP_SUBW: emit_op_32(j, u, ALU_SUB); break;
+    case OP_SLLW: emit_shift(j, u, SH_SHL, 0, 0); break;
+    case OP_SRLW: emit_shift(j, u, SH_SHR, 0, 0); break;
+    case OP_SRAW: emit_shift(j, u, SH_SAR, 0, 0); break;
+    case OP_MUL:
+        load_reg(j, RAX, u->rs1, 1);
+        load_reg(j, RCX, u->rs2, 1);
+        emit8(j, 0x48);
+        emit8(j, 0x0f);
+        emit8(j, 0xaf); // imul rax, rcx
+        emit8(j, 0xc0 | RAX << 3 | RCX);
+        store_reg(j, RAX, u->rd);
+        break;
+    case OP_MULW:
+        load_reg(j, RAX, u->rs1, 0);
+        load_reg(j, RCX, u->rs2, 0);
+        emit8(j, 0x0f);
+        emit8(j, 0xaf); // imul eax, ecx
+        emit8(j, 0xc0 | RAX << 3 | RCX);
+        movsxd(j, RAX, RAX);
+        store_reg(j, RAX, u->rd);
+        break;
+    case OP_MULH: emit_mulh(j, u, 5, 0); break;
+    case OP_MULHU: emit_mulh(j, u, 4, 0); break;
+    case OP_MULHSU: emit_mulh(j, u, 4, 1); break;
+    case OP_DIV: emit_div(j, u, 7, 0, 1); break;
+    case OP_DIVU: emit_div(j, u, 6, 0, 1); break;
+    case OP_REM: emit_div(j, u, 7, 1, 1); break;
+    case OP_REMU: emit_div(j, u, 6, 1, 1); break;
+    case OP_DIVW: emit_div(j, u, 7, 0, 0); break;
+    case OP_DIVUW: emit_div(j, u, 6, 0, 0); break;
+    case OP_REMW: emit_div(j, u, 7, 1, 0); break;
+    case OP_REMUW: emit_div(j, u, 6, 1, 0); break;
+    case OP_FENCE:
+        if (fence_store_load(u->inst)) {
+            emit8(j, 0x0f);
+            emit8(j, 0xae); // mfence
+            emit8(j, 0xf0);
+        }
+        break;
+    case OP_NOP: break;
+    case OP_FUSED_LOAD:
+    case OP_FUSED_ZEXT: {
+        insn_t p[2];
+        block_unfuse(u, p);
+        emit_uop(j, &p[0]);
+        emit_uop(j, &p[1]);
+        break;
+    }
+    }
+}
+
+_Static_assert(sizeof(ras_entry_t) == 16, "emit_ras_push scales by 16");
+
+// the call at the end of b, same as ras_push of the block engine
+static void emit_ras_push(jit_t *j, block_t *b) {
+    mov_imm(j, RCX, (uint64_t)(uintptr_t)j->ras);
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rcx + top]
+    modrm_rcx(j, RAX, offsetof(ras_t, top));
+    alu_imm(j, ALU_ADD, RAX, 1, 1);
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov [rcx + top], rax
+    modrm_rcx(j, RAX, offsetof(ras_t, top));
+    alu_imm(j, ALU_AND, RAX, RAS_SIZE - 1, 0);
+    shift_imm(j, SH_SHL, RAX, 4, 0);
+    alu_rr(j, ALU_ADD, RCX, RAX, 1);
+    mov_imm(j, RAX, b->end);
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov [rcx + e[top].pc], rax
+    modrm_rcx(j, RAX, offsetof(ras_t, e) + offsetof(ras_entry_t, pc));
+    mov_imm(j, RAX, (uint64_t)(uintptr_t)b);
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov [rcx + e[top].caller], rax
+    modrm_rcx(j, RAX, offsetof(ras_t, e) + offsetof(ras_entry_t, caller));
+}
+
+// add 1 to the counter at p
+static void emit_count(jit_t *j, void *p) {
+    mov_imm(j, RCX, (uint64_t)(uintptr_t)p);
+    emit8(j, 0x48);
+    emit8(j, 0x81); // add qword [rcx], 1
+    modrm_rcx(j, ALU_ADD, 0);
+    emit32(j, 1);
+}
+
+// add 1 to the counter at [rbx + off]
+static void emit_count_rbx(jit_t *j, int32_t off) {
+    emit8(j, 0x48);
+    emit8(j, 0x81); // add qword [rbx + off], 1
+    modrm_rbx(j, ALU_ADD, off);
+    emit32(j, 1);
+}
+
+// JALR target in cpu->pc: go straight to the code of the target the site saw first.
+// falls through on a miss
+static void emit_inline_cache(jit_t *j, block_t *b) {
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rbx + pc]
+    modrm_rbx(j, RAX, OFF_PC);
+    emit8(j, 0x48);
+    emit8(j, 0xb8 | RCX); // movabs rcx, target. odd, nothing matches until jit_retarget
+    b->ic[0] = j->p;
+    emit64(j, 1);
+    alu_rr(j, ALU_CMP, RAX, RCX, 1);
+    uint8_t *miss = jcc8(j, CC_NE);
+    emit_count(j, &b->jalr_hits);
+    emit_count_rbx(j, (int32_t)offsetof(cpu_t, stats.jalr_inline));
+    b->ic[1] = jmp32(j, j->p + 5);
+    bind8(j, miss);
+}
+
+// return in cpu->pc: pop the return address stack if its top is where it goes and jump
+// to the native code of the block after the call. falls through on a miss
+static void emit_ras_pop(jit_t *j, block_t *b) {
+    uint8_t *miss[3];
+    mov_imm(j, RCX, (uint64_t)(uintptr_t)j->ras);
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rcx + top]
+    modrm_rcx(j, RAX, offsetof(ras_t, top));
+    alu_imm(j, ALU_AND, RAX, RAS_SIZE - 1, 0);
+    shift_imm(j, SH_SHL, RAX, 4, 0);
+    alu_rr(j, ALU_ADD, RAX, RCX, 1);
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rdx, [rax + e[top].pc]
+    emit8(j, 0x80 | RDX << 3 | RAX);
+    emit32(j, offsetof(ras_t, e) + offsetof(ras_entry_t, pc));
+    emit8(j, 0x48);
+    emit8(j, 0x3b); // cmp rdx, [rbx + pc]
+    modrm_rbx(j, RDX, OFF_PC);
+    miss[0] = jcc8(j, CC_NE);
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rax + e[top].caller]
+    emit8(j, 0x80 | RAX << 3 | RAX);
+    emit32(j, offsetof(ras_t, e) + offsetof(ras_entry_t, caller));
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rax + ret]
+    emit8(j, 0x80 | RAX << 3 | RAX);
+    emit32(j, offsetof(block_t, ret));
+    test_rr(j, RAX, 1);
+    miss[1] = jcc8(j, CC_E);
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rax + code]
+    emit8(j, 0x80 | RAX << 3 | RAX);
+    emit32(j, offsetof(block_t, code));
+    test_rr(j, RAX, 1);
+    miss[2] = jcc8(j, CC_E);
+    emit8(j, 0x48);
+    emit8(j, 0x81); // sub qword [rcx + top], 1
+    modrm_rcx(j, ALU_SUB, offsetof(ras_t, top));
+    emit32(j, 1);
+    mov_rr(j, RDX, RAX, 1);
+    emit_count(j, &b->jalr_hits);
+    emit_count_rbx(j, (int32_t)offsetof(cpu_t, stats.jalr_ras));
+    emit8(j, 0xff); // jmp rdx
+    emit8(j, 0xe0 | RDX);
+    for (int i = 0; i < 3; i++)
+        bind8(j, miss[i]);
+}
+
+static void emit_branch(jit_t *j, block_t *b, const insn_t *u, int cc) {
+    load_reg(j, RAX, u->rs1, 1);
+    load_reg(j, RCX, u->rs2, 1);
+    alu_rr(j, ALU_CMP, RAX, RCX, 1);
+    uint8_t *taken = jcc32(j, cc);
+    emit_exit(j, b, JIT_EXIT_NEXT, b->end, 1);
+    bind32(taken, j->p);
+    emit_exit(j, b, JIT_EXIT_JUMP, b->end + (int64_t)u->imm - 4, 1);
+}
+
+// the last micro op decides how the block is left
+static void emit_end(jit_t *j, block_t *b, const insn_t *u) {
+    insn_t p[2];
+    switch (u->op) {
+    case OP_FUSED_JALR:
+        // AUIPC+JALR, the target is a constant
+        block_unfuse(u, p);
+        emit_uop(j, &p[0]);
+        mov_imm(j, RAX, b->end);
+        store_reg(j, RAX, u->rd);
+        if (b->flow & BLOCK_CALL)
+            emit_ras_push(j, b);
+        emit_exit(j, b, JIT_EXIT_JUMP, (u->imm + (int64_t)(int32_t)u->inst) & 0xfffffffe, 1);
+        break;
+    case OP_FUSED_CMP_BRANCH:
+        block_unfuse(u, p);
+        emit_uop(j, &p[0]);
+        emit_end(j, b, &p[1]);
+        break;
+    case OP_BEQ: emit_branch(j, b, u, CC_E); break;
+    case OP_BNE: emit_branch(j, b, u, CC_NE); break;
+    case OP_BLT: emit_branch(j, b, u, CC_L); break;
+    case OP_BGE: emit_branch(j, b, u, CC_GE); break;
+    case OP_BLTU: emit_branch(j, b, u, CC_B); break;
+    case OP_BGEU: emit_branch(j, b, u, CC_AE); break;
+    case OP_JAL:
+        mov_imm(j, RAX, b->end);
+        store_reg(j, RAX, u->rd);
+        if (b->flow & BLOCK_CALL)
+            emit_ras_push(j, b);
+        emit_exit(j, b, JIT_EXIT_JUMP, b->end + (int64_t)u->imm - 4, 1);
+        break;
+    case OP_JALR:
+        load_reg(j, RAX, u->rs1, 1);
+        if (u->imm)
+            alu_imm(j, ALU_ADD, RAX, (int32_t)u->imm, 1);
+        emit8(j, 0x25); // and eax, 0xfffffffe, clears the upper half as well
+        emit32(j, 0xfffffffe);
+        emit8(j, 0x48);
+        emit8(j, 0x89); // mov [rbx + pc], rax
+        modrm_rbx(j, RAX, OFF_PC);
+        mov_imm(j, RAX, b->end);
+        store_reg(j, RAX, u->rd);
+        if (b->flow & BLOCK_CALL)
+            emit_ras_push(j, b);
+        if (b->flow & BLOCK_RETURN)
+            emit_ras_pop(j, b);
+        else
+            emit_inline_cache(j, b);
+        emit_exit(j, b, JIT_EXIT_JUMP, 0, 0);
+        break;
+    case OP_ECALL_EBREAK:
+    case OP_CSR:
+    case OP_AMO:
+    case OP_FENCE_I:
+    case OP_invalid:
+        emit_exit(j, b, JIT_EXIT_TRAP, 0, 0);
+        break;
+    default:
+        // FENCE or a block cut at its maximum length
+        emit_uop(j, u);
+        emit_exit(j, b, JIT_EXIT_NEXT, b->end, 1);
+    }
+}
+
+static void emit_side_exit(jit_t *j, block_t *b, int exit, uint64_t target, uint32_t undo);
+
+// count the n instructions from here on in stats.instret, or leave through JIT_EXIT_LIMIT
+// when they would go past cpu->limit. cpu_stop sets the limit to 0, so chained blocks
+// notice it as well
+static void emit_instret(jit_t *j, block_t *b, uint32_t n, int set_pc) {
+    emit8(j, 0x48);
+    emit8(j, 0x8b); // mov rax, [rbx + instret]
+    modrm_rbx(j, RAX, OFF_INSTRET);
+    alu_imm(j, ALU_ADD, RAX, n, 1);
+    emit8(j, 0x48);
+    emit8(j, 0x3b); // cmp rax, [rbx + limit]
+    modrm_rbx(j, RAX, OFF_LIMIT);
+    uint8_t *ok = jcc8(j, CC_BE);
+    if (set_pc)
+        emit_side_exit(j, b, JIT_EXIT_LIMIT, b->pc, 0);
+    else
+        emit_exit(j, b, JIT_EXIT_LIMIT, 0, 0);
+    bind8(j, ok);
+    emit8(j, 0x48);
+    emit8(j, 0x89); // mov [rbx + instret], rax
+    modrm_rbx(j, RAX, OFF_INSTRET);
+}
+
+// fused pairs of the block, at its entry
+static void emit_fused(jit_t *j, block_t *b) {
+    for (int i = 0; b->nfused && i < CPU_FUSE_COUNT; i++) {
+        if (!b->fused[i])
+            continue;
+        emit8(j, 0x48);
+        emit8(j, 0x81); // add qword [rbx + fused[i]], count
+        modrm_rbx(j, ALU_ADD, (int32_t)(offsetof(cpu_t, stats.fused) + 8 * i));
+        emit32(j, b->fused[i]);
+    }
+}
+
+jit_t *jit_new(ras_t *ras, const bus_t *bus) {
+    jit_t *jit = malloc(sizeof(jit_t));
+    if (!jit)
+        return NULL;
+    jit->ras = ras;
+    jit->guard = bus->guard;
+    jit->dram_base = bus->dram.base;
+    jit->dram_size = bus->dram.size;
+    jit->base = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->base == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit->end = jit->base + JIT_CODE_SIZE;
+    jit_reset(jit);
+    return jit;
+}
+
+void jit_free(jit_t *jit) {
+    if (!jit)
+        return;
+    munmap(jit->base, JIT_CODE_SIZE);
+    free(jit);
+}
+
+void jit_reset(jit_t *jit) {
+    jit->p = jit->base;
+    jit->enter = jit->p;
+    emit8(jit, 0x53); // push rbx
+    emit8(jit, 0x55); // push rbp
+    emit8(jit, 0x48);
+    emit8(jit, 0x89); // mov rbx, rdi
+    emit8(jit, 0xfb);
+    emit8(jit, 0x48);
+    emit8(jit, 0x8b); // mov rbp, [rbx + OFF_MEM]
+    modrm_rbx(jit, RBP, OFF_MEM);
+    emit8(jit, 0xff); // jmp rsi
+    emit8(jit, 0xe6);
+    jit->epilogue = jit->p;
+    emit8(jit, 0x5d); // pop rbp
+    emit8(jit, 0x5b); // pop rbx
+    emit8(jit, 0xc3); // ret
+}
+
+int jit_compile(jit_t *jit, block_t *b) {
+    if (jit->end - jit->p < (ptrdiff_t)(b->insns * JIT_MAX_UOP_SIZE + 3 * JIT_MAX_EXIT_SIZE))
+        return -1;
+
+    jit->known = 1;
+    jit->val[0] = 0;
+    jit->safe = 0;
+    b->code = jit->p;
+    b->patch[0] = NULL;
+    b->patch[1] = NULL;
+    emit_instret(jit, b, b->insns, 0); // cpu->pc is b->pc on every way in
+    emit_fused(jit, b);
+    for (uint32_t i = 0; i + 1 < b->n; i++)
+        emit_uop(jit, &b->uops[i]);
+    emit_end(jit, b, &b->uops[b->n - 1]);
+    return 0;
+}
+
+// traces: a loop recorded as the list of blocks one iteration went through. the
+// trace is compiled as one piece with the back edge as a plain jump, and
+//  - registers set from constants (LUI, AUIPC, JAL and ALU ops on constants) are
+//    folded, their uses become immediates and constant addresses need no range check
+//  - results overwritten before the next read or exit of the trace are not computed
+//  - accesses through a base register the loop never writes are range checked once
+//    before the loop instead of on every access
+
+#define ALL_REGS 0xfffffffeu
+
+static uint32_t uop_reads(const insn_t *u) {
+    uint8_t op = u->op;
+    if ((op >= OP_SB && op <= OP_SD) || (op >= OP_ADD && op <= OP_REMU) || (op >= OP_ADDW && op <= OP_REMUW) || (op >= OP_BEQ && op <= OP_BGEU))
+        return (1u << u->rs1 | 1u << u->rs2) & ALL_REGS;
+    if ((op >= OP_LB && op <= OP_LWU) || (op >= OP_ADDI && op <= OP_ANDI) || (op >= OP_ADDIW && op <= OP_SRAIW) || op == OP_JALR)
+        return (1u << u->rs1) & ALL_REGS;
+    return 0;
+}
+
+static uint32_t uop_writes(const insn_t *u) {
+    uint8_t op = u->op;
+    if ((op >= OP_SB && op <= OP_SD) || (op >= OP_BEQ && op <= OP_BGEU) || op == OP_FENCE || op == OP_FENCE_I || op == OP_NOP || op == OP_ECALL_EBREAK ||
+        op == OP_invalid)
+        return 0;
+    return (1u << u->rd) & ALL_REGS;
+}
+
+// no effect besides writing rd. divisions stay, they can still fault on the host
+static int uop_pure(const insn_t *u) {
+    switch (u->op) {
+    case OP_LB: // a device can see the load
+    case OP_LH:
+    case OP_LW:
+    case OP_LD:
+    case OP_LBU:
+    case OP_LHU:
+    case OP_LWU:
+    case OP_DIV:
+    case OP_DIVU:
+    case OP_REM:
+    case OP_REMU:
+    case OP_DIVW:
+    case OP_DIVUW:
+    case OP_REMW:
+    case OP_REMUW:
+        return 0;
+    default:
+        return uop_writes(u) != 0;
+    }
+}
+
+// the value of rd when all inputs of u are known constants, end is the pc after u
+static int uop_fold(const jit_t *j, const insn_t *u, uint64_t end, uint64_t *v) {
+    uint32_t reads = uop_reads(u);
+    if ((reads & j->known) != reads)
+        return 0;
+    uint64_t a = j->val[u->rs1];
+    uint64_t b = j->val[u->rs2];
+    switch (u->op) {
+    case OP_LUI: *v = u->imm; return 1;
+    case OP_JAL: *v = end; return 1;
+    case OP_ADDI: *v = a + (int64_t)u->imm; return 1;
+    case OP_XORI: *v = a ^ u->imm; return 1;
+    case OP_ORI: *v = a | u->imm; return 1;
+    case OP_ANDI: *v = a & u->imm; return 1;
+    case OP_SLLI:
+    case OP_SLLI_64: *v = a << (u->imm & 0x3f); return 1;
+    case OP_ADDIW: *v = (int64_t)(int32_t)(uint32_t)(a + u->imm); return 1;
+    case OP_ADD: *v = a + b; return 1;
+    case OP_SUB: *v = a - b; return 1;
+    case OP_XOR: *v = a ^ b; return 1;
+    case OP_OR: *v = a | b; return 1;
+    case OP_AND: *v = a & b; return 1;
+    default: return 0;
+    }
+}
+
+static void trace_forget(jit_t *j, const insn_t *u, int folded, uint64_t v) {
+    uint32_t w = uop_writes(u);
+    if (folded) {
+        // a folded jal x0 has nothing to keep, x0 stays 0
+        if (!u->rd)
+            return;
+        j->known |= w;
+        j->val[u->rd] = v;
+    } else {
+        j->known &= ~w;
+    }
+}
+
+// store the constant v in guest register rd
+static void store_imm(jit_t *j, int guest, uint64_t v) {
+    if (guest == 0)
+        return;
+    if (fits32(v)) {
+        emit8(j, 0x48);
+        emit8(j, 0xc7); // mov qword [rbx + disp32], simm32
+        modrm_rbx(j, 0, OFF_REG(guest));
+        emit32(j, v);
+    } else {
+        mov_imm(j, RAX, v);
+        store_reg(j, RAX, guest);
+    }
+}
+
+static int branch_cc(uint8_t op) {
+    switch (op) {
+    case OP_BEQ: return CC_E;
+    case OP_BNE: return CC_NE;
+    case OP_BLT: return CC_L;
+    case OP_BGE: return CC_GE;
+    case OP_BLTU: return CC_B;
+    default: return CC_AE;
+    }
+}
+
+// side exit of a trace, the dispatcher sees it as exit of block b. undo takes back the
+// instructions of the blocks after b, counted at the top of the iteration
+static void emit_side_exit(jit_t *j, block_t *b, int exit, uint64_t target, uint32_t undo) {
+    if (undo) {
+        emit8(j, 0x48);
+        emit8(j, 0x81); // sub qword [rbx + instret], undo
+        modrm_rbx(j, ALU_SUB, OFF_INSTRET);
+        emit32(j, undo);
+    }
+    if (fits32(target)) {
+        emit8(j, 0x48);
+        emit8(j, 0xc7); // mov qword [rbx + pc], simm32
+        modrm_rbx(j, 0, OFF_PC);
+        emit32(j, target);
+    } else {
+        mov_imm(j, RAX, target);
+        emit8(j, 0x48);
+        emit8(j, 0x89);
+        modrm_rbx(j, RAX, OFF_PC);
+    }
+    mov_imm(j, RAX, (uint64_t)(uintptr_t)b | exit);
+    jmp32(j, j->epilogue);
+}
+
+int jit_compile_trace(jit_t *jit, block_t **blocks, int n) {
+    insn_t ops[TRACE_MAX_BLOCKS * BLOCK_MAX_INSNS];
+    int first[TRACE_MAX_BLOCKS + 1];
+    uint32_t creads[TRACE_MAX_BLOCKS * BLOCK_MAX_INSNS];
+    uint8_t dead[TRACE_MAX_BLOCKS * BLOCK_MAX_INSNS];
+    uint8_t exits[TRACE_MAX_BLOCKS * BLOCK_MAX_INSNS];
+    int64_t lo[32], hi[32];
+    uint32_t written = 0;
+    uint32_t bases = 0;
+    int count = 0;
+
+    // flatten with superinstructions split again, and find where the trace can leave:
+    // branches that do not always go on to the next block of the trace
+    for (int i = 0; i < n; i++) {
+        block_t *b = blocks[i];
+        uint64_t next = blocks[(i + 1) % n]->pc;
+        first[i] = count;
+        for (uint32_t k = 0; k < b->n; k++) {
+            if (block_unfuse(&b->uops[k], &ops[count]) == 2)
+                exits[count++] = 0;
+            const insn_t *u = &ops[count];
+            int last = k + 1 == b->n;
+            exits[count] = 0;
+            if (last && (u->op == OP_JALR || u->op == OP_ECALL_EBREAK || u->op == OP_CSR || u->op == OP_AMO || u->op == OP_FENCE_I || u->op == OP_invalid))
+                return -1;
+            if (last && u->op >= OP_BEQ && u->op <= OP_BGEU) {
+                uint64_t taken = b->end + (int64_t)u->imm - 4;
+                if (taken != next && b->end != next)
+                    return -1;
+                exits[count] = taken != b->end;
+            } else if (last && u->op == OP_JAL) {
+                if (b->end + (int64_t)u->imm - 4 != next)
+                    return -1;
+            } else if (last && b->end != next) {
+                return -1;
+            }
+            count++;
+        }
+    }
+    first[n] = count;
+    if (jit->end - jit->p < (ptrdiff_t)(count * JIT_MAX_UOP_SIZE + (n + 1) * (JIT_MAX_EXIT_SIZE + 16) + 32 * 48))
+        return -1;
+
+    // which operands are constants
+    jit->known = 1;
+    jit->val[0] = 0;
+    jit->safe = 0;
+    for (int bi = 0, i = 0; bi < n; bi++) {
+        for (; i < first[bi + 1]; i++) {
+            const insn_t *u = &ops[i];
+            uint64_t v = 0;
+            creads[i] = uop_reads(u) & jit->known;
+            written |= uop_writes(u);
+            trace_forget(jit, u, uop_fold(jit, u, blocks[bi]->end, &v), v);
+        }
+    }
+
+    // results nobody reads. everything is live at the exits and at the back edge
+    uint32_t live = ALL_REGS;
+    for (int i = count - 1; i >= 0; i--) {
+        const insn_t *u = &ops[i];
+        if (exits[i])
+            live = ALL_REGS;
+        dead[i] = uop_pure(u) && !(live & uop_writes(u));
+        if (!dead[i]) {
+            live &= ~uop_writes(u);
+            live |= uop_reads(u) & ~creads[i];
+        }
+    }
+
+    // offsets used through base registers the loop never writes, nothing to check with guard pages
+    for (int i = 0; i < count && !jit->guard; i++) {
+        const insn_t *u = &ops[i];
+        int r = u->rs1;
+        int64_t size;
+        if (u->op >= OP_LB && u->op <= OP_LWU)
+            size = u->op == OP_LB || u->op == OP_LBU ? 1 : u->op == OP_LH || u->op == OP_LHU ? 2 : u->op == OP_LD ? 8 : 4;
+        else if (u->op >= OP_SB && u->op <= OP_SD)
+            size = 1 << (u->op - OP_SB);
+        else
+            continue;
+        if (r == 0 || dead[i] || (written >> r & 1))
+            continue;
+        if (!(bases >> r & 1)) {
+            lo[r] = (int64_t)u->imm;
+            hi[r] = (int64_t)u->imm + size;
+        } else {
+            lo[r] = (int64_t)u->imm < lo[r] ? (int64_t)u->imm : lo[r];
+            hi[r] = (int64_t)u->imm + size > hi[r] ? (int64_t)u->imm + size : hi[r];
+        }
+        bases |= 1u << r;
+    }
+
+    // before the loop: check the bases, or run the plain block code
+    uint8_t *entry = jit->p;
+    uint8_t *fail[64];
+    int nfail = 0;
+    for (int r = 1; r < 32; r++) {
+        if (!(bases >> r & 1))
+            continue;
+        int64_t lower = (int64_t)jit->dram_base - lo[r];
+        int64_t upper = (int64_t)(jit->dram_base + jit->dram_size) - hi[r];
+        if (lower < 0)
+            lower = 0;
+        if (upper < lower)
+            continue;
+        load_reg(jit, RAX, r, 1);
+        mov_imm(jit, RCX, lower);
+        alu_rr(jit, ALU_CMP, RAX, RCX, 1);
+        fail[nfail++] = jcc32(jit, CC_B);
+        mov_imm(jit, RCX, upper);
+        alu_rr(jit, ALU_CMP, RAX, RCX, 1);
+        fail[nfail++] = jcc32(jit, CC_A);
+        jit->safe |= 1u << r;
+    }
+
+    // one iteration at a time, the back edge does not write cpu->pc
+    uint32_t insns = 0;
+    for (int bi = 0; bi < n; bi++)
+        insns += blocks[bi]->insns;
+    uint8_t *loop = jit->p;
+    emit_instret(jit, blocks[0], insns, 1);
+    jit->known = 1;
+    jit->val[0] = 0;
+    int i = 0;
+    for (int bi = 0; bi < n; bi++) {
+        block_t *b = blocks[bi];
+        int back = bi + 1 == n; // the last block goes back to the top
+        insns -= b->insns;
+        emit_fused(jit, b);
+        for (; i < first[bi + 1]; i++) {
+            const insn_t *u = &ops[i];
+            uint64_t v = 0;
+            int folded = uop_fold(jit, u, b->end, &v);
+            if (exits[i]) {
+                uint64_t taken = b->end + (int64_t)u->imm - 4;
+                int stay = taken == blocks[(bi + 1) % n]->pc;
+                load_reg(jit, RAX, u->rs1, 1);
+                load_reg(jit, RCX, u->rs2, 1);
+                alu_rr(jit, ALU_CMP, RAX, RCX, 1);
+                uint8_t *on = jcc32(jit, stay ? branch_cc(u->op) : branch_cc(u->op) ^ 1);
+                if (stay)
+                    emit_side_exit(jit, b, JIT_EXIT_NEXT, b->end, insns);
+                else
+                    emit_side_exit(jit, b, JIT_EXIT_JUMP, taken, insns);
+                bind32(on, back ? loop : jit->p);
+                back = 0;
+            } else if (!dead[i]) {
+                if (folded)
+                    store_imm(jit, u->rd, v);
+                else if (!(u->op >= OP_BEQ && u->op <= OP_BGEU) && u->op != OP_JAL)
+                    emit_uop(jit, u);
+            }
+            trace_forget(jit, u, folded, v);
+            if (u->op == OP_JAL && (b->flow & BLOCK_CALL))
+                emit_ras_push(jit, b);
+        }
+        if (back)
+            jmp32(jit, loop);
+    }
+
+    for (int f = 0; f < nfail; f++)
+        bind32(fail[f], blocks[0]->code);
+    blocks[0]->code = entry;
+    return 0;
+}
+
+uint64_t jit_enter(jit_t *jit, cpu_t *cpu, void *code) { return ((uint64_t(*)(cpu_t *, void *))(void *)jit->enter)(cpu, code); }
+
+void jit_link(block_t *from, int exit, block_t *to) {
+    bind32(from->patch[exit], to->code);
+    from->patch[exit] = NULL;
+}
+
+void jit_retarget(block_t *from, block_t *to) {
+    memcpy(from->ic[0], &to->pc, 8);
+    bind32(from->ic[1], to->code);
+    from->ic[0] = NULL; // monomorphic, the dispatcher handles the other targets
+}
+
+#else
+
+// no code generator for this host, every block stays in the interpreter
+
+jit_t *jit_new(ras_t *ras, const bus_t *bus) { return NULL; }
+void jit_free(jit_t *jit) {}
+void jit_reset(jit_t *jit) {}
+int jit_compile(jit_t *jit, block_t *b) { return -1; }
+int jit_compile_trace(jit_t *jit, block_t **blocks, int n) { return -1; }
+uint64_t jit_enter(jit_t *jit, cpu_t *cpu, void *code) { return 0; }
+void jit_link(block_t *from, int exit, block_t *to) {}
+void jit_retarget(block_t *from, block_t *to) {}
+
+#endif
@@ -0,0 +1,422 @@
+#include <string.h>
+
+#include "librv64i_internal.h"
+
+// lock step lanes: up to CPU_LANES cpus running the same code share one instruction stream.
+// the registers are stored as struct of arrays, x[r] holds register r of every lane in one host
+// vector, so an instruction is fetched, decoded and dispatched once and its ALU operation runs
+// for all lanes with vector instructions: SSE2, or AVX2/AVX-512 where the host has them, the run
+// loop is compiled for each. loads and stores go to the dram of each lane one after the other.
+//
+// the active lanes are the ones at the group pc. a branch that goes both ways splits them: the
+// lanes at the lower pc run on and the others wait at theirs, rejoining when the group pc gets
+// there (min pc reconvergence). so the lanes of an if/else meet again after it, and a loop with
+// a lane dependent trip count runs the lanes that stayed while the others wait behind it.
+// stores of a lane only go to its own dram, and a write of rd keeps the value of waiting lanes.
+//
+// ECALL/EBREAK, CSRs, atomics, FENCE.I and invalid instructions run lane by lane through the
+// handler table on the cpu_t of the lane, with its registers written back around the call.
+
+typedef uint64_t lanes_t __attribute__((vector_size(8 * CPU_LANES)));
+typedef int64_t slanes_t __attribute__((vector_size(8 * CPU_LANES)));
+
+#if defined(__x86_64__) && defined(__linux__)
+#define LANES_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LANES_CLONES
+#endif
+
+typedef struct group_t {
+    cpu_t *cpu[CPU_LANES];
+    cpu_result_t *result[CPU_LANES];
+    uint64_t start[CPU_LANES]; // stats.instret when cpu_run_lanes started
+    uint64_t pc[CPU_LANES];    // where each lane goes on, current for the lanes that are not active
+    unsigned live;             // lanes that did not stop
+} group_t;
+
+#define RD x[in->rd]
+#define RS1 x[in->rs1]
+#define RS2 x[in->rs2]
+#define IMM in->imm
+#define SEXT32(v) ((lanes_t)(((slanes_t)((v) << 32)) >> 32))
+
+// rd of the active lanes, the waiting ones keep theirs
+#define SET(val)                                                                                                                                               \
+    do {                                                                                                                                                       \
+        v = (val);                                                                                                                                             \
+        RD = wait ? (v & ~keep) | (RD & keep) : v;                                                                                                             \
+    } while (0)
+
+// stmt for every active lane l, for what has no vector form
+#define EACH(stmt)                                                                                                                                             \
+    do {                                                                                                                                                       \
+        for (unsigned b_ = act; b_; b_ &= b_ - 1) {                                                                                                            \
+            l = __builtin_ctz(b_);                                                                                                                             \
+            stmt;                                                                                                                                              \
+        }                                                                                                                                                      \
+    } while (0)
+
+#define LOAD(size) bus_load(&g->cpu[l]->bus, x[in->rs1][l] + (int64_t)IMM, size)
+#define STORE(size) bus_store(&g->cpu[l]->bus, x[in->rs1][l] + (int64_t)IMM, size, x[in->rs2][l])
+
+// cpu_stop of any active lane is seen at taken branches and jumps
+#define STOP_CHECK() EACH(if (g->cpu[l]->stop) budget = n)
+
+#define BRANCH(cond)                                                                                                                                           \
+    do {                                                                                                                                                       \
+        t = (lanes_t)(cond) & m;                                                                                                                               \
+        bits = lanes_bits(&t);                                                                                                                                 \
+        if (bits) {                                                                                                                                            \
+            target = pc + (int64_t)IMM - 4;                                                                                                                    \
+            if (bits != act || wait)                                                                                                                           \
+                goto split;                                                                                                                                    \
+            pc = target;                                                                                                                                       \
+            STOP_CHECK();                                                                                                                                      \
+        }                                                                                                                                                      \
+    } while (0)
+
+#define NEXT(stmt)                                                                                                                                             \
+    do {                                                                                                                                                       \
+        stmt;                                                                                                                                                  \
+        goto dispatch;                                                                                                                                         \
+    } while (0)
+
+// the n instructions go to the counters of the active lanes, decoding to the lead lane
+#define SETTLE()                                                                                                                                               \
+    do {                                                                                                                                                       \
+        EACH(g->cpu[l]->stats.instret += n);                                                                                                                   \
+        lead->stats.icache_hits += n - misses;                                                                                                                 \
+        lead->stats.icache_misses += misses;                                                                                                                   \
+        n = misses = 0;                                                                                                                                        \
+    } while (0)
+
+// vectors go by pointer, passing them by value depends on the instruction set
+static inline unsigned lanes_bits(const lanes_t *v) {
+    unsigned bits = 0;
+    for (int l = 0; l < CPU_LANES; l++)
+        bits |= (unsigned)((*v)[l] >> 63) << l;
+    return bits;
+}
+
+static inline void lanes_mask(lanes_t *m, unsigned bits) {
+    for (int l = 0; l < CPU_LANES; l++)
+        (*m)[l] = -(uint64_t)((bits >> l) & 1);
+}
+
+static inline void lane_out(const lanes_t *x, int l, cpu_t *cpu) {
+    for (int r = 0; r < 32; r++)
+        cpu->regs[r] = x[r][l];
+}
+
+static inline void lane_in(lanes_t *x, int l, const cpu_t *cpu) {
+    for (int r = 0; r < 32; r++)
+        x[r][l] = cpu->regs[r];
+}
+
+// lane l stopped, its registers and pc are in its cpu_t
+static void lane_end(group_t *g, int l, cpu_stop_t stop, int ret) {
+    cpu_t *cpu = g->cpu[l];
+    *g->result[l] = (cpu_result_t){.stop = stop, .ret = ret, .instret = cpu->stats.instret - g->start[l]};
+    g->live &= ~(1u << l);
+}
+
+LANES_CLONES static void lanes_run(group_t *g) {
+    lanes_t x[32];
+    lanes_t m = {0};    // act as a vector
+    lanes_t keep = {0}; // wait as a vector
+    lanes_t v, t;
+    lanes_t zero = {0};
+    unsigned act = 0;  // lanes at pc
+    unsigned wait = 0; // lanes that did not stop and are not at pc
+    unsigned bits;
+    uint64_t pc = 0;
+    uint64_t merge = UINT64_MAX;
+    uint64_t target;
+    uint64_t n = 0;
+    uint64_t misses = 0;
+    uint64_t budget = 0;
+    cpu_t *lead = NULL;
+    icache_entry_t *e;
+    const insn_t *in;
+    insn_t cur;
+    int l, ret;
+
+    memset(x, 0, sizeof(x));
+    for (unsigned b = g->live; b; b &= b - 1) {
+        l = __builtin_ctz(b);
+        lane_in(x, l, g->cpu[l]);
+        g->pc[l] = g->cpu[l]->pc;
+    }
+    goto schedule;
+
+split:
+    // bits: the active lanes that go to target, the others go on at pc
+    EACH(g->pc[l] = (bits >> l) & 1 ? target : pc);
+reschedule:
+    // g->pc holds the pcs of all active lanes
+    SETTLE();
+    act = 0;
+schedule:
+    // the lanes at the lowest pc run, that is where the others reconverge with them
+    if (!g->live)
+        return;
+    pc = UINT64_MAX;
+    for (unsigned b = g->live; b; b &= b - 1)
+        if (g->pc[__builtin_ctz(b)] < pc)
+            pc = g->pc[__builtin_ctz(b)];
+    merge = pc;
+sync:
+    if (lead)
+        SETTLE();
+    if (pc == merge) {
+        merge = UINT64_MAX;
+        for (unsigned b = g->live & ~act; b; b &= b - 1) {
+            l = __builtin_ctz(b);
+            if (g->pc[l] == pc)
+                act |= 1u << l;
+            else if (g->pc[l] < merge)
+                merge = g->pc[l];
+        }
+    }
+    budget = UINT64_MAX;
+    for (unsigned b = act; b; b &= b - 1) {
+        cpu_t *cpu = g->cpu[__builtin_ctz(b)];
+        uint64_t limit = run_limit(cpu);
+        l = __builtin_ctz(b);
+        if (cpu->stop || cpu->stats.instret >= limit) {
+            lane_out(x, l, cpu);
+            cpu->pc = pc;
+            lane_end(g, l, cpu->stop ? CPU_STOP_REQUEST : CPU_STOP_LIMIT, 0);
+            cpu->stop = 0;
+            act &= ~(1u << l);
+        } else if (limit - cpu->stats.instret < budget) {
+            budget = limit - cpu->stats.instret;
+        }
+    }
+    if (!act) {
+        lead = NULL;
+        goto schedule;
+    }
+    wait = g->live & ~act;
+    lanes_mask(&m, act);
+    lanes_mask(&keep, wait);
+    lead = g->cpu[__builtin_ctz(act)];
+    goto dispatch;
+
+dispatch:
+    // n counts the instructions of the active lanes since the last sync, budget is how many all of
+    // them may still run. merge is the lowest pc a waiting lane is at
+    if (n == budget || pc == merge)
+        goto sync;
+    n++;
+    e = &lead->icache[(pc >> 2) & (ICACHE_SIZE - 1)];
+    if (e->pc != pc) {
+        misses++;
+        code_mark(lead, pc);
+        e->pc = pc;
+        rv_decode(bus_fetch(&lead->bus, pc), &e->in);
+    }
+    in = &e->in;
+    pc += 4;
+    // a switch, gcc does not clone a function that takes the address of a label
+    switch (in->op) {
+    case OP_LUI:
+        NEXT(SET(zero + IMM));
+    case OP_AUIPC:
+        NEXT(SET(zero + (pc + IMM - 4)));
+    case OP_JAL:
+        SET(zero + pc);
+        x[0] = zero;
+        target = pc + (int64_t)IMM - 4;
+        if (wait) {
+            bits = act;
+            goto split;
+        }
+        NEXT(pc = target; STOP_CHECK());
+    case OP_JALR:
+        t = (RS1 + IMM) & 0xfffffffe; // like exec_JALR
+        SET(zero + pc);
+        x[0] = zero;
+        target = t[__builtin_ctz(act)];
+        v = (lanes_t)(t != target) & m;
+        bits = lanes_bits(&v);
+        if (bits || wait) {
+            EACH(g->pc[l] = t[l]);
+            goto reschedule;
+        }
+        NEXT(pc = target; STOP_CHECK());
+    case OP_BEQ:
+        NEXT(BRANCH(RS1 == RS2));
+    case OP_BNE:
+        NEXT(BRANCH(RS1 != RS2));
+    case OP_BLT:
+        NEXT(BRANCH((slanes_t)RS1 < (slanes_t)RS2));
+    case OP_BGE:
+        NEXT(BRANCH((slanes_t)RS1 >= (slanes_t)RS2));
+    case OP_BLTU:
+        NEXT(BRANCH(RS1 < RS2));
+    case OP_BGEU:
+        NEXT(BRANCH(RS1 >= RS2));
+    case OP_LB:
+        NEXT(EACH(x[in->rd][l] = (int64_t)(int8_t)LOAD(8)); x[0] = zero);
+    case OP_LH:
+        NEXT(EACH(x[in->rd][l] = (int64_t)(int16_t)LOAD(16)); x[0] = zero);
+    case OP_LW:
+        NEXT(EACH(x[in->rd][l] = (int64_t)(int32_t)LOAD(32)); x[0] = zero);
+    case OP_LD:
+        NEXT(EACH(x[in->rd][l] = LOAD(64)); x[0] = zero);
+    case OP_LBU:
+        NEXT(EACH(x[in->rd][l] = LOAD(8)); x[0] = zero);
+    case OP_LHU:
+        NEXT(EACH(x[in->rd][l] = LOAD(16)); x[0] = zero);
+    case OP_LWU:
+        NEXT(EACH(x[in->rd][l] = LOAD(32)); x[0] = zero);
+    case OP_SB:
+        NEXT(EACH(STORE(8)));
+    case OP_SH:
+        NEXT(EACH(STORE(16)));
+    case OP_SW:
+        NEXT(EACH(STORE(32)));
+    case OP_SD:
+        NEXT(EACH(STORE(64)));
+    // shift counts are masked like the host masks them for the other engines
+    case OP_ADDI:
+        NEXT(SET(RS1 + IMM));
+    case OP_SLLI:
+    case OP_SLLI_64:
+        NEXT(SET(RS1 << (IMM & 0x3f)));
+    case OP_SLTI:
+    case OP_SLTIU:
+        NEXT(SET((lanes_t)(RS1 < IMM) & 1));
+    case OP_XORI:
+        NEXT(SET(RS1 ^ IMM));
+    case OP_SRLI:
+    case OP_SRLI_64:
+    case OP_SRAI_64:
+        NEXT(SET(RS1 >> (IMM & 0x3f)));
+    case OP_SRAI:
+        NEXT(SET((lanes_t)((slanes_t)RS1 >> (int64_t)(IMM & 0x3f))));
+    case OP_ORI:
+        NEXT(SET(RS1 | IMM));
+    case OP_ANDI:
+        NEXT(SET(RS1 & IMM));
+    case OP_ADD:
+        NEXT(SET(RS1 + RS2));
+    case OP_SUB:
+        NEXT(SET(RS1 - RS2));
+    case OP_SLL:
+        NEXT(SET(RS1 << (RS2 & 0x3f)));
+    case OP_SLT:
+        NEXT(SET((lanes_t)((slanes_t)RS1 < (slanes_t)RS2) & 1));
+    case OP_SLTU:
+        NEXT(SET((lanes_t)(RS1 < RS2) & 1));
+    case OP_XOR:
+        NEXT(SET(RS1 ^ RS2));
+    case OP_SRL:
+        NEXT(SET(RS1 >> (RS2 & 0x3f)));
+    case OP_OR:
+        NEXT(SET(RS1 | RS2));
+    case OP_AND:
+        NEXT(SET(RS1 & RS2));
+    case OP_FENCE:
+        NEXT(fence_exec(in->inst));
+    case OP_NOP:
+        goto dispatch;
+    case OP_ADDIW:
+        NEXT(SET(SEXT32(RS1 + IMM)));
+    case OP_SLLIW:
+        NEXT(SET((RS1 << (IMM & 0x1f)) & 0xffffffff)); // zero extended, like exec_SLLIW and exec_SRLIW
+    case OP_SRLIW:
+        NEXT(SET((RS1 & 0xffffffff) >> (IMM & 0x1f)));
+    case OP_SRAIW:
+        NEXT(SET((lanes_t)((slanes_t)SEXT32(RS1) >> (int64_t)(IMM & 0x1f))));
+    case OP_ADDW:
+        NEXT(SET(SEXT32(RS1 + RS2)));
+    case OP_SUBW:
+        NEXT(SET(SEXT32(RS1 - RS2)));
+    case OP_SLLW:
+        NEXT(SET(SEXT32(RS1 << (RS2 & 0x1f))));
+    case OP_SRLW:
+        NEXT(SET(SEXT32((RS1 & 0xffffffff) >> (RS2 & 0x1f))));
+    case OP_SRAW:
+        NEXT(SET((lanes_t)((slanes_t)SEXT32(RS1) >> (slanes_t)(RS2 & 0x1f))));
+    case OP_SRA:
+        NEXT(SET((lanes_t)((slanes_t)RS1 >> (slanes_t)(RS2 & 0x1f))));
+    //
+    // rv64 M extension, the divisions and high products lane by lane
+    //
+    case OP_MUL:
+        NEXT(SET(RS1 * RS2));
+    case OP_MULW:
+        NEXT(SET(SEXT32(RS1 * RS2)));
+    case OP_MULH:
+        NEXT(EACH(x[in->rd][l] = (((int128_t)(int64_t)x[in->rs1][l]) * ((int128_t)(int64_t)x[in->rs2][l])) >> 64));
+    case OP_MULHU:
+        NEXT(EACH(x[in->rd][l] = ((uint128_t)x[in->rs1][l] * (uint128_t)x[in->rs2][l]) >> 64));
+    case OP_MULHSU:
+        NEXT(EACH(x[in->rd][l] = ((int128_t)(((int128_t)(int64_t)x[in->rs1][l]) * (uint128_t)x[in->rs2][l])) >> 64));
+    case OP_DIV:
+        NEXT(EACH(x[in->rd][l] = (int64_t)x[in->rs2][l] == -1 ? -x[in->rs1][l] : x[in->rs2][l] != 0 ? (uint64_t)((int64_t)x[in->rs1][l] / (int64_t)x[in->rs2][l]) : (uint64_t)-1));
+    case OP_DIVU:
+        NEXT(EACH(x[in->rd][l] = x[in->rs2][l] != 0 ? x[in->rs1][l] / x[in->rs2][l] : (uint64_t)-1));
+    case OP_DIVW:
+        NEXT(EACH(x[in->rd][l] = (int32_t)x[in->rs2][l] == -1 ? (uint64_t)(int64_t)(int32_t)-(uint32_t)x[in->rs1][l] : (int32_t)x[in->rs2][l] != 0 ? (uint64_t)(int64_t)((int32_t)x[in->rs1][l] / (int32_t)x[in->rs2][l]) : (uint64_t)-1));
+    case OP_DIVUW:
+        NEXT(EACH(x[in->rd][l] = (uint32_t)x[in->rs2][l] != 0 ? (uint64_t)((uint32_t)x[in->rs1][l] / (uint32_t)x[in->rs2][l]) : (uint64_t)-1));
+    case OP_REM:
+        NEXT(EACH(x[in->rd][l] = (int64_t)x[in->rs2][l] == -1 ? 0 : x[in->rs2][l] != 0 ? (uint64_t)((int64_t)x[in->rs1][l] % (int64_t)x[in->rs2][l]) : (uint64_t)-1));
+    case OP_REMU:
+        NEXT(EACH(x[in->rd][l] = x[in->rs2][l] != 0 ? x[in->rs1][l] % x[in->rs2][l] : (uint64_t)-1));
+    case OP_REMW:
+        NEXT(EACH(x[in->rd][l] = (int32_t)x[in->rs2][l] == -1 ? 0 : (int32_t)x[in->rs2][l] != 0 ? (uint64_t)(int64_t)((int32_t)x[in->rs1][l] % (int32_t)x[in->rs2][l]) : (uint64_t)-1));
+    case OP_REMUW:
+        NEXT(EACH(x[in->rd][l] = (uint32_t)x[in->rs2][l] != 0 ? (uint64_t)((uint32_t)x[in->rs1][l] % (uint32_t)x[in->rs2][l]) : (uint64_t)-1));
+
+    case OP_FENCE_I:
+    case OP_ECALL_EBREAK:
+    case OP_CSR:
+    case OP_AMO:
+    case OP_invalid:
+        // lane by lane on the cpu_t, a handler may flush the icache in points into
+        cur = *in;
+        SETTLE();
+        EACH({
+            cpu_t *cpu = g->cpu[l];
+            lane_out(x, l, cpu);
+            cpu->pc = pc;
+            if ((ret = cur.fn(cpu, &cur))) {
+                lane_end(g, l, cpu->stop_reason, ret);
+            } else {
+                lane_in(x, l, cpu);
+                g->pc[l] = cpu->pc;
+            }
+        });
+        act &= g->live;
+        goto reschedule;
+    }
+}
+
+int cpu_run_lanes(cpu_t **cpus, int n, uint64_t max_instructions, cpu_result_t *results) {
+    if (n < 1)
+        return -1;
+    for (int i = 0; i < n; i += CPU_LANES) {
+        group_t g = {.live = 0};
+        for (int l = 0; l < CPU_LANES && i + l < n; l++) {
+            cpu_t *cpu = cpus[i + l];
+            uint64_t start = cpu->stats.instret;
+            g.cpu[l] = cpu;
+            g.result[l] = &results[i + l];
+            g.start[l] = start;
+            cpu->regs[0] = 0;
+            __atomic_store_n(&cpu->limit, max_instructions > UINT64_MAX - start ? UINT64_MAX : start + max_instructions, __ATOMIC_RELAXED);
+            if (cpu->stop) {
+                results[i + l] = (cpu_result_t){.stop = CPU_STOP_REQUEST};
+                cpu->stop = 0;
+            } else {
+                g.live |= 1u << l;
+            }
+        }
+        lanes_run(&g);
+    }
+    return 0;
+}
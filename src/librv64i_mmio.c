@@ -0,0 +1,169 @@
+#include <stdlib.h>
+
+#include "librv64i_internal.h"
+
+// memory mapped devices. loads and stores check the range of dram first and only what misses it
+// comes here, so dram keeps its single branch. the device is found through the guest page of the
+// address: a hash table of 2 MiB chunks of the address space, each with the device numbers of its
+// 512 pages. a lookup is one probe and one index however many devices there are.
+
+#define MMIO_PAGE_SHIFT 12
+#define MMIO_CHUNK_SHIFT 9 // log2 of the pages of a chunk
+#define MMIO_CHUNK_MASK ((1u << MMIO_CHUNK_SHIFT) - 1)
+
+typedef struct mmio_chunk_t {
+    uint64_t key;                       // guest address >> (MMIO_PAGE_SHIFT + MMIO_CHUNK_SHIFT)
+    uint8_t dev[1u << MMIO_CHUNK_SHIFT]; // device number + 1 of each page, 0 for none
+} mmio_chunk_t;
+
+typedef struct mmio_t {
+    cpu_device_t dev[CPU_MAX_DEVICES];
+    cpu_device_stats_t stats[CPU_MAX_DEVICES];
+    int count;
+    mmio_chunk_t **chunks; // open addressed on the key, cap is a power of two
+    uint64_t cap;
+    uint64_t used;
+} mmio_t;
+
+static uint64_t mmio_hash(uint64_t key) { return (key * 0x9e3779b97f4a7c15ull) >> 32; }
+
+static mmio_chunk_t *mmio_chunk(const mmio_t *m, uint64_t key) {
+    for (uint64_t h = mmio_hash(key);; h++) {
+        mmio_chunk_t *c = m->chunks[h & (m->cap - 1)];
+        if (!c || c->key == key)
+            return c;
+    }
+}
+
+static void mmio_insert(mmio_t *m, mmio_chunk_t *c) {
+    uint64_t h = mmio_hash(c->key);
+    while (m->chunks[h & (m->cap - 1)])
+        h++;
+    m->chunks[h & (m->cap - 1)] = c;
+    m->used++;
+}
+
+// the chunk of key, a new one if there is none. the table stays at most half full
+static mmio_chunk_t *mmio_chunk_add(mmio_t *m, uint64_t key) {
+    mmio_chunk_t *c = mmio_chunk(m, key);
+    if (c)
+        return c;
+    if (2 * (m->used + 1) > m->cap) {
+        mmio_t old = *m;
+        m->cap *= 2;
+        m->used = 0;
+        if (!(m->chunks = calloc(m->cap, sizeof(mmio_chunk_t *)))) {
+            *m = old;
+            return NULL;
+        }
+        for (uint64_t i = 0; i < old.cap; i++)
+            if (old.chunks[i])
+                mmio_insert(m, old.chunks[i]);
+        free(old.chunks);
+    }
+    if (!(c = calloc(1, sizeof(mmio_chunk_t))))
+        return NULL;
+    c->key = key;
+    mmio_insert(m, c);
+    return c;
+}
+
+// the device the n bytes at addr are in, -1 if they are not all inside one
+static int mmio_find(const mmio_t *m, uint64_t addr, uint64_t n) {
+    const mmio_chunk_t *c = mmio_chunk(m, addr >> (MMIO_PAGE_SHIFT + MMIO_CHUNK_SHIFT));
+    int i = c ? c->dev[(addr >> MMIO_PAGE_SHIFT) & MMIO_CHUNK_MASK] - 1 : -1;
+    return i >= 0 && m->dev[i].size >= n && addr - m->dev[i].base <= m->dev[i].size - n ? i : -1;
+}
+
+int mmio_share(bus_t *bus) {
+    if (bus->mmio)
+        return 0;
+    mmio_t *m = calloc(1, sizeof(mmio_t));
+    if (!m || !(m->chunks = calloc(16, sizeof(mmio_chunk_t *)))) {
+        free(m);
+        return -1;
+    }
+    m->cap = 16;
+    bus->mmio = m;
+    return 0;
+}
+
+int cpu_device_add(cpu_t *cpu, const cpu_device_t *dev) {
+    bus_t *bus = &cpu->bus;
+    const dram_t *dram = &bus->dram;
+    uint64_t end = dev->base + dev->size - 1;
+    if (bus->guard || !dev->size || end < dev->base || (dev->base < dram->base + dram->size && dram->base <= end))
+        return -1;
+    if (mmio_share(bus))
+        return -1;
+    mmio_t *m = bus->mmio;
+    if (m->count == CPU_MAX_DEVICES)
+        return -1;
+    uint64_t first = dev->base >> MMIO_PAGE_SHIFT;
+    uint64_t last = end >> MMIO_PAGE_SHIFT;
+    for (uint64_t page = first; page <= last; page++) {
+        const mmio_chunk_t *c = mmio_chunk(m, page >> MMIO_CHUNK_SHIFT);
+        if (c && c->dev[page & MMIO_CHUNK_MASK])
+            return -1;
+    }
+    for (uint64_t page = first; page <= last; page++) {
+        mmio_chunk_t *c = mmio_chunk_add(m, page >> MMIO_CHUNK_SHIFT);
+        if (!c) {
+            // the pages marked so far go back to no device, their chunks stay
+            while (page-- > first)
+                mmio_chunk(m, page >> MMIO_CHUNK_SHIFT)->dev[page & MMIO_CHUNK_MASK] = 0;
+            return -1;
+        }
+        c->dev[page & MMIO_CHUNK_MASK] = m->count + 1;
+    }
+    m->dev[m->count] = *dev;
+    m->stats[m->count] = (cpu_device_stats_t){0};
+    return m->count++;
+}
+
+int cpu_device_stats(cpu_t *cpu, int n, cpu_device_stats_t *stats) {
+    const mmio_t *m = cpu->bus.mmio;
+    if (!m || n < 0 || n >= m->count)
+        return -1;
+    *stats = m->stats[n];
+    return 0;
+}
+
+uint64_t mmio_load(bus_t *bus, uint64_t addr, uint64_t size) {
+    mmio_t *m = bus->mmio;
+    int i = mmio_find(m, addr, size / 8);
+    if (i < 0)
+        return 0;
+    const cpu_device_t *d = &m->dev[i];
+    __atomic_fetch_add(&m->stats[i].reads, 1, __ATOMIC_RELAXED); // harts share the device
+    uint64_t v = d->read ? d->read(d->ctx, addr - d->base, size / 8) : 0;
+    // the engines extend the value from the size of the access
+    return size == 64 ? v : v & ((1ull << size) - 1);
+}
+
+void mmio_store(bus_t *bus, uint64_t addr, uint64_t size, uint64_t value) {
+    mmio_t *m = bus->mmio;
+    int i = mmio_find(m, addr, size / 8);
+    if (i < 0)
+        return;
+    const cpu_device_t *d = &m->dev[i];
+    __atomic_fetch_add(&m->stats[i].writes, 1, __ATOMIC_RELAXED);
+    if (d->write)
+        d->write(d->ctx, addr - d->base, size / 8, size == 64 ? value : value & ((1ull << size) - 1));
+}
+
+void mmio_reset(bus_t *bus) {
+    if (bus->mmio)
+        memset(bus->mmio->stats, 0, sizeof(bus->mmio->stats));
+}
+
+void mmio_free(bus_t *bus) {
+    mmio_t *m = bus->mmio;
+    if (!m)
+        return;
+    for (uint64_t i = 0; i < m->cap; i++)
+        free(m->chunks[i]);
+    free(m->chunks);
+    free(m);
+    bus->mmio = NULL;
+}
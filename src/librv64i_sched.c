@@ -0,0 +1,270 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// scheduler: many cpus on a few host threads. a job runs in slices of quantum instructions, a
+// cpu_run each, so a worker switches jobs at block boundaries without the guest noticing, and the
+// cpu keeps its engine state (blocks, traces, native code) between slices on whichever worker.
+//
+// every worker has a deque of the jobs it will run. it takes the newest from the bottom, which
+// keeps a job that was just woken on the core that ran it, and puts a job whose slice ran out
+// at the top, behind the others. a worker without jobs steals from the top of another one,
+// starting at a random worker so idle ones do not all pick the same victim. a deque is a ring
+// with a lock, it is only held for one index, and a job is in at most one of them.
+//
+// workers that found nothing sleep on a condition until a job is queued or the last one ended.
+
+typedef struct sched_job_t {
+    cpu_t *cpu;
+    uint64_t max;
+    int worker;  // the worker that ran the last slice, -1 before the first
+    int waiting; // its ecall handler returned CPU_SCHED_WAIT
+    int woken;   // cpu_sched_wake came before the worker saw CPU_SCHED_WAIT
+    int done;
+    cpu_result_t result;
+    cpu_job_stats_t stats;
+} sched_job_t;
+
+typedef struct sched_worker_t {
+    pthread_mutex_t lock;
+    int *ring; // s->cap jobs, head is the top
+    uint64_t head;
+    uint64_t tail;
+    uint64_t rng;
+    int id;
+    pthread_t thread;
+    struct cpu_sched_t *s;
+} __attribute__((aligned(64))) sched_worker_t; // the locks of two workers never share a cache line
+
+struct cpu_sched_t {
+    int workers;
+    uint64_t quantum;
+    sched_job_t *jobs;
+    int count;
+    int size;
+    uint64_t cap; // ring size, a power of two of at least count
+    sched_worker_t *w;
+    pthread_mutex_t lock; // left, sleepers waiting on cond, and waiting/woken of the jobs
+    pthread_cond_t cond;
+    int left;     // jobs that did not end
+    int sleepers; // atomic, workers in cond
+    int queued;   // atomic, jobs in the deques
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+cpu_sched_t *cpu_sched_new(int workers, uint64_t quantum) {
+    cpu_sched_t *s = quantum ? calloc(1, sizeof(cpu_sched_t)) : NULL;
+    if (!s)
+        return NULL;
+    s->workers = workers > 0 ? workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (s->workers < 1)
+        s->workers = 1;
+    s->quantum = quantum;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    return s;
+}
+
+int cpu_sched_add(cpu_sched_t *s, cpu_t *cpu, uint64_t max_instructions) {
+    if (s->count == s->size) {
+        int size = s->size ? 2 * s->size : 64;
+        sched_job_t *jobs = realloc(s->jobs, size * sizeof(sched_job_t));
+        if (!jobs)
+            return -1;
+        s->jobs = jobs;
+        s->size = size;
+    }
+    s->jobs[s->count] = (sched_job_t){.cpu = cpu, .max = max_instructions, .worker = -1};
+    return s->count++;
+}
+
+// queue job on w, at the top behind the other jobs or at the bottom to run next
+static void sched_push(sched_worker_t *w, int job, int top) {
+    cpu_sched_t *s = w->s;
+    pthread_mutex_lock(&w->lock);
+    if (top)
+        w->ring[--w->head & (s->cap - 1)] = job;
+    else
+        w->ring[w->tail++ & (s->cap - 1)] = job;
+    __atomic_fetch_add(&s->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->lock);
+    // seq_cst against the sleeper, which counts itself before it looks at queued
+    if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static int sched_pop(sched_worker_t *w, int top) {
+    int job = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail) {
+        job = top ? w->ring[w->head++ & (w->s->cap - 1)] : w->ring[--w->tail & (w->s->cap - 1)];
+        __atomic_fetch_sub(&w->s->queued, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+// the next job of w, its own newest or the oldest of another worker
+static int sched_next(sched_worker_t *w) {
+    cpu_sched_t *s = w->s;
+    int job = sched_pop(w, 0);
+    if (job >= 0 || s->workers == 1)
+        return job;
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    for (int i = 0; i < s->workers && job < 0; i++) {
+        int victim = (w->rng + i) % s->workers;
+        if (victim != w->id)
+            job = sched_pop(&s->w[victim], 1);
+    }
+    return job;
+}
+
+static void sched_end(cpu_sched_t *s, sched_job_t *job, cpu_result_t r) {
+    job->result = (cpu_result_t){.stop = r.stop, .ret = r.ret, .instret = job->stats.instret};
+    pthread_mutex_lock(&s->lock);
+    job->done = 1;
+    if (!--s->left)
+        pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void sched_slice(sched_worker_t *w, int n) {
+    cpu_sched_t *s = w->s;
+    sched_job_t *job = &s->jobs[n];
+    uint64_t left = job->max - job->stats.instret;
+    uint64_t t = now_ns();
+    cpu_result_t r = cpu_run(job->cpu, left < s->quantum ? left : s->quantum);
+    job->stats.run_ns += now_ns() - t;
+    job->stats.instret += r.instret;
+    job->stats.slices++;
+    if (job->worker >= 0 && job->worker != w->id)
+        job->stats.migrations++;
+    job->worker = w->id;
+
+    if (r.stop == CPU_STOP_LIMIT && job->stats.instret < job->max) {
+        sched_push(w, n, 1);
+    } else if (r.stop == CPU_STOP_ECALL && r.ret == CPU_SCHED_WAIT) {
+        pthread_mutex_lock(&s->lock);
+        int woken = job->woken;
+        job->woken = 0;
+        job->waiting = !woken;
+        pthread_mutex_unlock(&s->lock);
+        if (woken)
+            sched_push(w, n, 0);
+    } else {
+        sched_end(s, job, r);
+    }
+}
+
+static void *sched_worker(void *arg) {
+    sched_worker_t *w = arg;
+    cpu_sched_t *s = w->s;
+    for (;;) {
+        int job = sched_next(w);
+        if (job >= 0) {
+            sched_slice(w, job);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        __atomic_fetch_add(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (s->left && !__atomic_load_n(&s->queued, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&s->cond, &s->lock);
+        __atomic_fetch_sub(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+        int left = s->left;
+        pthread_mutex_unlock(&s->lock);
+        if (!left)
+            return NULL;
+    }
+}
+
+void cpu_sched_wake(cpu_sched_t *s, int job) {
+    sched_job_t *j = &s->jobs[job];
+    pthread_mutex_lock(&s->lock);
+    int waiting = j->waiting;
+    j->waiting = 0;
+    j->woken = !waiting;
+    pthread_mutex_unlock(&s->lock);
+    // back on the worker that ran it, its caches are still warm
+    if (waiting)
+        sched_push(&s->w[j->worker], job, 0);
+}
+
+int cpu_sched_run(cpu_sched_t *s) {
+    int n = s->workers;
+    int started = 1;
+    s->cap = 1;
+    while (s->cap < (uint64_t)s->count)
+        s->cap *= 2;
+    if (posix_memalign((void **)&s->w, 64, n * sizeof(sched_worker_t)))
+        return -1;
+    memset(s->w, 0, n * sizeof(sched_worker_t));
+    for (int i = 0; i < n; i++) {
+        sched_worker_t *w = &s->w[i];
+        if (!(w->ring = malloc(s->cap * sizeof(int)))) {
+            while (i--)
+                free(s->w[i].ring);
+            free(s->w);
+            s->w = NULL;
+            return -1;
+        }
+        pthread_mutex_init(&w->lock, NULL);
+        w->id = i;
+        w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        w->s = s;
+    }
+    s->left = 0;
+    s->queued = 0;
+    for (int i = 0; i < s->count; i++) {
+        if (s->jobs[i].done)
+            continue;
+        sched_push(&s->w[s->left++ % n], i, 0);
+    }
+
+    // with fewer threads than workers the others steal the jobs of the missing ones
+    for (; started < n; started++)
+        if (pthread_create(&s->w[started].thread, NULL, sched_worker, &s->w[started]))
+            break;
+    sched_worker(&s->w[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(s->w[i].thread, NULL);
+
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_destroy(&s->w[i].lock);
+        free(s->w[i].ring);
+    }
+    free(s->w);
+    s->w = NULL;
+    return 0;
+}
+
+int cpu_sched_result(cpu_sched_t *s, int job, cpu_result_t *result, cpu_job_stats_t *stats) {
+    if (job < 0 || job >= s->count)
+        return -1;
+    if (result)
+        *result = s->jobs[job].result;
+    if (stats)
+        *stats = s->jobs[job].stats;
+    return 0;
+}
+
+void cpu_sched_free(cpu_sched_t *s) {
+    if (!s)
+        return;
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->jobs);
+    free(s);
+}
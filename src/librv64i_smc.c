@@ -0,0 +1,125 @@
+#include <stdlib.h>
+
+#include "librv64i_internal.h"
+
+// self modifying code. like on hardware the guest has to execute FENCE.I before it runs code
+// it wrote, and that drops decoded instructions and translated blocks. by default it drops all
+// of them. a cpu with cpu_config_t.guard, or with a cpu_snapshot, has the fault handler of
+// librv64i_guard.c already: there every dram page that an icache entry or a translated block is
+// made from is write protected, the first store to it faults once, marks the page written and
+// leaves it writable. FENCE.I then drops only the decoded instructions of the written pages
+// (and the translated blocks), a page decoded from again after that is protected again. a page
+// that mixes code and data costs one fault per FENCE.I, not one per store.
+//
+// the ahead of time translation can not be dropped by page, an image that modifies its
+// code must not use it.
+
+int code_init(cpu_t *cpu) {
+    codemap_t *c = calloc(1, sizeof(codemap_t));
+    if (!c)
+        return -1;
+    c->shift = __builtin_ctzll(dram_page_size());
+    c->pages = (cpu->bus.dram.size + (1ull << c->shift) - 1) >> c->shift;
+    c->code = calloc((c->pages + 63) / 64, sizeof(uint64_t));
+    c->written = calloc((c->pages + 63) / 64, sizeof(uint64_t));
+    cpu->code = c;
+    if (!c->code || !c->written) {
+        code_free(cpu);
+        return -1;
+    }
+    // stores of harts to the shared dram are seen by the cpu that owns it, a hart drops everything
+    c->tracked = !cpu->owner && cpu->bus.guard && !guard_watch(cpu);
+    return 0;
+}
+
+void code_track(cpu_t *cpu) {
+    codemap_t *c = cpu->code;
+    if (c->tracked || cpu->owner)
+        return;
+    // the stores to what was decoded so far were not seen, the next FENCE.I drops it
+    for (uint64_t w = 0; w < (c->pages + 63) / 64; w++)
+        c->written[w] = c->code[w];
+    c->tracked = 1;
+}
+
+void code_free(cpu_t *cpu) {
+    codemap_t *c = cpu->code;
+    if (!c)
+        return;
+    cpu->code = NULL;
+    free(c->code);
+    free(c->written);
+    free(c);
+}
+
+static int bit(const uint64_t *map, uint64_t i) { return map[i / 64] >> (i % 64) & 1; }
+
+void code_page_add(cpu_t *cpu, uint64_t page) {
+    codemap_t *c = cpu->code;
+    c->code[page / 64] |= 1ull << (page % 64);
+    // a written page stays writable until FENCE.I drops what was decoded from it
+    if (c->tracked && !bit(c->written, page))
+        guard_protect(cpu, page << c->shift, 1ull << c->shift);
+}
+
+int code_written(cpu_t *cpu, uint64_t page) {
+    codemap_t *c = cpu->code;
+    if (!c || !c->tracked || page >= c->pages || !bit(c->code, page))
+        return 0;
+    __atomic_fetch_or(&c->written[page / 64], 1ull << (page % 64), __ATOMIC_RELAXED);
+    return 1;
+}
+
+// a page that is protected neither for a snapshot nor for code can be written again
+static void code_release(cpu_t *cpu, uint64_t page) {
+    codemap_t *c = cpu->code;
+    snapshot_t *snap = cpu->snap;
+    uint64_t off = page << c->shift;
+    if (c->tracked && !bit(c->written, page) && !(snap && snap->tracked && !bit(snap->dirty, page)))
+        guard_unprotect(cpu, off, 1ull << c->shift);
+}
+
+// the pages FENCE.I drops in word w of the bitmaps
+static uint64_t code_stale(const codemap_t *c, uint64_t w) { return c->tracked ? c->code[w] & c->written[w] : c->code[w]; }
+
+void code_sync(cpu_t *cpu) {
+    codemap_t *c = cpu->code;
+    uint64_t words = (c->pages + 63) / 64;
+    uint64_t n = 0;
+    for (uint64_t w = 0; w < words; w++)
+        n += __builtin_popcountll(code_stale(c, w));
+    if (!n)
+        return;
+
+    // direct mapped, the entries of a page are wherever their pc put them
+    for (int i = 0; i < ICACHE_SIZE; i++) {
+        uint64_t page = (cpu->icache[i].pc - cpu->bus.dram.base) >> c->shift;
+        if (!(cpu->icache[i].pc & 1) && page < c->pages && code_stale(c, page / 64) >> (page % 64) & 1)
+            cpu->icache[i].pc = 1;
+    }
+    for (uint64_t w = 0; w < words; w++) {
+        uint64_t drop = code_stale(c, w);
+        c->code[w] &= ~drop;
+        __atomic_fetch_and(&c->written[w], ~drop, __ATOMIC_RELAXED);
+    }
+    // blocks are chained and patched into each other, they all go
+    block_cache_flush(cpu);
+    cpu->stats.code_invalidated += n;
+}
+
+void code_clear(cpu_t *cpu) {
+    codemap_t *c = cpu->code;
+    for (uint64_t w = 0; w < (c->pages + 63) / 64; w++) {
+        for (uint64_t bits = c->code[w]; bits; bits &= bits - 1)
+            code_release(cpu, w * 64 + __builtin_ctzll(bits));
+        c->code[w] = 0;
+        c->written[w] = 0;
+    }
+}
+
+void code_protect(cpu_t *cpu) {
+    codemap_t *c = cpu->code;
+    for (uint64_t w = 0; c->tracked && w < (c->pages + 63) / 64; w++)
+        for (uint64_t bits = c->code[w] & ~c->written[w]; bits; bits &= bits - 1)
+            guard_protect(cpu, (w * 64 + __builtin_ctzll(bits)) << c->shift, 1ull << c->shift);
+}
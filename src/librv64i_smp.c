@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "librv64i_internal.h"
+
+// harts: cpus that share the dram and devices of one cpu, each run by cpu_run on its own host
+// thread. the engines access dram with plain host loads and stores, which gives the guest the
+// memory order of the host, and an x86-64 host is TSO, stronger than RVWMO. what needs more goes
+// through the host atomics here: the A extension and the fences of FENCE.
+//
+// cpu_run_harts_quantum is the reproducible alternative: the harts take turns on one thread,
+// each running exactly quantum instructions, so a run only depends on the image, its inputs
+// and the quantum. the turns are the barriers, no hart runs while another one does.
+//
+// LR takes a reservation on its address and remembers the value it loaded, SC is a compare and
+// swap against that value. another hart storing the same value in between goes unnoticed, which
+// is allowed for an LR/SC loop that only depends on the value.
+
+#define CSR_MHARTID 0xf14
+
+// one AMO of width type at q. AMOMIN/AMOMAX have no host instruction, they are a compare and swap loop
+#define AMO_FN(name, type, stype)                                                                                                                              \
+    static int name(cpu_t *cpu, type *q, uint64_t a, int funct5, type b, type *v) {                                                                            \
+        type old, new;                                                                                                                                         \
+        switch (funct5) {                                                                                                                                      \
+        case 0x02: /* LR */                                                                                                                                    \
+            *v = __atomic_load_n(q, __ATOMIC_SEQ_CST);                                                                                                         \
+            cpu->lr_addr = a;                                                                                                                                  \
+            cpu->lr_value = *v;                                                                                                                                \
+            return 0;                                                                                                                                          \
+        case 0x03: /* SC, 0 in rd when it stored */                                                                                                            \
+            old = cpu->lr_value;                                                                                                                               \
+            *v = !(cpu->lr_addr == a && __atomic_compare_exchange_n(q, &old, b, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));                                       \
+            cpu->lr_addr = LR_NONE;                                                                                                                            \
+            return 0;                                                                                                                                          \
+        case 0x01: *v = __atomic_exchange_n(q, b, __ATOMIC_SEQ_CST); return 0;                                                                                 \
+        case 0x00: *v = __atomic_fetch_add(q, b, __ATOMIC_SEQ_CST); return 0;                                                                                  \
+        case 0x04: *v = __atomic_fetch_xor(q, b, __ATOMIC_SEQ_CST); return 0;                                                                                  \
+        case 0x0c: *v = __atomic_fetch_and(q, b, __ATOMIC_SEQ_CST); return 0;                                                                                  \
+        case 0x08: *v = __atomic_fetch_or(q, b, __ATOMIC_SEQ_CST); return 0;                                                                                   \
+        case 0x10: /* AMOMIN */                                                                                                                                \
+        case 0x14: /* AMOMAX */                                                                                                                                \
+        case 0x18: /* AMOMINU */                                                                                                                               \
+        case 0x1c: /* AMOMAXU */                                                                                                                               \
+            old = __atomic_load_n(q, __ATOMIC_RELAXED);                                                                                                        \
+            do {                                                                                                                                               \
+                int less = funct5 < 0x18 ? (stype)old < (stype)b : old < b;                                                                                    \
+                new = (less == (funct5 == 0x10 || funct5 == 0x18)) ? old : b;                                                                                  \
+            } while (!__atomic_compare_exchange_n(q, &old, new, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));                                                       \
+            *v = old;                                                                                                                                          \
+            return 0;                                                                                                                                          \
+        }                                                                                                                                                      \
+        return -1;                                                                                                                                             \
+    }
+
+AMO_FN(amo_32, uint32_t, int32_t)
+AMO_FN(amo_64, uint64_t, int64_t)
+
+int amo_exec(cpu_t *cpu, const insn_t *in, uint64_t a, uint64_t b, uint64_t *v) {
+    int funct3 = (in->inst >> 12) & 7;
+    int funct5 = in->inst >> 27;
+    if ((funct3 != 2 && funct3 != 3) || (funct5 == 0x02 && in->rs2))
+        return -1;
+    // atomics are on dram only, a device has no host address for them
+    uint64_t n = funct3 == 3 ? 8 : 4;
+    uint8_t *p = a & (n - 1) ? NULL : bus_ptr(&cpu->bus, a, n);
+    if (!p)
+        return -1;
+    if (n == 8)
+        return amo_64(cpu, (uint64_t *)p, a, funct5, b, v);
+    uint32_t w;
+    if (amo_32(cpu, (uint32_t *)p, a, funct5, (uint32_t)b, &w))
+        return -1;
+    *v = (uint64_t)(int64_t)(int32_t)w;
+    return 0;
+}
+
+int csr_exec(cpu_t *cpu, const insn_t *in, uint64_t *v) {
+    // CSRRS/CSRRC with x0 and CSRRSI/CSRRCI with 0 read without writing, a read only CSR allows nothing else
+    int funct3 = (in->inst >> 12) & 7;
+    if ((in->inst >> 20) != CSR_MHARTID || (funct3 & 3) < 2 || in->rs1)
+        return -1;
+    *v = cpu->hartid;
+    return 0;
+}
+
+int cpu_init_hart(cpu_t *hart, cpu_t *cpu, uint64_t hartid) {
+    cpu_t *owner = cpu->owner ? cpu->owner : cpu;
+    cpu_config_t config = {.engine = cpu->engine, .dram_base = owner->bus.dram.base, .dram_size = owner->bus.dram.size, .guard = owner->bus.guard, .handlers = cpu->handlers};
+    if (!owner->bus.guard && mmio_share(&owner->bus))
+        return -1;
+    if (cpu_init_shared(hart, &config, -1, owner) || (owner->aot && !(hart->aot = aot_dup(owner->aot)))) {
+        cpu_free(hart);
+        return -1;
+    }
+    memcpy(hart->regs, cpu->regs, sizeof(hart->regs));
+    hart->pc = cpu->pc;
+    hart->hartid = hartid;
+    return 0;
+}
+
+typedef struct hart_run_t {
+    cpu_t *cpu;
+    uint64_t max;
+    cpu_result_t r;
+} hart_run_t;
+
+static void *hart_thread(void *arg) {
+    hart_run_t *h = arg;
+    h->r = cpu_run(h->cpu, h->max);
+    return NULL;
+}
+
+int cpu_run_harts(cpu_t **cpus, int n, uint64_t max_instructions, cpu_result_t *results) {
+    if (n < 1)
+        return -1;
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+    hart_run_t *h = malloc(n * sizeof(hart_run_t));
+    int started = 1;
+    int ret = 0;
+    if (!threads || !h) {
+        free(threads);
+        free(h);
+        return -1;
+    }
+    for (int i = 0; i < n; i++)
+        h[i] = (hart_run_t){.cpu = cpus[i], .max = max_instructions};
+    // the first hart runs on the calling thread
+    for (; started < n; started++)
+        if (pthread_create(&threads[started], NULL, hart_thread, &h[started]))
+            break;
+    if (started < n) {
+        for (int i = 1; i < started; i++)
+            cpu_stop(cpus[i]);
+        ret = -1;
+    } else {
+        hart_thread(&h[0]);
+    }
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < n && !ret; i++)
+        results[i] = h[i].r;
+    free(threads);
+    free(h);
+    return ret;
+}
+
+int cpu_run_harts_quantum(cpu_t **cpus, int n, uint64_t max_instructions, uint64_t quantum, cpu_result_t *results) {
+    uint8_t *done = n > 0 && quantum ? calloc(n, 1) : NULL;
+    int running = n;
+    if (!done)
+        return -1;
+    for (int i = 0; i < n; i++)
+        results[i] = (cpu_result_t){.stop = CPU_STOP_LIMIT};
+    // rounds in the order of cpus, a hart stopped by another one's callback sees it on its next turn
+    while (running) {
+        for (int i = 0; i < n; i++) {
+            if (done[i])
+                continue;
+            uint64_t left = max_instructions - results[i].instret;
+            cpu_result_t r = cpu_run(cpus[i], left < quantum ? left : quantum);
+            results[i].instret += r.instret;
+            if (r.stop == CPU_STOP_LIMIT && results[i].instret < max_instructions)
+                continue;
+            results[i].stop = r.stop;
+            results[i].ret = r.ret;
+            done[i] = 1;
+            running--;
+        }
+    }
+    free(done);
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// snapshots for resetting a cpu quickly. cpu_snapshot copies registers, pc and the dram
+// pages the guest touched once, and write protects dram. the first store to a page after
+// that faults once and marks it dirty, see librv64i_guard.c, so cpu_restore copies back
+// only those pages and protects them again. a run that stores to a handful of pages is
+// undone in microseconds, whatever the size of dram. where stores can not be tracked every
+// page is copied back.
+
+int cpu_snapshot(cpu_t *cpu) {
+    dram_t *dram = &cpu->bus.dram;
+    uint64_t page = dram_page_size();
+    uint64_t pages = (dram->size + page - 1) / page;
+
+    snapshot_free(cpu);
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    if (!snap)
+        return -1;
+    snap->pages = pages;
+    snap->dirty = calloc((pages + 63) / 64, sizeof(uint64_t));
+    snap->mem = mmap(NULL, dram->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (!snap->dirty || snap->mem == MAP_FAILED) {
+        if (snap->mem != MAP_FAILED)
+            munmap(snap->mem, dram->size);
+        free(snap->dirty);
+        free(snap);
+        return -1;
+    }
+
+    // pages the guest never touched are zero in the copy as well
+    unsigned char vec[256];
+    for (uint64_t first = 0; first < pages; first += sizeof(vec)) {
+        uint64_t n = pages - first < sizeof(vec) ? pages - first : sizeof(vec);
+        int known = !dram_resident(dram, first, n, vec);
+        for (uint64_t k = 0; k < n; k++) {
+            uint64_t off = (first + k) * page;
+            if (!known || vec[k] & 1)
+                memcpy(snap->mem + off, dram->mem + off, dram->size - off < page ? dram->size - off : page);
+        }
+    }
+    memcpy(snap->regs, cpu->regs, sizeof(snap->regs));
+    snap->pc = cpu->pc;
+
+    snap->tracked = 1;
+    cpu->snap = snap;
+    if (cpu->owner || guard_track(cpu))
+        snap->tracked = 0;
+    else
+        code_track(cpu);
+    return 0;
+}
+
+int cpu_restore(cpu_t *cpu) {
+    snapshot_t *snap = cpu->snap;
+    dram_t *dram = &cpu->bus.dram;
+    uint64_t page = dram_page_size();
+    if (!snap)
+        return -1;
+
+    if (!snap->tracked) {
+        memcpy(dram->mem, snap->mem, dram->size);
+        cpu->stats.pages_restored += snap->pages;
+    } else {
+        uint64_t lo = snap->pages;
+        uint64_t hi = 0;
+        for (uint64_t w = 0; w < (snap->pages + 63) / 64; w++) {
+            for (uint64_t bits = snap->dirty[w]; bits; bits &= bits - 1) {
+                uint64_t i = w * 64 + __builtin_ctzll(bits);
+                uint64_t off = i * page;
+                memcpy(dram->mem + off, snap->mem + off, dram->size - off < page ? dram->size - off : page);
+                lo = i < lo ? i : lo;
+                hi = i + 1;
+                cpu->stats.pages_restored++;
+            }
+            snap->dirty[w] = 0;
+        }
+        // one call for the whole range, the clean pages in between are read only already
+        if (lo < hi)
+            guard_protect(cpu, lo * page, (hi - lo) * page);
+    }
+    // code the run wrote is back to what the snapshot had, so are the pages it was decoded from.
+    // untracked, every page counts as written and all decoded code goes
+    code_sync(cpu);
+    memcpy(cpu->regs, snap->regs, sizeof(cpu->regs));
+    cpu->pc = snap->pc;
+    cpu->stop = 0;
+    cpu->stop_reason = CPU_STOP_LIMIT;
+    return 0;
+}
+
+void snapshot_free(cpu_t *cpu) {
+    snapshot_t *snap = cpu->snap;
+    if (!snap)
+        return;
+    if (snap->tracked) {
+        guard_untrack(cpu);
+        code_protect(cpu);
+    }
+    cpu->snap = NULL;
+    munmap(snap->mem, cpu->bus.dram.size);
+    free(snap->dirty);
+    free(snap);
+}
+
+// snapshot files: the header padded to SNAP_PAGE, the numbers of the stored pages as uint64_t
+// padded to SNAP_PAGE, then those pages in the same order. pages that are all zero are left
+// out. the stored pages are page aligned in the file, so cpu_snapshot_load maps them copy on
+// write and processes resuming the same file share them in the page cache. host byte order
+
+#define SNAP_MAGIC "RV64SNAP"
+#define SNAP_VERSION 1
+#define SNAP_PAGE 4096
+
+typedef struct snap_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t page; // SNAP_PAGE
+    uint64_t dram_base;
+    uint64_t dram_size;
+    uint64_t pc;
+    uint64_t regs[32];
+    uint64_t pages; // stored
+} snap_header_t;
+
+static uint64_t snap_round(uint64_t n) { return (n + SNAP_PAGE - 1) / SNAP_PAGE * SNAP_PAGE; }
+
+static const uint8_t snap_zero[SNAP_PAGE];
+
+static int snap_pad(FILE *f, uint64_t n) { return n && fwrite(snap_zero, n, 1, f) != 1; }
+
+int snapshot_write(cpu_t *cpu, FILE *f) {
+    dram_t *dram = &cpu->bus.dram;
+    uint64_t pages = (dram->size + SNAP_PAGE - 1) / SNAP_PAGE;
+    uint64_t *index = malloc(pages * sizeof(uint64_t));
+    snap_header_t h = {.magic = SNAP_MAGIC, .version = SNAP_VERSION, .page = SNAP_PAGE, .dram_base = dram->base, .dram_size = dram->size, .pc = cpu->pc};
+    int ret = -1;
+    if (!index)
+        return -1;
+
+    // host pages the guest never touched read as zero, they are not even read here
+    uint64_t host = dram_page_size();
+    uint64_t hosts = (dram->size + host - 1) / host;
+    unsigned char vec[256];
+    for (uint64_t first = 0; first < hosts; first += sizeof(vec)) {
+        uint64_t n = hosts - first < sizeof(vec) ? hosts - first : sizeof(vec);
+        int known = !dram_resident(dram, first, n, vec);
+        for (uint64_t k = 0; k < n; k++) {
+            if (known && !(vec[k] & 1))
+                continue;
+            for (uint64_t off = (first + k) * host; off < (first + k + 1) * host && off < dram->size; off += SNAP_PAGE)
+                if (memcmp(dram->mem + off, snap_zero, dram->size - off < SNAP_PAGE ? dram->size - off : SNAP_PAGE))
+                    index[h.pages++] = off / SNAP_PAGE;
+        }
+    }
+    memcpy(h.regs, cpu->regs, sizeof(h.regs));
+    if (fwrite(&h, sizeof(h), 1, f) != 1 || snap_pad(f, SNAP_PAGE - sizeof(h)) ||
+        (h.pages && fwrite(index, h.pages * sizeof(uint64_t), 1, f) != 1) || snap_pad(f, snap_round(h.pages * 8) - h.pages * 8))
+        goto out;
+    for (uint64_t k = 0; k < h.pages; k++) {
+        uint64_t off = index[k] * SNAP_PAGE;
+        uint64_t len = dram->size - off < SNAP_PAGE ? dram->size - off : SNAP_PAGE;
+        if (fwrite(dram->mem + off, len, 1, f) != 1 || snap_pad(f, SNAP_PAGE - len))
+            goto out;
+    }
+    ret = 0;
+out:
+    free(index);
+    return ret;
+}
+
+int cpu_snapshot_write(cpu_t *cpu, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+    int ret = snapshot_write(cpu, f);
+    return fclose(f) ? -1 : ret;
+}
+
+static int snap_header(int fd, snap_header_t *h) {
+    return pread(fd, h, sizeof(*h), 0) != sizeof(*h) || memcmp(h->magic, SNAP_MAGIC, 8) || h->version != SNAP_VERSION || h->page != SNAP_PAGE ? -1 : 0;
+}
+
+int cpu_snapshot_config(const char *path, cpu_config_t *config) {
+    snap_header_t h;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ret = snap_header(fd, &h);
+    close(fd);
+    if (!ret) {
+        config->dram_base = h.dram_base;
+        config->dram_size = h.dram_size;
+    }
+    return ret;
+}
+
+int snapshot_load(cpu_t *cpu, int fd) {
+    dram_t *dram = &cpu->bus.dram;
+    uint64_t pages = (dram->size + SNAP_PAGE - 1) / SNAP_PAGE;
+    uint64_t *index = NULL;
+    snap_header_t h;
+    int ret = -1;
+    if (snap_header(fd, &h) || h.dram_base != dram->base || h.dram_size != dram->size || h.pages > pages ||
+        !(index = malloc(h.pages * sizeof(uint64_t) + 1)) || pread(fd, index, h.pages * sizeof(uint64_t), SNAP_PAGE) != (ssize_t)(h.pages * sizeof(uint64_t)))
+        goto out;
+    for (uint64_t k = 0; k < h.pages; k++)
+        if (index[k] >= pages || (k && index[k] <= index[k - 1]))
+            goto out;
+
+    // the mappings replace dram, a tracked snapshot would lose its write protection
+    snapshot_free(cpu);
+    dram_zero(dram, 0, dram->size);
+    uint64_t data = SNAP_PAGE + snap_round(h.pages * 8);
+    for (uint64_t k = 0, n; k < h.pages; k += n) {
+        // a run of consecutive pages is one mapping
+        for (n = 1; k + n < h.pages && index[k + n] == index[k] + n; n++)
+            ;
+        uint64_t off = index[k] * SNAP_PAGE;
+        uint64_t len = dram->size - off < n * SNAP_PAGE ? dram->size - off : n * SNAP_PAGE;
+        if (dram_load_file(dram, off, fd, data + k * SNAP_PAGE, len))
+            goto out;
+    }
+    memcpy(cpu->regs, h.regs, sizeof(cpu->regs));
+    cpu->regs[0] = 0;
+    cpu->pc = h.pc;
+    ret = 0;
+out:
+    free(index);
+    return ret;
+}
+
+int cpu_snapshot_load(cpu_t *cpu, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ret = snapshot_load(cpu, fd);
+    close(fd);
+    cpu_icache_flush(cpu);
+    return ret;
+}
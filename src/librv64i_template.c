@@ -0,0 +1,76 @@
+#define _GNU_SOURCE // memfd_create
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// templates for starting many cpus from one loaded image. the dram of the template's cpu is
+// kept in the snapshot file format in an anonymous file and its decoded instructions in
+// another, every cpu started from it maps both copy on write. the host holds one copy of the
+// pages no cpu wrote since, an icache miss copies one page of decoded instructions. the aot
+// translation is the same shared object opened once more.
+
+// an unnamed file in memory, a temporary file where memfd_create is missing
+static int template_file(const char *name) {
+#if defined(__linux__)
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+#endif
+    FILE *f = tmpfile();
+    if (!f)
+        return -1;
+    int fd2 = dup(fileno(f));
+    fclose(f);
+    return fd2;
+}
+
+cpu_template_t *cpu_template_new(cpu_t *cpu) {
+    cpu_template_t *t = calloc(1, sizeof(cpu_template_t));
+    if (!t)
+        return NULL;
+    t->refs = 1;
+    t->config = (cpu_config_t){.engine = cpu->engine, .dram_base = cpu->bus.dram.base, .dram_size = cpu->bus.dram.size, .guard = cpu->bus.guard, .handlers = cpu->handlers};
+    t->fd = template_file("rv64i-dram");
+    t->icache_fd = template_file("rv64i-icache");
+    t->code = malloc((cpu->code->pages + 63) / 64 * sizeof(uint64_t));
+    FILE *f = t->fd >= 0 ? fdopen(dup(t->fd), "wb") : NULL;
+    int ret = f && t->icache_fd >= 0 ? snapshot_write(cpu, f) : -1;
+    if ((f && fclose(f)) || ret || !t->code || write(t->icache_fd, cpu->icache, ICACHE_SIZE * sizeof(icache_entry_t)) != (ssize_t)(ICACHE_SIZE * sizeof(icache_entry_t)) ||
+        (cpu->aot && !(t->aot = aot_dup(cpu->aot)))) {
+        template_put(t);
+        return NULL;
+    }
+    memcpy(t->code, cpu->code->code, (cpu->code->pages + 63) / 64 * sizeof(uint64_t));
+    return t;
+}
+
+void template_put(cpu_template_t *t) {
+    if (!t || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (t->fd >= 0)
+        close(t->fd);
+    if (t->icache_fd >= 0)
+        close(t->icache_fd);
+    aot_close(t->aot);
+    free(t->code);
+    free(t);
+}
+
+void cpu_template_free(cpu_template_t *t) { template_put(t); }
+
+int cpu_init_template(cpu_t *cpu, cpu_template_t *t) {
+    if (cpu_init_shared(cpu, &t->config, t->icache_fd, NULL) || snapshot_load(cpu, t->fd) || (t->aot && !(cpu->aot = aot_dup(t->aot)))) {
+        cpu_free(cpu);
+        return -1;
+    }
+    // the shared icache entries were decoded from these pages
+    for (uint64_t w = 0; w < (cpu->code->pages + 63) / 64; w++)
+        for (uint64_t bits = t->code[w]; bits; bits &= bits - 1)
+            code_page_add(cpu, w * 64 + __builtin_ctzll(bits));
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_ACQ_REL);
+    cpu->tmpl = t;
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <string.h>
+
+#include "librv64i_internal.h"
+
+// threaded interpreter. instructions come out of the same decoded instruction cache
+// as cpu_step, but instead of calling a handler per instruction each handler ends
+// with its own computed goto to the next one. registers and pc are kept in locals
+// and only written back to cpu_t around the callbacks and on exit.
+
+#define RD x[in->rd]
+#define RS1 x[in->rs1]
+#define RS2 x[in->rs2]
+#define IMM in->imm
+
+#define LOAD(size) bus_load(&(cpu->bus), RS1 + (int64_t)IMM, size)
+#define STORE(size) bus_store(&(cpu->bus), RS1 + (int64_t)IMM, size, RS2)
+
+// cpu_stop from another thread is seen at taken branches and jumps, any loop has one
+#define STOP_CHECK()                                                                                                                                           \
+    do {                                                                                                                                                       \
+        if (cpu->stop)                                                                                                                                         \
+            budget = n;                                                                                                                                        \
+    } while (0)
+
+#define BRANCH(cond)                                                                                                                                           \
+    do {                                                                                                                                                       \
+        if (cond) {                                                                                                                                            \
+            pc = pc + (int64_t)IMM - 4;                                                                                                                        \
+            STOP_CHECK();                                                                                                                                      \
+        }                                                                                                                                                      \
+    } while (0)
+
+// fetch the next decoded instruction and jump to its handler
+#define DISPATCH()                                                                                                                                             \
+    do {                                                                                                                                                       \
+        if (n == budget)                                                                                                                                       \
+            goto limit;                                                                                                                                        \
+        n++;                                                                                                                                                   \
+        e = &cpu->icache[(pc >> 2) & (ICACHE_SIZE - 1)];                                                                                                       \
+        if (e->pc != pc)                                                                                                                                       \
+            goto miss;                                                                                                                                         \
+        in = &e->in;                                                                                                                                           \
+        pc += 4;                                                                                                                                               \
+        goto *labels[in->op];                                                                                                                                  \
+    } while (0)
+
+#define NEXT(stmt)                                                                                                                                             \
+    do {                                                                                                                                                       \
+        stmt;                                                                                                                                                  \
+        DISPATCH();                                                                                                                                            \
+    } while (0)
+
+// hand the register file (and the counters) to a callback, and take back whatever it changed.
+// n counts the instructions since, budget is how many cpu->limit still allows
+#define SPILL()                                                                                                                                                \
+    do {                                                                                                                                                       \
+        memcpy(cpu->regs, x, sizeof(x));                                                                                                                       \
+        cpu->pc = pc;                                                                                                                                          \
+        cpu->stats.instret += n;                                                                                                                               \
+        cpu->stats.icache_hits += n - misses;                                                                                                                  \
+        cpu->stats.icache_misses += misses;                                                                                                                    \
+        n = misses = 0;                                                                                                                                        \
+    } while (0)
+#define RELOAD()                                                                                                                                               \
+    do {                                                                                                                                                       \
+        memcpy(x, cpu->regs, sizeof(x));                                                                                                                       \
+        pc = cpu->pc;                                                                                                                                          \
+        budget = run_limit(cpu);                                                                                                                               \
+        budget = budget > cpu->stats.instret ? budget - cpu->stats.instret : 0;                                                                                \
+    } while (0)
+
+int cpu_run_threaded(cpu_t *cpu) {
+    static const void *const labels[OP_COUNT] = {
+#define OP_LABEL(name) &&op_##name,
+        RV_OPS(OP_LABEL)
+#undef OP_LABEL
+    };
+    uint64_t x[32];
+    uint64_t pc;
+    uint64_t n = 0;
+    uint64_t misses = 0;
+    uint64_t budget;
+    icache_entry_t *e;
+    const insn_t *in;
+    uint64_t tmp;
+    int ret;
+
+    RELOAD();
+    DISPATCH();
+
+miss:
+    misses++;
+    code_mark(cpu, pc);
+    e->pc = pc;
+    rv_decode(bus_fetch(&(cpu->bus), pc), &e->in);
+    in = &e->in;
+    pc += 4;
+    goto *labels[in->op];
+
+op_LUI:
+    NEXT(RD = IMM);
+op_AUIPC:
+    NEXT(RD = ((int64_t)pc + (int64_t)IMM) - 4);
+op_JAL:
+    NEXT(RD = pc; x[0] = 0; pc = pc + (int64_t)IMM - 4; STOP_CHECK());
+op_JALR:
+    NEXT(tmp = pc; pc = (RS1 + (int64_t)IMM) & 0xfffffffe; RD = tmp; x[0] = 0; STOP_CHECK());
+op_BEQ:
+    NEXT(BRANCH((int64_t)RS1 == (int64_t)RS2));
+op_BNE:
+    NEXT(BRANCH(RS1 != RS2));
+op_BLT:
+    NEXT(BRANCH((int64_t)RS1 < (int64_t)RS2));
+op_BGE:
+    NEXT(BRANCH((int64_t)RS1 >= (int64_t)RS2));
+op_BLTU:
+    NEXT(BRANCH(RS1 < RS2));
+op_BGEU:
+    NEXT(BRANCH(RS1 >= RS2));
+op_LB:
+    NEXT(RD = (int64_t)(int8_t)LOAD(8); x[0] = 0);
+op_LH:
+    NEXT(RD = (int64_t)(int16_t)LOAD(16); x[0] = 0);
+op_LW:
+    NEXT(RD = (int64_t)(int32_t)LOAD(32); x[0] = 0);
+op_LD:
+    NEXT(RD = (int64_t)LOAD(64); x[0] = 0);
+op_LBU:
+    NEXT(RD = LOAD(8); x[0] = 0);
+op_LHU:
+    NEXT(RD = LOAD(16); x[0] = 0);
+op_LWU:
+    NEXT(RD = LOAD(32); x[0] = 0);
+op_SB:
+    NEXT(STORE(8));
+op_SH:
+    NEXT(STORE(16));
+op_SW:
+    NEXT(STORE(32));
+op_SD:
+    NEXT(STORE(64));
+op_ADDI:
+    NEXT(RD = RS1 + (int64_t)IMM);
+op_SLLI:
+op_SLLI_64:
+    NEXT(RD = RS1 << (uint32_t)(IMM & 0x3f));
+op_SLTI:
+    NEXT(RD = (RS1 < (int64_t)IMM) ? 1 : 0);
+op_SLTIU:
+    if (IMM == 1)
+        NEXT(RD = RS1 == 0 ? 1 : 0);
+    NEXT(RD = (RS1 < IMM) ? 1 : 0);
+op_XORI:
+    NEXT(RD = RS1 ^ IMM);
+op_SRLI:
+op_SRLI_64:
+op_SRAI_64:
+    NEXT(RD = RS1 >> IMM);
+op_SRAI:
+    NEXT(RD = (int64_t)RS1 >> IMM);
+op_ORI:
+    NEXT(RD = RS1 | IMM);
+op_ANDI:
+    NEXT(RD = RS1 & IMM);
+op_ADD:
+    NEXT(RD = ((int64_t)RS1 + (int64_t)RS2));
+op_SUB:
+    NEXT(RD = ((int64_t)RS1 - (int64_t)RS2));
+op_SLL:
+    NEXT(RD = RS1 << (int64_t)RS2);
+op_SLT:
+    NEXT(RD = ((int64_t)RS1 < (int64_t)RS2) ? 1 : 0);
+op_SLTU:
+    if (in->rs1 == 0)
+        NEXT(RD = RS2 != 0 ? 1 : 0);
+    NEXT(RD = (RS1 < RS2) ? 1 : 0);
+op_XOR:
+    NEXT(RD = RS1 ^ RS2);
+op_SRL:
+    NEXT(RD = RS1 >> RS2);
+op_OR:
+    NEXT(RD = RS1 | RS2);
+op_AND:
+    NEXT(RD = RS1 & RS2);
+op_FENCE:
+    NEXT(fence_exec(in->inst));
+op_NOP:
+    DISPATCH();
+op_FENCE_I:
+    // the icache entries of written pages go, in is not looked at again
+    SPILL();
+    code_sync(cpu);
+    RELOAD();
+    DISPATCH();
+op_ECALL_EBREAK:
+    if (IMM == 0x0 || IMM == 0x1) {
+        SPILL();
+        cpu->stop_reason = IMM == 0x0 ? CPU_STOP_ECALL : CPU_STOP_EBREAK;
+        ret = IMM == 0x0 ? handle_ecall(cpu, in->inst) : handle_ebreak(cpu, in->inst);
+        if (ret)
+            goto out;
+        RELOAD();
+        DISPATCH();
+    }
+    SPILL();
+    cpu->stop_reason = CPU_STOP_INVOP;
+    ret = -1;
+    goto out;
+op_ADDIW:
+    NEXT(RD = ((int32_t)RS1) + (int32_t)IMM);
+op_SLLIW:
+    NEXT(RD = (int64_t)(((uint32_t)RS1) << ((uint32_t)(IMM & 0x3f) % 32)));
+op_SRLIW:
+    NEXT(RD = (uint64_t)(((uint32_t)RS1) >> ((uint32_t)(IMM & 0x3f) % 32)));
+op_SRAIW:
+    NEXT(RD = (int64_t)(((int32_t)RS1) >> (IMM % 32)));
+op_ADDW:
+    NEXT(RD = (int64_t)(((int32_t)RS1) + (int32_t)RS2));
+op_SUBW:
+    NEXT(RD = (int64_t)(((int32_t)RS1) - (int32_t)RS2));
+op_SLLW:
+    NEXT(RD = (int64_t)((int32_t)(RS1 << (RS2 % 32))));
+op_SRLW:
+    NEXT(RD = (int64_t)((int32_t)(((uint32_t)RS1) >> (RS2 % 32))));
+op_SRAW:
+    NEXT(RD = (int64_t)((int32_t)(((int32_t)RS1) >> (RS2 % 32))));
+op_SRA:
+    NEXT(RD = (int64_t)(((int64_t)RS1) >> (RS2 % 32)));
+//
+// rv64 M extension
+//
+op_DIV:
+    NEXT(RD = (int64_t)RS2 == -1 ? -RS1 : RS2 != 0 ? (uint64_t)((int64_t)RS1 / (int64_t)RS2) : (uint64_t)-1); // see exec_DIV
+op_DIVU:
+    NEXT(RD = RS2 != 0 ? RS1 / RS2 : (uint64_t)-1);
+op_DIVW:
+    NEXT(RD = (int32_t)RS2 == -1 ? (uint64_t)(int64_t)(int32_t)-(uint32_t)RS1 : (int32_t)RS2 != 0 ? (uint64_t)(int64_t)((int32_t)RS1 / (int32_t)RS2) : (uint64_t)-1);
+op_DIVUW:
+    NEXT(RD = (uint32_t)RS2 != 0 ? (uint64_t)((uint32_t)RS1 / (uint32_t)RS2) : (uint64_t)-1);
+op_MUL:
+    NEXT(RD = (int64_t)RS1 * (int64_t)RS2);
+op_MULW:
+    NEXT(RD = (int64_t)((int32_t)RS1 * (int32_t)RS2));
+op_MULH:
+    NEXT(RD = (((int128_t)(int64_t)RS1) * ((int128_t)(int64_t)RS2)) >> 64);
+op_MULHU:
+    NEXT(RD = ((uint128_t)RS1 * (uint128_t)RS2) >> 64);
+op_MULHSU:
+    NEXT(RD = ((int128_t)(((int128_t)(int64_t)RS1) * (uint128_t)RS2)) >> 64);
+op_REM:
+    NEXT(RD = (int64_t)RS2 == -1 ? 0 : RS2 != 0 ? (uint64_t)((int64_t)RS1 % (int64_t)RS2) : (uint64_t)-1);
+op_REMU:
+    NEXT(RD = RS2 != 0 ? RS1 % RS2 : (uint64_t)-1);
+op_REMW:
+    NEXT(RD = (int32_t)RS2 == -1 ? 0 : (int32_t)RS2 != 0 ? (uint64_t)(int64_t)((int32_t)RS1 % (int32_t)RS2) : (uint64_t)-1);
+op_REMUW:
+    NEXT(RD = (uint32_t)RS2 != 0 ? (uint64_t)((uint32_t)RS1 % (uint32_t)RS2) : (uint64_t)-1);
+op_CSR:
+    if (csr_exec(cpu, in, &tmp))
+        goto op_invalid;
+    NEXT(RD = tmp; x[0] = 0);
+//
+// rv64 A extension
+//
+op_AMO:
+    if (amo_exec(cpu, in, RS1, RS2, &tmp))
+        goto op_invalid;
+    NEXT(RD = tmp; x[0] = 0);
+op_invalid:
+    SPILL();
+    cpu->stop_reason = CPU_STOP_INVOP;
+    handle_invop(cpu, in->inst);
+    ret = 1;
+    goto out;
+
+limit:
+    SPILL();
+    ret = 0;
+
+out:
+    return ret;
+}
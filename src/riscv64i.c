@@ -1,55 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "dbg.h"
 #include "librv64i.h"
 
-int read_file(cpu_t *cpu, char *filename) {
-    FILE *file;
-    uint8_t *buffer;
-    unsigned long fileLen;
-
-    // Open file
-    file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "Unable to open file %s", filename);
-        return -1;
-    }
-    // Get file length
-    fseek(file, 0, SEEK_END);
-    fileLen = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Allocate memory
-    buffer = (uint8_t *)malloc(fileLen + 1);
-    if (!buffer) {
-        fprintf(stderr, "Memory error!");
-        fclose(file);
-        return -1;
-    }
-    // Read file contents into buffer
-    fread(buffer, fileLen, 1, file);
-    fclose(file);
-
-    // copy the bin executable to dram
-    memcpy(cpu->bus.dram.mem, buffer, fileLen * sizeof(uint8_t));
-    free(buffer);
-    return 0;
-}
-
 void print_BUS_safe(struct cpu_t *cpu, uint64_t addr) {
     // addr &= 0xffffffff;
     fprintf(stderr, "::");
     while (1) {
-        if (addr < DRAM_BASE) {
+        if (addr < cpu->bus.dram.base) {
             break;
         }
-        if (addr >= DRAM_BASE + DRAM_SIZE) {
+        if (addr - cpu->bus.dram.base >= cpu->bus.dram.size) {
             break;
         }
 
-        int c = cpu->bus.dram.mem[(addr - DRAM_BASE)];
+        int c = cpu->bus.dram.mem[(addr - cpu->bus.dram.base)];
         putc(c, stderr);
         addr++;
         if (c == '\0')
@@ -58,49 +26,230 @@ void print_BUS_safe(struct cpu_t *cpu, uint64_t addr) {
     putc('\n', stderr);
 }
 
-int ECALL_cb(cpu_t *cpu, uint32_t inst) {
+static const char *snapshot_path; // -w
+static cpu_t **harts;             // -p
+static int nharts = 1;
+static uint64_t quantum;          // -q
+
+// the guest exits, the harts still running stop as well
+static void stop_harts(cpu_t *cpu) {
+    for (int i = 0; harts && i < nharts; i++)
+        if (harts[i] != cpu)
+            cpu_stop(harts[i]);
+}
+
+static int ecall(void *ctx, cpu_t *cpu, uint32_t inst) {
     switch (cpu->regs[10]) {
     case 0: print_BUS_safe(cpu, cpu->regs[11]); return 0;
-    case 1: exit(0); return 0;
+    case 1: stop_harts(cpu); return 1; // guest exit, cpu_run returns CPU_STOP_ECALL
     case 2: fputc(cpu->regs[11], stderr); return 0;
+    case 3: // the guest is warmed up, the first one is written with -w and the guest continues
+        if (snapshot_path && cpu_snapshot_write(cpu, snapshot_path))
+            DBG("SNAPSHOT WRITE FAILED");
+        snapshot_path = NULL;
+        return 0;
     default:
         return -1;
     }
 }
 
-int EBREAK_cb(cpu_t *cpu, uint32_t inst) {
-    exit(0);
-    return 0;
+// main returned on hart 0, the other harts are done when their hart_main returns
+static int ebreak(void *ctx, cpu_t *cpu, uint32_t inst) {
+    if (cpu->hartid == 0)
+        stop_harts(cpu);
+    return 1;
+}
+
+// symbol+offset of addr for an elf image, an empty string otherwise
+static const char *symbolize(cpu_t *cpu, uint64_t addr) {
+    static char buf[128];
+    const cpu_symbol_t *sym = cpu_symbol_find(cpu, addr);
+    buf[0] = 0;
+    if (sym)
+        snprintf(buf, sizeof(buf), " <%s+0x%lx>", sym->name, addr - sym->addr);
+    return buf;
 }
 
-int INVOP_cb(cpu_t *cpu, uint32_t inst) {
+static int invop(void *ctx, cpu_t *cpu, uint32_t inst) {
     int opcode = inst & 0x7f;         // opcode in bits 6..0
     int funct3 = (inst >> 12) & 0x7;  // funct3 in bits 14..12
     int funct7 = (inst >> 25) & 0x7f; // funct7 in bits 31..25
-    DBG("%016lx [-] ERROR-> 0x%08x opcode:0x%x, funct3:0x%x, funct7:0x%x\n", cpu->pc - 4, inst, opcode, funct3, funct7);
+    DBG("%016lx%s [-] ERROR-> 0x%08x opcode:0x%x, funct3:0x%x, funct7:0x%x\n", cpu->pc - 4, symbolize(cpu, cpu->pc - 4), inst, opcode, funct3,
+        funct7);
     return -1;
 }
 
-int main(int argc, char **argv) {
-    cpu_t cpu;
-    cpu_init(&cpu);
-
-    // Read input file
-    if (read_file(&cpu, argv[1])) {
-        DBG("LOAD FILE FAILED");
+// elf executables are loaded by segment, anything else is a raw image for the start of dram
+static int load(cpu_t *cpu, const char *path) {
+    char magic[4] = {0};
+    FILE *f = fopen(path, "rb");
+    if (!f)
         return -1;
+    fread(magic, 1, sizeof(magic), f);
+    fclose(f);
+    if (!memcmp(magic, "\x7f" "ELF", 4))
+        return cpu_load_elf(cpu, path);
+    return cpu_load_image(cpu, path, cpu->bus.dram.base);
+}
+
+static cpu_t *stats_cpu;
+static uint64_t stats_resident; // dram is gone by the time print_stats runs
+
+static void print_stats(void) {
+    cpu_stats_t stats;
+    cpu_stats_get(stats_cpu, &stats);
+    uint64_t lookups = stats.icache_hits + stats.icache_misses;
+    fprintf(stderr, "instret: %lu\n", stats.instret);
+    fprintf(stderr, "icache: %lu hits %lu misses (%.2f%% hit rate)\n", stats.icache_hits, stats.icache_misses,
+            lookups ? 100.0 * stats.icache_hits / lookups : 0.0);
+    fprintf(stderr, "blocks: %lu translated %lu lookups %lu chained\n", stats.blocks_translated, stats.block_lookups, stats.block_chained);
+    fprintf(stderr, "traces: %lu compiled\n", stats.traces_compiled);
+    fprintf(stderr, "fused: %lu lui+addi %lu auipc+jalr %lu auipc+addr %lu slli+srli %lu cmp+branch\n", stats.fused[CPU_FUSE_LUI_ADDI],
+            stats.fused[CPU_FUSE_AUIPC_JALR], stats.fused[CPU_FUSE_AUIPC_ADDR], stats.fused[CPU_FUSE_SLLI_SRLI], stats.fused[CPU_FUSE_CMP_BRANCH]);
+    fprintf(stderr, "jalr: %lu inline %lu ras %lu table %lu lookups\n", stats.jalr_inline, stats.jalr_ras, stats.jalr_table, stats.jalr_lookups);
+    fprintf(stderr, "guard: %lu faults\n", stats.guard_faults);
+    fprintf(stderr, "snapshot: %lu pages restored\n", stats.pages_restored);
+    fprintf(stderr, "code: %lu pages invalidated\n", stats.code_invalidated);
+    fprintf(stderr, "dram: %lu KiB resident of %lu KiB\n", stats_resident / 1024, stats_cpu->bus.dram.size / 1024);
+}
+
+// bytes, with an optional k, m or g suffix
+static uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 0);
+    switch (*end | 0x20) {
+    case 'k': return size << 10;
+    case 'm': return size << 20;
+    case 'g': return size << 30;
+    default: return size;
     }
+}
 
-    // cpu loop
-    do {
-        uint32_t inst = cpu_fetch(&cpu);
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s] [-a] [-g] [-e step|threaded|block|jit] [-n count] [-m size] [-p harts [-q quantum]] [-w snapshot] image.elf|image.bin\n", prog);
+    fprintf(stderr, "       %s [-s] [-a] [-g] [-e step|threaded|block|jit] [-n count] [-p harts [-q quantum]] -r snapshot\n", prog);
+    fprintf(stderr, "  -s  print the cpu counters when the guest exits\n");
+    fprintf(stderr, "  -a  translate the image ahead of time, cached as image.bin.aot.so (block engine unless jit)\n");
+    fprintf(stderr, "  -g  back dram with guard pages instead of range checking every access\n");
+    fprintf(stderr, "  -e  execution engine, default step\n");
+    fprintf(stderr, "  -n  stop the guest after count instructions (of each hart)\n");
+    fprintf(stderr, "  -m  dram size in bytes, k/m/g suffixes, default 1m\n");
+    fprintf(stderr, "  -p  run that many harts on a host thread each, all start at the entry with their mhartid\n");
+    fprintf(stderr, "  -q  run the harts in turns of quantum instructions on one thread, the same run every time\n");
+    fprintf(stderr, "  -w  write a snapshot file when the guest makes its first snapshot ecall (a0 = 3)\n");
+    fprintf(stderr, "  -r  resume from a snapshot file instead of loading an image\n");
+}
 
-        if (cpu_execute(&cpu, inst)) {
-            DBG("execute error");
+int main(int argc, char **argv) {
+    static cpu_t cpu;
+    cpu_config_t config = {.engine = CPU_ENGINE_STEP, .handlers = {.ecall = ecall, .ebreak = ebreak, .invop = invop}};
+    uint64_t max_instructions = UINT64_MAX;
+    const char *resume = NULL;
+    int aot = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "sage:n:m:p:q:w:r:")) != -1) {
+        switch (opt) {
+        case 's': stats_cpu = &cpu; break;
+        case 'a': aot = 1; break;
+        case 'g': config.guard = 1; break;
+        case 'n': max_instructions = strtoull(optarg, NULL, 0); break;
+        case 'm': config.dram_size = parse_size(optarg); break;
+        case 'p': nharts = atoi(optarg); break;
+        case 'q': quantum = strtoull(optarg, NULL, 0); break;
+        case 'w': snapshot_path = optarg; break;
+        case 'r': resume = optarg; break;
+        case 'e':
+            if (!strcmp(optarg, "step")) {
+                config.engine = CPU_ENGINE_STEP;
+            } else if (!strcmp(optarg, "threaded")) {
+                config.engine = CPU_ENGINE_THREADED;
+            } else if (!strcmp(optarg, "block")) {
+                config.engine = CPU_ENGINE_BLOCK;
+            } else if (!strcmp(optarg, "jit")) {
+                config.engine = CPU_ENGINE_JIT;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
             break;
+        default: usage(argv[0]); return -1;
         }
+    }
+    if ((optind >= argc && !resume) || nharts < 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    // the snapshot has the dram layout it was written with
+    if (resume && cpu_snapshot_config(resume, &config)) {
+        DBG("NOT A SNAPSHOT FILE");
+        return -1;
+    }
+    const char *image = resume ? resume : argv[optind];
+
+    if (aot && config.engine != CPU_ENGINE_JIT)
+        config.engine = CPU_ENGINE_BLOCK;
+    if (cpu_init_config(&cpu, &config)) {
+        DBG("DRAM ALLOCATION FAILED");
+        return -1;
+    }
+    if (stats_cpu)
+        atexit(print_stats);
 
-    } while (1);
+    if (resume ? cpu_snapshot_load(&cpu, resume) : load(&cpu, image)) {
+        DBG("LOAD FILE FAILED, missing or larger than dram");
+        return -1;
+    }
+    if (aot && cpu_aot_load(&cpu, image))
+        DBG("AOT translation failed, interpreting");
+
+    // the other harts start where the loader left hart 0
+    cpu_result_t r;
+    if (nharts > 1) {
+        cpu_result_t *results = calloc(nharts, sizeof(cpu_result_t));
+        harts = calloc(nharts, sizeof(cpu_t *));
+        if (!results || !harts) {
+            DBG("HART ALLOCATION FAILED");
+            return -1;
+        }
+        harts[0] = &cpu;
+        for (int i = 1; i < nharts; i++)
+            if (!(harts[i] = calloc(1, sizeof(cpu_t))) || cpu_init_hart(harts[i], &cpu, i)) {
+                DBG("HART ALLOCATION FAILED");
+                return -1;
+            }
+        if (quantum ? cpu_run_harts_quantum(harts, nharts, max_instructions, quantum, results) : cpu_run_harts(harts, nharts, max_instructions, results)) {
+            DBG("HART THREADS FAILED");
+            return -1;
+        }
+        for (int i = 0; stats_cpu && i < nharts; i++)
+            fprintf(stderr, "hart %d: %lu retired\n", i, results[i].instret);
+        // what stopped the guest, not a hart stopped because of it
+        r = results[0];
+        for (int i = 0; i < nharts && r.stop == CPU_STOP_REQUEST; i++)
+            r = results[i];
+        for (int i = 1; i < nharts; i++) {
+            cpu_free(harts[i]);
+            free(harts[i]);
+        }
+        free(harts);
+        free(results);
+        harts = NULL;
+    } else {
+        r = cpu_run(&cpu, max_instructions);
+    }
+    switch (r.stop) {
+    case CPU_STOP_ECALL:
+    case CPU_STOP_EBREAK:
+        if (r.ret == 1)
+            break;
+        DBG("execute error");
+        break;
+    case CPU_STOP_LIMIT: DBG("stopped after %lu instructions at %lx%s", r.instret, cpu.pc, symbolize(&cpu, cpu.pc)); break;
+    default: DBG("execute error"); break;
+    }
+    stats_resident = cpu_dram_resident(&cpu);
+    cpu_free(&cpu);
 
     return 0;
 }
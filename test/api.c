@@ -0,0 +1,477 @@
+#include <elf.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// tests of what the library promises beyond running instructions right, see test/engines.c for
+// that: the dram layout, images and ELF executables, snapshots and snapshot files, templates,
+// atomics and harts, handlers and the scheduler. the guest programs are a few instructions each,
+// the files go to a temporary directory that is removed at the end
+
+static char dir[] = "/tmp/api.XXXXXX";
+
+// prints what is checked, 1 if it failed
+static int check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    return !ok;
+}
+
+static void init(cpu_t *cpu, const cpu_config_t *config) {
+    if (cpu_init_config(cpu, config)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+static void path(char *buf, const char *name) { snprintf(buf, sizeof(dir) + 32, "%s/%s", dir, name); }
+
+static int write_file(const char *p, const void *data, uint64_t len) {
+    FILE *f = fopen(p, "wb");
+    if (!f)
+        return -1;
+    int ret = fwrite(data, 1, len, f) == len ? 0 : -1;
+    fclose(f);
+    return ret;
+}
+
+// sd x6, 0(x5); ld x7, 0(x5); ecall with x5 at the last dword of 64 MiB of dram at 0x80000000
+static int test_dram_layout(void) {
+    static const uint32_t code[] = {0x0062b023, 0x0002b383, 0x00000073};
+    cpu_config_t config = {.dram_base = 0x80000000, .dram_size = 64 << 20};
+    cpu_t cpu;
+    uint64_t v = 0x0123456789abcdefull;
+    uint64_t in_dram;
+    int fail = 0;
+
+    init(&cpu, &config);
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.pc = config.dram_base;
+    cpu.regs[5] = config.dram_base + config.dram_size - 8;
+    cpu.regs[6] = v;
+    cpu_result_t r = cpu_run(&cpu, 100);
+    memcpy(&in_dram, cpu.bus.dram.mem + config.dram_size - 8, 8);
+    fail |= check(r.stop == CPU_STOP_ECALL && cpu.pc == config.dram_base + 12 && cpu.regs[7] == v && in_dram == v, "dram at 0x80000000, the last dword");
+    fail |= check(cpu_dram_resident(&cpu) < config.dram_size, "dram is backed on first touch");
+    cpu_free(&cpu);
+    return fail;
+}
+
+// a file one byte larger than dram, and one that does not fit at its address
+static int test_image_size(void) {
+    cpu_config_t config = {.dram_size = 64 << 10};
+    char big[sizeof(dir) + 32];
+    char small[sizeof(dir) + 32];
+    uint8_t *data = calloc(1, config.dram_size + 1);
+    cpu_t cpu;
+    int fail = 0;
+
+    path(big, "big.bin");
+    path(small, "small.bin");
+    if (data)
+        memset(data, 0x5a, config.dram_size + 1);
+    if (!data || write_file(big, data, config.dram_size + 1) || write_file(small, data, 4096)) {
+        free(data);
+        return check(0, "image files");
+    }
+    init(&cpu, &config);
+    fail |= check(cpu_load_image(&cpu, big, 0) == -1 && cpu.bus.dram.mem[0] == 0, "an image larger than dram is rejected, dram is unchanged");
+    fail |= check(cpu_load_image(&cpu, small, config.dram_size - 2048) == -1, "an image past the end of dram is rejected");
+    fail |= check(cpu_load_image(&cpu, small, config.dram_size - 4096) == 0 && cpu.bus.dram.mem[config.dram_size - 1] == 0x5a, "an image at the end of dram");
+    cpu_free(&cpu);
+    remove(big);
+    remove(small);
+    free(data);
+    return fail;
+}
+
+static const char elf_names[] = "\0start\0table";
+
+// the executable of test_elf, laid out as the linker would
+typedef struct elf_file_t {
+    Elf64_Ehdr eh;
+    Elf64_Phdr ph[2];
+    uint8_t pad0[0x1000 - sizeof(Elf64_Ehdr) - 2 * sizeof(Elf64_Phdr)];
+    uint32_t code[4];
+    uint8_t pad1[0x1000 - 4 * sizeof(uint32_t)];
+    uint64_t data;
+    uint8_t junk[0x1000 - 8];
+    Elf64_Sym sym[3];
+    char names[sizeof(elf_names)];
+    Elf64_Shdr sh[3];
+} elf_file_t;
+
+// an executable with code at 0x1000 and entry at 0x1004: addi a1, x0, 100; addi a1, a1, 7; ecall, then
+// 8 bytes of data at 0x3000 followed by bss up to 0x4000. the file has junk after the data in the same
+// page, dram has junk where bss goes
+static int test_elf(void) {
+    static const uint32_t code[] = {0x06400593, 0x00758593, 0x00000073, 0x00000073};
+    elf_file_t f = {0};
+    char file[sizeof(dir) + 32];
+    cpu_t cpu;
+    int fail = 0;
+
+    memcpy(f.eh.e_ident, ELFMAG, SELFMAG);
+    f.eh.e_ident[EI_CLASS] = ELFCLASS64;
+    f.eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    f.eh.e_ident[EI_VERSION] = EV_CURRENT;
+    f.eh.e_type = ET_EXEC;
+    f.eh.e_machine = 243; // EM_RISCV
+    f.eh.e_version = EV_CURRENT;
+    f.eh.e_entry = 0x1004;
+    f.eh.e_phoff = offsetof(elf_file_t, ph);
+    f.eh.e_shoff = offsetof(elf_file_t, sh);
+    f.eh.e_ehsize = sizeof(Elf64_Ehdr);
+    f.eh.e_phentsize = sizeof(Elf64_Phdr);
+    f.eh.e_phnum = 2;
+    f.eh.e_shentsize = sizeof(Elf64_Shdr);
+    f.eh.e_shnum = 3;
+    f.ph[0] = (Elf64_Phdr){.p_type = PT_LOAD, .p_offset = 0x1000, .p_vaddr = 0x1000, .p_filesz = sizeof(code), .p_memsz = sizeof(code), .p_align = 0x1000};
+    f.ph[1] = (Elf64_Phdr){.p_type = PT_LOAD, .p_offset = 0x2000, .p_vaddr = 0x3000, .p_filesz = 8, .p_memsz = 0x1000, .p_align = 0x1000};
+    memcpy(f.code, code, sizeof(code));
+    f.data = 0x1122334455667788ull;
+    memset(f.junk, 0xaa, sizeof(f.junk));
+    f.sym[1] = (Elf64_Sym){.st_name = 1, .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC), .st_shndx = 1, .st_value = 0x1000, .st_size = sizeof(code)};
+    f.sym[2] = (Elf64_Sym){.st_name = 7, .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT), .st_shndx = 1, .st_value = 0x3000, .st_size = 8};
+    memcpy(f.names, elf_names, sizeof(elf_names));
+    f.sh[1] = (Elf64_Shdr){.sh_type = SHT_SYMTAB, .sh_offset = offsetof(elf_file_t, sym), .sh_size = sizeof(f.sym), .sh_link = 2, .sh_entsize = sizeof(Elf64_Sym)};
+    f.sh[2] = (Elf64_Shdr){.sh_type = SHT_STRTAB, .sh_offset = offsetof(elf_file_t, names), .sh_size = sizeof(elf_names)};
+    path(file, "prog.elf");
+    if (write_file(file, &f, sizeof(f)))
+        return check(0, "elf file");
+
+    init(&cpu, &(cpu_config_t){0});
+    memset(cpu.bus.dram.mem + 0x3000, 0x55, 0x2000);
+    int loaded = !cpu_load_elf(&cpu, file);
+    uint64_t data;
+    int zero = 1;
+    memcpy(&data, cpu.bus.dram.mem + 0x3000, 8);
+    for (int i = 8; i < 0x1000; i++)
+        zero &= cpu.bus.dram.mem[0x3000 + i] == 0;
+    fail |= check(loaded && !memcmp(cpu.bus.dram.mem + 0x1000, code, sizeof(code)) && data == f.data, "elf segments at their addresses");
+    fail |= check(loaded && zero && cpu.bus.dram.mem[0x4000] == 0x55, "elf bss zeroed, up to its end");
+    fail |= check(loaded && cpu.pc == 0x1004 && cpu.regs[10] == 1, "elf e_entry, a0 = 1");
+    cpu_run(&cpu, 100);
+    fail |= check(cpu.regs[11] == 7, "elf runs from e_entry");
+    const cpu_symbol_t *start = cpu_symbol_find(&cpu, 0x1008);
+    const cpu_symbol_t *table = cpu_symbol_find(&cpu, 0x3004);
+    fail |= check(start && !strcmp(start->name, "start") && start->addr == 0x1000 && table && !strcmp(table->name, "table") && !cpu_symbol_find(&cpu, 0x3008) &&
+                      !cpu_symbol_find(&cpu, 0xfff),
+                  "cpu_symbol_find");
+    cpu_free(&cpu);
+    remove(file);
+    return fail;
+}
+
+// sd x6, 0(x5); sd x6, 0(x7); ecall, storing to the pages at 0x10000 and 0x20000
+static int test_snapshot(void) {
+    static const uint32_t code[] = {0x0062b023, 0x0063b023, 0x00000073};
+    cpu_t cpu;
+    int fail = 0;
+
+    init(&cpu, &(cpu_config_t){0});
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.bus.dram.mem[0x10000] = 1;
+    cpu.bus.dram.mem[0x30000] = 3;
+    cpu.regs[5] = 0x10000;
+    cpu.regs[6] = -1;
+    cpu.regs[7] = 0x20008;
+    if (cpu_snapshot(&cpu))
+        return check(0, "cpu_snapshot");
+    cpu_run(&cpu, 100);
+    cpu.regs[5] = 0;
+    cpu_restore(&cpu);
+    fail |= check(cpu.bus.dram.mem[0x10000] == 1 && cpu.bus.dram.mem[0x10001] == 0 && cpu.bus.dram.mem[0x20008] == 0 && cpu.bus.dram.mem[0x30000] == 3,
+                  "cpu_restore undoes the stores");
+    fail |= check(cpu.pc == 0 && cpu.regs[5] == 0x10000, "cpu_restore resets registers and pc");
+    uint64_t pages = cpu.snap->tracked ? 2 : cpu.snap->pages;
+    fail |= check(cpu.stats.pages_restored == pages, "cpu_restore copies the dirty pages only");
+    cpu_restore(&cpu);
+    fail |= check(cpu.stats.pages_restored == pages + (cpu.snap->tracked ? 0 : cpu.snap->pages), "cpu_restore of a clean dram copies nothing");
+    cpu_run(&cpu, 100);
+    cpu_restore(&cpu);
+    fail |= check(cpu.bus.dram.mem[0x10000] == 1 && cpu.bus.dram.mem[0x20008] == 0, "cpu_restore again after the next run");
+    cpu_free(&cpu);
+    return fail;
+}
+
+// addi x5, x5, 1; sd x5, 0(x6); addi x6, x6, 8; blt x5, x7, -12; ecall, stopped in the middle and
+// written to a file, then loaded into a cpu of another engine and both run to the end
+static int test_snapshot_file(void) {
+    static const uint32_t code[] = {0x00128293, 0x00533023, 0x00830313, 0xfe72cae3, 0x00000073};
+    cpu_config_t config = {.dram_base = 0x10000, .dram_size = 2 << 20};
+    cpu_config_t loaded = {0};
+    char file[sizeof(dir) + 32];
+    cpu_t cpu;
+    cpu_t copy;
+    int fail = 0;
+
+    path(file, "snap.rv64");
+    init(&cpu, &config);
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.pc = config.dram_base;
+    cpu.regs[6] = config.dram_base + 0x8000;
+    cpu.regs[7] = 5000;
+    cpu_run(&cpu, 10001);
+    if (cpu_snapshot_write(&cpu, file) || cpu_snapshot_config(file, &loaded))
+        return check(0, "cpu_snapshot_write");
+    fail |= check(loaded.dram_base == config.dram_base && loaded.dram_size == config.dram_size, "cpu_snapshot_config");
+    loaded.engine = CPU_ENGINE_BLOCK;
+    init(&copy, &loaded);
+    fail |= check(!cpu_snapshot_load(&copy, file) && copy.pc == cpu.pc && !memcmp(copy.regs, cpu.regs, sizeof(cpu.regs)) &&
+                      !memcmp(copy.bus.dram.mem, cpu.bus.dram.mem, config.dram_size),
+                  "cpu_snapshot_load has the registers, pc and dram written");
+    cpu_run(&cpu, 100000);
+    cpu_run(&copy, 100000);
+    fail |= check(copy.pc == cpu.pc && copy.regs[5] == 5000 && !memcmp(copy.regs, cpu.regs, sizeof(cpu.regs)) &&
+                      !memcmp(copy.bus.dram.mem, cpu.bus.dram.mem, config.dram_size),
+                  "the loaded snapshot runs on like the cpu it was written from");
+    cpu_free(&cpu);
+    cpu_free(&copy);
+    remove(file);
+    return fail;
+}
+
+// sd a0, 0(x5); ld a1, 8(x5); ecall on two cpus of one template, with a0 = 1 and 2
+static int test_template(void) {
+    static const uint32_t code[] = {0x00a2b023, 0x0082b583, 0x00000073};
+    cpu_t cpu;
+    cpu_t a;
+    cpu_t b;
+    int fail = 0;
+
+    init(&cpu, &(cpu_config_t){.engine = CPU_ENGINE_JIT});
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.bus.dram.mem[0x8008] = 42;
+    cpu.regs[5] = 0x8000;
+    cpu_template_t *t = cpu_template_new(&cpu);
+    if (!t || cpu_init_template(&a, t) || cpu_init_template(&b, t))
+        return check(0, "cpu_template_new");
+    a.regs[10] = 1;
+    b.regs[10] = 2;
+    cpu_run(&a, 100);
+    cpu_run(&b, 100);
+    fail |= check(a.bus.dram.mem[0x8000] == 1 && b.bus.dram.mem[0x8000] == 2 && cpu.bus.dram.mem[0x8000] == 0, "template cpus do not see each other's stores");
+    fail |= check(a.regs[11] == 42 && b.regs[11] == 42, "template cpus start with the dram of the template");
+    cpu_free(&a);
+    cpu_free(&b);
+    cpu_template_free(t);
+    cpu_free(&cpu);
+    return fail;
+}
+
+// lr.d x6, (x5); sc.d x7, x8, (x5); amoadd.d x9, x10, (x5); amoswap.w x11, x12, (x13); amomax.d x14, x15, (x5);
+// amomaxu.d x16, x15, (x5); csrr x17, mhartid; lr.d x6, (x5); ecall; sc.d x7, x8, (x5); ecall. between the two
+// ecalls hart 3 runs sd x0, 0(x5); csrr x17, mhartid; ecall at 0x40
+static int test_atomics(void) {
+    static const uint32_t code[] = {0x1002b32f, 0x1882b3af, 0x00a2b4af, 0x08c6a5af, 0xa0f2b72f, 0xe0f2b82f,
+                                    0xf14028f3, 0x1002b32f, 0x00000073, 0x1882b3af, 0x00000073};
+    static const uint32_t other[] = {0x0002b023, 0xf14028f3, 0x00000073};
+    cpu_t cpu;
+    cpu_t hart;
+    uint64_t m;
+    uint32_t w;
+    int fail = 0;
+
+    init(&cpu, &(cpu_config_t){0});
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    memcpy(cpu.bus.dram.mem + 0x40, other, sizeof(other));
+    memcpy(cpu.bus.dram.mem + 0x8000, &(uint64_t){10}, 8);
+    memcpy(cpu.bus.dram.mem + 0x8010, &(uint32_t){0xffffffff}, 4);
+    cpu.regs[5] = 0x8000;
+    cpu.regs[8] = 20;
+    cpu.regs[10] = 5;
+    cpu.regs[12] = 7;
+    cpu.regs[13] = 0x8010;
+    cpu.regs[15] = -1;
+    cpu_run(&cpu, 100);
+    memcpy(&w, cpu.bus.dram.mem + 0x8010, 4);
+    fail |= check(cpu.regs[7] == 0 && cpu.regs[9] == 20, "sc after lr stores");
+    fail |= check(cpu.regs[9] == 20 && cpu.regs[11] == (uint64_t)-1 && w == 7, "amoadd.d, amoswap.w");
+    fail |= check(cpu.regs[14] == 25 && cpu.regs[16] == 25 && cpu.regs[6] == (uint64_t)-1, "amomax.d, amomaxu.d");
+    fail |= check(cpu.regs[17] == 0, "mhartid 0");
+
+    if (cpu_init_hart(&hart, &cpu, 3))
+        return check(0, "cpu_init_hart");
+    hart.pc = 0x40;
+    cpu_run(&hart, 100);
+    cpu_run(&cpu, 100);
+    memcpy(&m, cpu.bus.dram.mem + 0x8000, 8);
+    fail |= check(hart.regs[17] == 3, "mhartid of a hart");
+    fail |= check(cpu.regs[7] == 1 && m == 0, "sc fails after a store of another hart");
+    cpu_free(&hart);
+    cpu_free(&cpu);
+    return fail;
+}
+
+// csrr x5, mhartid; ld x6, 0(x7); add x6, x6, x5; addi x6, x6, 1; sd x6, 0(x7); addi x8, x8, -1; bne x8, x0, -20;
+// ecall on two harts with different counts in x8, both adding to one counter without atomics
+static int quantum_run(cpu_result_t *r, uint64_t *counter) {
+    static const uint32_t code[] = {0xf14022f3, 0x0003b303, 0x00530333, 0x00130313, 0x0063b023, 0xfff40413, 0xfe0416e3, 0x00000073};
+    cpu_t cpu;
+    cpu_t hart;
+    cpu_t *cpus[2] = {&cpu, &hart};
+
+    init(&cpu, &(cpu_config_t){.engine = CPU_ENGINE_BLOCK});
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.regs[7] = 0x8000;
+    cpu.regs[8] = 1000;
+    if (cpu_init_hart(&hart, &cpu, 1))
+        return -1;
+    hart.regs[8] = 1500;
+    int ret = cpu_run_harts_quantum(cpus, 2, UINT64_MAX, 7, r);
+    memcpy(counter, cpu.bus.dram.mem + 0x8000, 8);
+    cpu_free(&hart);
+    cpu_free(&cpu);
+    return ret;
+}
+
+static int test_quantum(void) {
+    cpu_result_t r[2][2];
+    uint64_t counter[2];
+    if (quantum_run(r[0], &counter[0]) || quantum_run(r[1], &counter[1]))
+        return check(0, "cpu_run_harts_quantum");
+    return check(r[0][0].instret == r[1][0].instret && r[0][1].instret == r[1][1].instret && r[0][0].stop == CPU_STOP_ECALL && r[0][1].stop == CPU_STOP_ECALL &&
+                     counter[0] == counter[1],
+                 "two quantum runs retire and store the same");
+}
+
+typedef struct seen_t {
+    cpu_t *cpu; // the cpu the ecall handler was called for
+    int ecalls;
+    uint64_t tag; // goes to a1
+} seen_t;
+
+static int seen_ecall(void *ctx, cpu_t *cpu, uint32_t inst) {
+    seen_t *s = ctx;
+    s->cpu = cpu;
+    s->ecalls++;
+    cpu->regs[11] = s->tag;
+    return 0;
+}
+
+static int seen_ebreak(void *ctx, cpu_t *cpu, uint32_t inst) { return 1; }
+
+// ecall; addi a0, a0, 1; ebreak on two cpus with handlers of their own, then on one of them again after cpu_set_handlers
+static int test_handlers(void) {
+    static const uint32_t code[] = {0x00000073, 0x00150513, 0x00100073};
+    seen_t sa = {.tag = 0xa};
+    seen_t sb = {.tag = 0xb};
+    seen_t sc = {.tag = 0xc};
+    cpu_t a;
+    cpu_t b;
+    int fail = 0;
+
+    init(&a, &(cpu_config_t){.handlers = {seen_ecall, seen_ebreak, NULL, &sa}});
+    init(&b, &(cpu_config_t){.engine = CPU_ENGINE_THREADED, .handlers = {seen_ecall, seen_ebreak, NULL, &sb}});
+    memcpy(a.bus.dram.mem, code, sizeof(code));
+    memcpy(b.bus.dram.mem, code, sizeof(code));
+    cpu_result_t ra = cpu_run(&a, 100);
+    cpu_result_t rb = cpu_run(&b, 100);
+    fail |= check(sa.cpu == &a && sa.ecalls == 1 && a.regs[11] == 0xa && sb.cpu == &b && sb.ecalls == 1 && b.regs[11] == 0xb, "each cpu calls its own handlers with its ctx");
+    fail |= check(ra.stop == CPU_STOP_EBREAK && rb.stop == CPU_STOP_EBREAK && a.regs[10] == 1 && b.regs[10] == 1, "ebreak handler stops the cpu");
+    cpu_set_handlers(&b, &(cpu_handlers_t){seen_ecall, seen_ebreak, NULL, &sc});
+    b.pc = 0;
+    cpu_run(&b, 100);
+    fail |= check(sc.cpu == &b && sc.ecalls == 1 && b.regs[11] == 0xc && sb.ecalls == 1 && sa.ecalls == 1, "cpu_set_handlers");
+    cpu_free(&a);
+    cpu_free(&b);
+    return fail;
+}
+
+#define SCHED_JOBS 24
+#define SCHED_WAITER 5 // the job whose first ecall waits for cpu_sched_wake
+
+typedef struct sched_test_t {
+    cpu_sched_t *s;
+    int job;
+    int ecalls;
+    int wait; // the first ecall returns CPU_SCHED_WAIT
+} sched_test_t;
+
+static int waiting = -1; // the job cpu_sched_wake is due for
+
+static int sched_ecall(void *ctx, cpu_t *cpu, uint32_t inst) {
+    sched_test_t *t = ctx;
+    if (t->ecalls++)
+        return 1;
+    if (!t->wait)
+        return 0;
+    cpu->regs[10] = 77; // what the host call returned
+    __atomic_store_n(&waiting, t->job, __ATOMIC_RELEASE);
+    return CPU_SCHED_WAIT;
+}
+
+static void *sched_waker(void *arg) {
+    sched_test_t *t = arg;
+    while (__atomic_load_n(&waiting, __ATOMIC_ACQUIRE) < 0)
+        usleep(100);
+    cpu_sched_wake(t->s, waiting);
+    return NULL;
+}
+
+// addi x5, x5, 1; bne x5, x6, -4; ecall; add x7, x7, a0; ecall. job i counts to 1000 + 100 * i
+static int test_sched(void) {
+    static const uint32_t code[] = {0x00128293, 0xfe629ee3, 0x00000073, 0x00a383b3, 0x00000073};
+    static cpu_t cpus[SCHED_JOBS];
+    sched_test_t t[SCHED_JOBS];
+    pthread_t waker;
+    uint64_t quantum = 100;
+    int done = 1;
+    int counted = 1;
+    int sliced = 1;
+
+    cpu_sched_t *s = cpu_sched_new(3, quantum);
+    if (!s)
+        return check(0, "cpu_sched_new");
+    for (int i = 0; i < SCHED_JOBS; i++) {
+        t[i] = (sched_test_t){.s = s, .job = i, .wait = i == SCHED_WAITER};
+        init(&cpus[i], &(cpu_config_t){.engine = i % 3 ? CPU_ENGINE_BLOCK : CPU_ENGINE_THREADED, .handlers = {.ecall = sched_ecall, .ctx = &t[i]}});
+        memcpy(cpus[i].bus.dram.mem, code, sizeof(code));
+        cpus[i].regs[6] = 1000 + 100 * i;
+        if (cpu_sched_add(s, &cpus[i], UINT64_MAX) != i)
+            return check(0, "cpu_sched_add");
+    }
+    if (pthread_create(&waker, NULL, sched_waker, &t[0]) || cpu_sched_run(s))
+        return check(0, "cpu_sched_run");
+    pthread_join(waker, NULL);
+    for (int i = 0; i < SCHED_JOBS; i++) {
+        cpu_result_t r;
+        cpu_job_stats_t st;
+        cpu_sched_result(s, i, &r, &st);
+        // two per count, then ecall, add and ecall
+        uint64_t instret = 2 * (1000 + 100 * i) + 3;
+        done &= r.stop == CPU_STOP_ECALL && r.ret == 1 && t[i].ecalls == 2 && cpus[i].regs[7] == (i == SCHED_WAITER ? 77 : 0);
+        counted &= st.instret == instret && cpus[i].stats.instret == instret;
+        sliced &= st.slices >= (instret + quantum - 1) / quantum + (i == SCHED_WAITER) && st.migrations < st.slices && st.run_ns > 0;
+        cpu_free(&cpus[i]);
+    }
+    cpu_sched_free(s);
+    return check(done, "every job runs to its end, the waiting one after cpu_sched_wake") | check(counted, "cpu_job_stats_t instret") |
+           check(sliced, "cpu_job_stats_t slices, migrations and run time");
+}
+
+int main(int argc, char **argv) {
+    int fail = 0;
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "no temporary directory\n");
+        return 1;
+    }
+    fail |= test_dram_layout();
+    fail |= test_image_size();
+    fail |= test_elf();
+    fail |= test_snapshot();
+    fail |= test_snapshot_file();
+    fail |= test_template();
+    fail |= test_atomics();
+    fail |= test_quantum();
+    fail |= test_handlers();
+    fail |= test_sched();
+    rmdir(dir);
+    return fail;
+}
@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// per instruction cost of each engine. every RV64IM instruction is timed in a loop
+// of BENCH_BODY copies of itself, once writing x5 and once writing x0. then the speed
+// of the sha256 and aes workloads of test/bench.rv64i.s, the throughput of
+// bus_load/bus_store, range checked and with guard pages, against the portable byte by
+// byte dram path, the cost of resetting a guest with cpu_restore and the throughput of
+// a batch of guests on cpu_sched_t with more and more workers
+
+#define BENCH_BODY 32
+#define BENCH_DATA 0x8000 // x9 points here for the loads and stores
+
+typedef enum kind_t {
+    R,    // rd, x7, x8
+    I,    // rd, x7, x
+    L,    // rd, x(x9)
+    S,    // x7, x(x9)
+    U,    // rd, 0x12345
+    B,    // x7, x8, next instruction
+    JAL,  // rd, next instruction
+    JALR, // rd, next instruction(x0)
+    F,    // fence
+} kind_t;
+
+typedef struct bench_op_t {
+    const char *name;
+    kind_t kind;
+    uint32_t opcode;
+    uint32_t funct3;
+    uint32_t x; // funct7 of R, immediate of I, L and S
+} bench_op_t;
+
+static const bench_op_t ops[] = {
+    {"lui", U, 0x37, 0, 0},       {"auipc", U, 0x17, 0, 0},     {"jal", JAL, 0x6f, 0, 0},     {"jalr", JALR, 0x67, 0, 0},   {"beq", B, 0x63, 0, 0},
+    {"bne", B, 0x63, 1, 0},       {"blt", B, 0x63, 4, 0},       {"bge", B, 0x63, 5, 0},       {"bltu", B, 0x63, 6, 0},      {"bgeu", B, 0x63, 7, 0},
+    {"lb", L, 0x03, 0, 8},        {"lh", L, 0x03, 1, 8},        {"lw", L, 0x03, 2, 8},        {"ld", L, 0x03, 3, 8},        {"lbu", L, 0x03, 4, 8},
+    {"lhu", L, 0x03, 5, 8},       {"lwu", L, 0x03, 6, 8},       {"sb", S, 0x23, 0, 8},        {"sh", S, 0x23, 1, 8},        {"sw", S, 0x23, 2, 8},
+    {"sd", S, 0x23, 3, 8},        {"addi", I, 0x13, 0, 5},      {"slti", I, 0x13, 2, 5},      {"sltiu", I, 0x13, 3, 5},     {"xori", I, 0x13, 4, 5},
+    {"ori", I, 0x13, 6, 5},       {"andi", I, 0x13, 7, 5},      {"slli", I, 0x13, 1, 5},      {"srli", I, 0x13, 5, 5},      {"srai", I, 0x13, 5, 0x405},
+    {"add", R, 0x33, 0, 0x00},    {"sub", R, 0x33, 0, 0x20},    {"sll", R, 0x33, 1, 0x00},    {"slt", R, 0x33, 2, 0x00},    {"sltu", R, 0x33, 3, 0x00},
+    {"xor", R, 0x33, 4, 0x00},    {"srl", R, 0x33, 5, 0x00},    {"sra", R, 0x33, 5, 0x20},    {"or", R, 0x33, 6, 0x00},     {"and", R, 0x33, 7, 0x00},
+    {"fence", F, 0x0f, 0, 0},     {"addiw", I, 0x1b, 0, 5},     {"slliw", I, 0x1b, 1, 5},     {"srliw", I, 0x1b, 5, 5},     {"sraiw", I, 0x1b, 5, 0x405},
+    {"addw", R, 0x3b, 0, 0x00},   {"subw", R, 0x3b, 0, 0x20},   {"sllw", R, 0x3b, 1, 0x00},   {"srlw", R, 0x3b, 5, 0x00},   {"sraw", R, 0x3b, 5, 0x20},
+    {"mul", R, 0x33, 0, 0x01},    {"mulh", R, 0x33, 1, 0x01},   {"mulhsu", R, 0x33, 2, 0x01}, {"mulhu", R, 0x33, 3, 0x01},  {"div", R, 0x33, 4, 0x01},
+    {"divu", R, 0x33, 5, 0x01},   {"rem", R, 0x33, 6, 0x01},    {"remu", R, 0x33, 7, 0x01},   {"mulw", R, 0x3b, 0, 0x01},   {"divw", R, 0x3b, 4, 0x01},
+    {"divuw", R, 0x3b, 5, 0x01},  {"remw", R, 0x3b, 6, 0x01},   {"remuw", R, 0x3b, 7, 0x01},
+};
+
+static const struct {
+    const char *name;
+    cpu_engine_t engine;
+} engines[] = {{"step", CPU_ENGINE_STEP}, {"threaded", CPU_ENGINE_THREADED}, {"block", CPU_ENGINE_BLOCK}, {"jit", CPU_ENGINE_JIT}};
+#define ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static uint32_t enc_B(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t off) {
+    uint32_t u = off;
+    return 0x63 | ((u >> 11) & 1) << 7 | ((u >> 1) & 0xf) << 8 | funct3 << 12 | rs1 << 15 | rs2 << 20 | ((u >> 5) & 0x3f) << 25 | ((u >> 12) & 1) << 31;
+}
+
+// the instruction at pc, rd is ignored by the kinds without one
+static uint32_t enc(const bench_op_t *op, uint32_t rd, uint64_t pc) {
+    uint32_t base = op->opcode | op->funct3 << 12;
+    switch (op->kind) {
+    case R: return base | rd << 7 | 7 << 15 | 8 << 20 | op->x << 25;
+    case I: return base | rd << 7 | 7 << 15 | op->x << 20;
+    case L: return base | rd << 7 | 9 << 15 | op->x << 20;
+    case S: return base | (op->x & 0x1f) << 7 | 9 << 15 | 7 << 20 | (op->x >> 5) << 25;
+    case U: return base | rd << 7 | 0x12345 << 12;
+    case B: return enc_B(op->funct3, 7, 8, 4);
+    case JAL: return base | rd << 7 | (4 >> 1) << 21;
+    case JALR: return base | rd << 7 | (uint32_t)(pc + 4) << 20; // pc stays below 2 KiB
+    case F: return base;
+    }
+    return 0;
+}
+
+static int has_rd(const bench_op_t *op) { return op->kind != S && op->kind != B && op->kind != F; }
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static cpu_t cpu;
+
+// ns per instruction of iterations times the loop around op
+static double bench_once(const bench_op_t *op, uint32_t rd, cpu_engine_t engine, uint64_t iterations) {
+    cpu_config_t config = {.engine = engine};
+    uint32_t code[BENCH_BODY + 3];
+    for (int i = 0; i < BENCH_BODY; i++)
+        code[i] = enc(op, rd, 4 * i);
+    code[BENCH_BODY] = 0xffff8f93;                                 // addi x31, x31, -1
+    code[BENCH_BODY + 1] = enc_B(1, 31, 0, -4 * (BENCH_BODY + 1)); // bne x31, x0, 0
+    code[BENCH_BODY + 2] = 0x00000073;                             // ecall
+
+    cpu_init_config(&cpu, &config);
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.regs[7] = 0x123456789abcdef1ull;
+    cpu.regs[8] = 0x0fedcba987654321ull;
+    cpu.regs[9] = BENCH_DATA;
+    cpu.regs[31] = iterations;
+
+    double t = now();
+    cpu_result_t r = cpu_run(&cpu, UINT64_MAX);
+    t = now() - t;
+    cpu_free(&cpu);
+    if (r.stop != CPU_STOP_ECALL) {
+        fprintf(stderr, "%s: stopped by %d\n", op->name, r.stop);
+        exit(1);
+    }
+    return t * 1e9 / r.instret;
+}
+
+// best of three, the others caught the scheduler or a frequency change
+static double bench(const bench_op_t *op, uint32_t rd, cpu_engine_t engine, uint64_t iterations) {
+    double best = bench_once(op, rd, engine, iterations);
+    for (int i = 0; i < 2; i++) {
+        double t = bench_once(op, rd, engine, iterations);
+        if (t < best)
+            best = t;
+    }
+    return best;
+}
+
+// the path bus_load/bus_store take on big endian hosts
+static uint64_t portable_load(bus_t *bus, uint64_t addr, uint64_t size) {
+    return bus_ptr(bus, addr, size / 8) ? dram_load(&bus->dram, addr - bus->dram.base, size) : 0;
+}
+
+static void portable_store(bus_t *bus, uint64_t addr, uint64_t size, uint64_t value) {
+    if (bus_ptr(bus, addr, size / 8))
+        dram_store(&bus->dram, addr - bus->dram.base, size, value);
+}
+
+// n accesses of size bits to random, mostly unaligned addresses in the first 64 KiB
+static inline __attribute__((always_inline)) uint64_t bus_loop(bus_t *bus, int native, int store, uint64_t size, uint64_t n) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t addr = bus->dram.base + ((i * 0x9e3779b1) & 0xffff); // no dependency between iterations
+        if (store && native)
+            bus_store(bus, addr, size, i);
+        else if (store)
+            portable_store(bus, addr, size, i);
+        else
+            sum += native ? bus_load(bus, addr, size) : portable_load(bus, addr, size);
+    }
+    return sum;
+}
+
+static volatile uint64_t sink; // keeps the loads
+
+// ns per access, best of three
+static double bench_bus(bus_t *bus, int native, int store, uint64_t size, uint64_t n) {
+    double best = 0;
+    for (int i = 0; i < 3; i++) {
+        double t = now();
+        switch (size) { // constant sizes, like at the call sites in the engines
+        case 8: sink = bus_loop(bus, native, store, 8, n); break;
+        case 16: sink = bus_loop(bus, native, store, 16, n); break;
+        case 32: sink = bus_loop(bus, native, store, 32, n); break;
+        default: sink = bus_loop(bus, native, store, 64, n); break;
+        }
+        t = now() - t;
+        if (i == 0 || t < best)
+            best = t;
+    }
+    return best * 1e9 / n;
+}
+
+// us per reset of a 1 MiB guest that stored to pages pages since the last one, with
+// cpu_restore or by starting over with a new cpu and a copy of the image
+// mode 0: a new cpu with the image copied in, 1: cpu_restore, 2: a new cpu from a template
+static double bench_reset(int mode, uint64_t pages, uint64_t n) {
+    static uint8_t image[DRAM_SIZE];
+    double t = 0;
+    cpu_init(&cpu);
+    memcpy(cpu.bus.dram.mem, image, sizeof(image));
+    cpu_template_t *tmpl = mode == 2 ? cpu_template_new(&cpu) : NULL;
+    if (mode == 1)
+        cpu_snapshot(&cpu);
+    for (uint64_t i = 0; i < n; i++) {
+        for (uint64_t p = 0; p < pages; p++)
+            bus_store(&cpu.bus, DRAM_BASE + p * 4096, 64, i); // faults like a guest store
+        double t0 = now();
+        if (mode == 1) {
+            cpu_restore(&cpu);
+        } else if (tmpl) {
+            cpu_free(&cpu);
+            cpu_init_template(&cpu, tmpl);
+        } else {
+            cpu_free(&cpu);
+            cpu_init(&cpu);
+            memcpy(cpu.bus.dram.mem, image, sizeof(image));
+        }
+        t += now() - t0;
+    }
+    cpu_free(&cpu);
+    cpu_template_free(tmpl);
+    return t * 1e6 / n;
+}
+
+// million instructions per second of BENCH_JOBS guests running an addi loop of iterations on workers threads
+#define BENCH_JOBS 64
+static double bench_sched(int workers, uint64_t iterations) {
+    static cpu_t jobs[BENCH_JOBS];
+    uint32_t code[] = {0x00128293, 0xffff8f93, enc_B(1, 31, 0, -8), 0x00000073}; // addi x5, x5, 1; addi x31, x31, -1; bne; ecall
+    cpu_config_t config = {.engine = CPU_ENGINE_BLOCK};
+    cpu_sched_t *s = cpu_sched_new(workers, 100000);
+    uint64_t instret = 0;
+
+    cpu_init_config(&cpu, &config);
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.regs[31] = iterations;
+    cpu_template_t *tmpl = cpu_template_new(&cpu);
+    for (int i = 0; i < BENCH_JOBS; i++) {
+        cpu_init_template(&jobs[i], tmpl);
+        cpu_sched_add(s, &jobs[i], UINT64_MAX);
+    }
+    double t = now();
+    cpu_sched_run(s);
+    t = now() - t;
+    for (int i = 0; i < BENCH_JOBS; i++) {
+        cpu_result_t r;
+        cpu_sched_result(s, i, &r, NULL);
+        instret += r.instret;
+        cpu_free(&jobs[i]);
+    }
+    cpu_sched_free(s);
+    cpu_template_free(tmpl);
+    cpu_free(&cpu);
+    return instret / t / 1e6;
+}
+
+// million instructions per second of BENCH_JOBS guests on the calling thread, on different inputs
+// of one loop of iterations: one after the other with cpu_run on engine, or with cpu_run_lanes when lanes
+static double bench_lanes(cpu_engine_t engine, int lanes, uint64_t iterations) {
+    static cpu_t jobs[BENCH_JOBS];
+    cpu_t *cpus[BENCH_JOBS];
+    cpu_result_t r[BENCH_JOBS];
+    // addi x5, x5, 1; xor x6, x6, x5; add x7, x7, x6; addi x31, x31, -1; bne; ecall
+    uint32_t code[] = {0x00128293, 0x00534333, 0x006383b3, 0xffff8f93, enc_B(1, 31, 0, -16), 0x00000073};
+    cpu_config_t config = {.engine = engine};
+    uint64_t instret = 0;
+
+    cpu_init_config(&cpu, &config);
+    memcpy(cpu.bus.dram.mem, code, sizeof(code));
+    cpu.regs[31] = iterations;
+    cpu_template_t *tmpl = cpu_template_new(&cpu);
+    for (int i = 0; i < BENCH_JOBS; i++) {
+        cpu_init_template(&jobs[i], tmpl);
+        jobs[i].regs[6] = i;
+        cpus[i] = &jobs[i];
+    }
+    double t = now();
+    if (lanes)
+        cpu_run_lanes(cpus, BENCH_JOBS, UINT64_MAX, r);
+    else
+        for (int i = 0; i < BENCH_JOBS; i++)
+            r[i] = cpu_run(cpus[i], UINT64_MAX);
+    t = now() - t;
+    for (int i = 0; i < BENCH_JOBS; i++) {
+        instret += r[i].instret;
+        cpu_free(&jobs[i]);
+    }
+    cpu_template_free(tmpl);
+    cpu_free(&cpu);
+    return instret / t / 1e6;
+}
+
+#define BENCH_IMAGE "bin/bench.rv64i.bin" // test/bench.rv64i.s, sha256 at 0 and aes at 4
+
+// million instructions per second of the workload at entry of BENCH_IMAGE, a0 repetitions. 0
+// without the image, it needs a riscv assembler to build
+static double bench_image(cpu_engine_t engine, uint64_t entry, uint64_t reps) {
+    cpu_config_t config = {.engine = engine};
+    double best = 0;
+    for (int i = 0; i < 3; i++) {
+        cpu_init_config(&cpu, &config);
+        if (cpu_load_image(&cpu, BENCH_IMAGE, 0)) {
+            cpu_free(&cpu);
+            return 0;
+        }
+        cpu.pc = entry;
+        cpu.regs[10] = reps;
+        double t = now();
+        cpu_result_t r = cpu_run(&cpu, UINT64_MAX);
+        t = now() - t;
+        cpu_free(&cpu);
+        if (r.stop != CPU_STOP_ECALL) {
+            fprintf(stderr, "%s: stopped by %d\n", BENCH_IMAGE, r.stop);
+            exit(1);
+        }
+        if (r.instret / t * 1e-6 > best)
+            best = r.instret / t * 1e-6;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 0) : 20000;
+    double sum[ENGINES][2] = {{0}};
+    int nrd = 0;
+
+    printf("ns per instruction, loops of %d with rd = x5 | rd = x0\n%-8s", BENCH_BODY, "");
+    for (size_t e = 0; e < ENGINES; e++)
+        printf(" %15s", engines[e].name);
+    printf("\n");
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        printf("%-8s", ops[i].name);
+        for (size_t e = 0; e < ENGINES; e++) {
+            double x5 = bench(&ops[i], 5, engines[e].engine, iterations);
+            if (has_rd(&ops[i])) {
+                double x0 = bench(&ops[i], 0, engines[e].engine, iterations);
+                sum[e][0] += x5;
+                sum[e][1] += x0;
+                printf("  %6.2f | %6.2f", x5, x0);
+            } else {
+                printf("  %6.2f |      -", x5);
+            }
+        }
+        nrd += has_rd(&ops[i]);
+        printf("\n");
+        fflush(stdout);
+    }
+    printf("%-8s", "mean");
+    for (size_t e = 0; e < ENGINES; e++)
+        printf("  %6.2f | %6.2f", sum[e][0] / nrd, sum[e][1] / nrd);
+    printf("\n");
+
+    static const struct {
+        const char *name;
+        uint64_t entry;
+    } workloads[] = {{"sha256", 0}, {"aes", 4}};
+    printf("\nmillion instructions per second of the workloads of %s\n%-8s", BENCH_IMAGE, "");
+    for (size_t e = 0; e < ENGINES; e++)
+        printf(" %8s", engines[e].name);
+    printf("\n");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        printf("%-8s", workloads[w].name);
+        for (size_t e = 0; e < ENGINES; e++)
+            printf(" %8.1f", bench_image(engines[e].engine, workloads[w].entry, iterations / 100));
+        printf("\n");
+        fflush(stdout);
+    }
+
+    static cpu_t guarded;
+    cpu_config_t config = {.guard = 1};
+    if (cpu_init(&cpu) || cpu_init_config(&guarded, &config)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    printf("\nns per bus access, native | guard pages | portable%s\n%-8s %24s %24s\n", guarded.bus.guard ? "" : " (no guard pages on this host)", "", "load",
+           "store");
+    for (uint64_t size = 8; size <= 64; size *= 2) {
+        uint64_t n = iterations * 500;
+        printf("%-8lu", size);
+        for (int store = 0; store < 2; store++)
+            printf("  %6.2f | %6.2f | %6.2f", bench_bus(&cpu.bus, 1, store, size, n), bench_bus(&guarded.bus, 1, store, size, n),
+                   bench_bus(&cpu.bus, 0, store, size, n));
+        printf("\n");
+    }
+    cpu_free(&cpu);
+    cpu_free(&guarded);
+
+    printf("\nus per reset of a 1 MiB guest, cpu_restore | cpu_init_template | new cpu\npages\n");
+    for (uint64_t pages = 1; pages <= 256; pages *= 16)
+        printf("%-8lu  %6.2f | %6.2f | %6.2f\n", pages, bench_reset(1, pages, 200), bench_reset(2, pages, 200), bench_reset(0, pages, 200));
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("\nmillion instructions per second of %d guests on cpu_sched_t\nworkers\n", BENCH_JOBS);
+    for (long workers = 1; workers <= cores; workers *= 2)
+        printf("%-8ld  %8.1f\n", workers, bench_sched(workers, iterations * 100));
+
+    printf("\nmillion instructions per second of %d guests on one thread, one after the other with cpu_run or with cpu_run_lanes\n", BENCH_JOBS);
+    for (size_t e = 1; e < ENGINES; e++)
+        printf("%-8s  %8.1f\n", engines[e].name, bench_lanes(engines[e].engine, 0, iterations * 10));
+    printf("%-8s  %8.1f\n", "lanes", bench_lanes(CPU_ENGINE_STEP, 1, iterations * 10));
+    return 0;
+}
@@ -0,0 +1,475 @@
+# guest workloads of test/bench.c, loaded at address 0. both run their loop a0 times
+# and end with an ecall, the result in a0:
+#   0: sha256 of SHA_BLOCKS blocks, a0 = the first word of the state
+#   4: aes-128 of AES_BLOCKS blocks in place, a0 = the first word of the buffer
+# the code is what a compiler makes of test/sha256.c and test/aes.c: long straight
+# runs of 32 bit arithmetic, table loads and short loops. no relocations, data is
+# at fixed addresses
+
+    .option norelax
+    .text
+
+    .equ K, 0x1000         # sha256 round constants
+    .equ H0, 0x1100        # sha256 initial state
+    .equ SBOX, 0x1200      # aes s-box
+    .equ KEY, 0x1300       # aes-128 key
+    .equ AESBUF, 0x1400    # aes data, encrypted in place
+    .equ AES_BLOCKS, 32
+    .equ STATE, 0x2000     # sha256 state
+    .equ W, 0x2100         # sha256 message schedule
+    .equ RK, 0x2200        # aes round keys
+    .equ TE0, 0x3000       # aes tables, 1 KiB each
+    .equ TE1, 0x3400
+    .equ TE2, 0x3800
+    .equ TE3, 0x3c00
+    .equ MSG, 0x4000       # sha256 message
+    .equ SHA_BLOCKS, 8
+
+_start:
+    j sha256
+    j aes
+
+#
+# sha256, a..h in s0, s1, s2..s7
+#
+
+sha256:
+    mv s10, a0
+    li t0, H0
+    li a2, STATE
+    addi t1, t0, 32
+1:  lw t2, 0(t0)
+    sw t2, 0(a2)
+    addi t0, t0, 4
+    addi a2, a2, 4
+    bne t0, t1, 1b
+    # message: word i is i * 0x9e3779b1
+    li t0, MSG
+    li t1, MSG + SHA_BLOCKS * 64
+    li t2, 0
+    li t3, 0x9e3779b1
+2:  sw t2, 0(t0)
+    add t2, t2, t3
+    addi t0, t0, 4
+    bne t0, t1, 2b
+
+sha_rep:
+    li a0, MSG
+    li a1, SHA_BLOCKS
+    li a2, STATE
+    li a3, K
+    li a4, W
+sha_block:
+    # w[0..15], big endian
+    mv t0, a0
+    mv t1, a4
+    addi t2, a4, 64
+1:  lbu t3, 0(t0)
+    lbu t4, 1(t0)
+    lbu t5, 2(t0)
+    lbu t6, 3(t0)
+    slli t3, t3, 24
+    slli t4, t4, 16
+    slli t5, t5, 8
+    or t3, t3, t4
+    or t5, t5, t6
+    or t3, t3, t5
+    sw t3, 0(t1)
+    addi t0, t0, 4
+    addi t1, t1, 4
+    bne t1, t2, 1b
+    # w[16..63]
+    addi t2, a4, 256
+2:  lw t3, -8(t1)
+    lw t4, -60(t1)
+    srliw t5, t3, 17
+    slliw t6, t3, 15
+    or t5, t5, t6
+    srliw t6, t3, 19
+    slliw a5, t3, 13
+    or t6, t6, a5
+    xor t5, t5, t6
+    srliw t6, t3, 10
+    xor t5, t5, t6
+    srliw t6, t4, 7
+    slliw a5, t4, 25
+    or t6, t6, a5
+    srliw a5, t4, 18
+    slliw a6, t4, 14
+    or a5, a5, a6
+    xor t6, t6, a5
+    srliw a5, t4, 3
+    xor t6, t6, a5
+    lw a5, -28(t1)
+    lw a6, -64(t1)
+    addw t5, t5, t6
+    addw t5, t5, a5
+    addw t5, t5, a6
+    sw t5, 0(t1)
+    addi t1, t1, 4
+    bne t1, t2, 2b
+    # rounds
+    lw s0, 0(a2)
+    lw s1, 4(a2)
+    lw s2, 8(a2)
+    lw s3, 12(a2)
+    lw s4, 16(a2)
+    lw s5, 20(a2)
+    lw s6, 24(a2)
+    lw s7, 28(a2)
+    mv t0, a4
+    mv t1, a3
+3:  srliw t3, s4, 6
+    slliw t4, s4, 26
+    or t3, t3, t4
+    srliw t4, s4, 11
+    slliw t5, s4, 21
+    or t4, t4, t5
+    xor t3, t3, t4
+    srliw t4, s4, 25
+    slliw t5, s4, 7
+    or t4, t4, t5
+    xor t3, t3, t4
+    and t4, s4, s5
+    not t5, s4
+    and t5, t5, s6
+    xor t4, t4, t5
+    addw t3, t3, t4
+    addw t3, t3, s7
+    lw t4, 0(t1)
+    lw t5, 0(t0)
+    addw t3, t3, t4
+    addw t3, t3, t5
+    srliw t4, s0, 2
+    slliw t5, s0, 30
+    or t4, t4, t5
+    srliw t5, s0, 13
+    slliw t6, s0, 19
+    or t5, t5, t6
+    xor t4, t4, t5
+    srliw t5, s0, 22
+    slliw t6, s0, 10
+    or t5, t5, t6
+    xor t4, t4, t5
+    and t5, s0, s1
+    and t6, s0, s2
+    xor t5, t5, t6
+    and t6, s1, s2
+    xor t5, t5, t6
+    addw t4, t4, t5
+    mv s7, s6
+    mv s6, s5
+    mv s5, s4
+    addw s4, s3, t3
+    mv s3, s2
+    mv s2, s1
+    mv s1, s0
+    addw s0, t3, t4
+    addi t0, t0, 4
+    addi t1, t1, 4
+    bne t0, t2, 3b
+    lw t3, 0(a2)
+    addw t3, t3, s0
+    sw t3, 0(a2)
+    lw t3, 4(a2)
+    addw t3, t3, s1
+    sw t3, 4(a2)
+    lw t3, 8(a2)
+    addw t3, t3, s2
+    sw t3, 8(a2)
+    lw t3, 12(a2)
+    addw t3, t3, s3
+    sw t3, 12(a2)
+    lw t3, 16(a2)
+    addw t3, t3, s4
+    sw t3, 16(a2)
+    lw t3, 20(a2)
+    addw t3, t3, s5
+    sw t3, 20(a2)
+    lw t3, 24(a2)
+    addw t3, t3, s6
+    sw t3, 24(a2)
+    lw t3, 28(a2)
+    addw t3, t3, s7
+    sw t3, 28(a2)
+    addi a0, a0, 64
+    addi a1, a1, -1
+    bnez a1, sha_block
+    addi s10, s10, -1
+    bnez s10, sha_rep
+    li t0, STATE
+    lw a0, 0(t0)
+    ecall
+
+#
+# aes-128 with four tables, the state columns in s0, s1, s2, s3
+#
+
+    .macro load_be r, off
+    lbu \r, \off(s4)
+    lbu t4, \off+1(s4)
+    slli \r, \r, 8
+    or \r, \r, t4
+    lbu t4, \off+2(s4)
+    slli \r, \r, 8
+    or \r, \r, t4
+    lbu t4, \off+3(s4)
+    slli \r, \r, 8
+    or \r, \r, t4
+    .endm
+
+    .macro store_be r, off
+    srli t4, \r, 24
+    sb t4, \off(s4)
+    srli t4, \r, 16
+    sb t4, \off+1(s4)
+    srli t4, \r, 8
+    sb t4, \off+2(s4)
+    sb \r, \off+3(s4)
+    .endm
+
+    # d = te0[w0 >> 24] ^ te1[w1 >> 16 & 0xff] ^ te2[w2 >> 8 & 0xff] ^ te3[w3 & 0xff] ^ rk[k]
+    .macro column d, w0, w1, w2, w3, k
+    srliw t4, \w0, 24
+    slli t4, t4, 2
+    add t4, t4, a1
+    lw \d, 0(t4)
+    srliw t4, \w1, 16
+    andi t4, t4, 0xff
+    slli t4, t4, 2
+    add t4, t4, a2
+    lw t4, 0(t4)
+    xor \d, \d, t4
+    srliw t4, \w2, 8
+    andi t4, t4, 0xff
+    slli t4, t4, 2
+    add t4, t4, a3
+    lw t4, 0(t4)
+    xor \d, \d, t4
+    andi t4, \w3, 0xff
+    slli t4, t4, 2
+    add t4, t4, a4
+    lw t4, 0(t4)
+    xor \d, \d, t4
+    lw t4, \k(a5)
+    xor \d, \d, t4
+    .endm
+
+    # the last round, s-box only
+    .macro last d, w0, w1, w2, w3, k
+    srliw t4, \w0, 24
+    add t4, t4, s7
+    lbu \d, 0(t4)
+    slli \d, \d, 24
+    srliw t4, \w1, 16
+    andi t4, t4, 0xff
+    add t4, t4, s7
+    lbu t4, 0(t4)
+    slli t4, t4, 16
+    or \d, \d, t4
+    srliw t4, \w2, 8
+    andi t4, t4, 0xff
+    add t4, t4, s7
+    lbu t4, 0(t4)
+    slli t4, t4, 8
+    or \d, \d, t4
+    andi t4, \w3, 0xff
+    add t4, t4, s7
+    lbu t4, 0(t4)
+    or \d, \d, t4
+    lw t4, \k(a5)
+    xor \d, \d, t4
+    .endm
+
+aes:
+    mv s6, a0
+    li s7, SBOX
+    li a1, TE0
+    li a2, TE1
+    li a3, TE2
+    li a4, TE3
+    # te0[x] = s2 s s s3 with s = sbox[x], s2 = 2 * s and s3 = 3 * s in GF(2^8), the others rotated
+    li t0, 0
+    li t6, 256
+1:  add t1, s7, t0
+    lbu t1, 0(t1)
+    slli t2, t1, 1
+    srli t3, t1, 7
+    neg t3, t3
+    andi t3, t3, 0x1b
+    xor t2, t2, t3
+    andi t2, t2, 0xff
+    xor t3, t2, t1
+    slli t5, t0, 2
+    slli t4, t2, 24
+    slli a5, t1, 16
+    or t4, t4, a5
+    slli a5, t1, 8
+    or t4, t4, a5
+    or t4, t4, t3
+    add a5, t5, a1
+    sw t4, 0(a5)
+    slli t4, t3, 24
+    slli a5, t2, 16
+    or t4, t4, a5
+    slli a5, t1, 8
+    or t4, t4, a5
+    or t4, t4, t1
+    add a5, t5, a2
+    sw t4, 0(a5)
+    slli t4, t1, 24
+    slli a5, t3, 16
+    or t4, t4, a5
+    slli a5, t2, 8
+    or t4, t4, a5
+    or t4, t4, t1
+    add a5, t5, a3
+    sw t4, 0(a5)
+    slli t4, t1, 24
+    slli a5, t1, 16
+    or t4, t4, a5
+    slli a5, t3, 8
+    or t4, t4, a5
+    or t4, t4, t2
+    add a5, t5, a4
+    sw t4, 0(a5)
+    addi t0, t0, 1
+    bne t0, t6, 1b
+    # key expansion, rk[i] = rk[i - 4] ^ rk[i - 1], every fourth word through the s-box with rcon
+    li s4, KEY
+    li a5, RK
+    load_be t0, 0
+    sw t0, 0(a5)
+    load_be t0, 4
+    sw t0, 4(a5)
+    load_be t0, 8
+    sw t0, 8(a5)
+    load_be t0, 12
+    sw t0, 12(a5)
+    li t6, 1
+    li a6, 10
+2:  lw t0, 12(a5)
+    srliw t1, t0, 16
+    andi t1, t1, 0xff
+    add t1, t1, s7
+    lbu t1, 0(t1)
+    slli t1, t1, 24
+    srliw t2, t0, 8
+    andi t2, t2, 0xff
+    add t2, t2, s7
+    lbu t2, 0(t2)
+    slli t2, t2, 16
+    or t1, t1, t2
+    andi t2, t0, 0xff
+    add t2, t2, s7
+    lbu t2, 0(t2)
+    slli t2, t2, 8
+    or t1, t1, t2
+    srliw t2, t0, 24
+    add t2, t2, s7
+    lbu t2, 0(t2)
+    or t1, t1, t2
+    slli t2, t6, 24
+    xor t1, t1, t2
+    lw t2, 0(a5)
+    xor t1, t1, t2
+    sw t1, 16(a5)
+    lw t2, 4(a5)
+    xor t1, t1, t2
+    sw t1, 20(a5)
+    lw t2, 8(a5)
+    xor t1, t1, t2
+    sw t1, 24(a5)
+    lw t2, 12(a5)
+    xor t1, t1, t2
+    sw t1, 28(a5)
+    slli t2, t6, 1
+    srli t3, t6, 7
+    neg t3, t3
+    andi t3, t3, 0x1b
+    xor t6, t2, t3
+    andi t6, t6, 0xff
+    addi a5, a5, 16
+    addi a6, a6, -1
+    bnez a6, 2b
+
+aes_rep:
+    li s4, AESBUF
+    li s5, AESBUF + AES_BLOCKS * 16
+aes_block:
+    li a5, RK
+    load_be s0, 0
+    load_be s1, 4
+    load_be s2, 8
+    load_be s3, 12
+    lw t4, 0(a5)
+    xor s0, s0, t4
+    lw t4, 4(a5)
+    xor s1, s1, t4
+    lw t4, 8(a5)
+    xor s2, s2, t4
+    lw t4, 12(a5)
+    xor s3, s3, t4
+    addi a5, a5, 16
+    li a6, 9
+3:  column t0, s0, s1, s2, s3, 0
+    column t1, s1, s2, s3, s0, 4
+    column t2, s2, s3, s0, s1, 8
+    column t3, s3, s0, s1, s2, 12
+    mv s0, t0
+    mv s1, t1
+    mv s2, t2
+    mv s3, t3
+    addi a5, a5, 16
+    addi a6, a6, -1
+    bnez a6, 3b
+    last t0, s0, s1, s2, s3, 0
+    last t1, s1, s2, s3, s0, 4
+    last t2, s2, s3, s0, s1, 8
+    last t3, s3, s0, s1, s2, 12
+    store_be t0, 0
+    store_be t1, 4
+    store_be t2, 8
+    store_be t3, 12
+    addi s4, s4, 16
+    bne s4, s5, aes_block
+    addi s6, s6, -1
+    bnez s6, aes_rep
+    li t0, AESBUF
+    lw a0, 0(t0)
+    ecall
+
+    .org K
+    .word 0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5
+    .word 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174
+    .word 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da
+    .word 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967
+    .word 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85
+    .word 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070
+    .word 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3
+    .word 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    .org H0
+    .word 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    .org SBOX
+    .byte 0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76
+    .byte 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0
+    .byte 0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15
+    .byte 0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75
+    .byte 0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84
+    .byte 0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf
+    .byte 0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8
+    .byte 0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2
+    .byte 0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73
+    .byte 0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb
+    .byte 0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79
+    .byte 0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08
+    .byte 0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a
+    .byte 0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e
+    .byte 0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf
+    .byte 0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+    # the key and first block of the FIPS-197 example, which encrypts to 3925841d02dc09fbdc118597196a0b32
+    .org KEY
+    .byte 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+    .org AESBUF
+    .byte 0x32, 0x43, 0xf6, 0xa8, 0x88, 0x5a, 0x30, 0x8d, 0x31, 0x31, 0x98, 0xa2, 0xe0, 0x37, 0x07, 0x34
+    .org AESBUF + AES_BLOCKS * 16
@@ -0,0 +1,374 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "librv64i_internal.h"
+
+// differential tests of the engines. guest code runs with cpu_run on every engine, translated
+// ahead of time and on CPU_LANES cpus with cpu_run_lanes, and has to end with the registers, pc,
+// dram and instret of the same code stepped with cpu_step. the programs are the instruction
+// sequences an engine once got wrong, which also list the registers they end with, then seeded
+// random ones. last cpu_restore after the guest
+// modified its code, on a cpu and on a hart, and loads into x0 from a device
+
+#define TEST_MAX 1000000  // instructions, every program stops before
+#define TEST_DATA 0x8000  // the random programs load and store here
+#define TEST_RANDOM 300   // seeded random programs
+#define TEST_AOT 4        // of them also translated ahead of time, each one runs the host compiler
+#define RANDOM_CODE 256   // words of a random program before its functions
+#define RANDOM_FUNCTIONS 3
+
+typedef struct test_prog_t {
+    const char *name;
+    const uint32_t *code; // at address 0
+    uint64_t n;           // words of code
+    uint64_t regs[32];
+    const uint8_t *data;    // 0x800 bytes at TEST_DATA, or none
+    const uint64_t *expect; // the registers at the end, or not checked
+} test_prog_t;
+
+#define CODE(...) (const uint32_t[]){__VA_ARGS__}, sizeof((const uint32_t[]){__VA_ARGS__}) / 4
+
+static const test_prog_t progs[] = {
+    // lui x5, 0x12345; auipc x6, 0xfffff; lui x7, 0x80000; ecall. imm_U kept bits of rd and the opcode
+    {"lui and auipc", CODE(0x123452b7, 0xfffff317, 0x800003b7, 0x00000073), {0}, NULL,
+     (const uint64_t[32]){[5] = 0x12345000, [6] = 0xfffffffffffff004ull, [7] = 0xffffffff80000000ull}},
+    // addi x31, x31, -1; j +4; addi x5, x0, 7; add x6, x6, x5; bne x31, x0, -16; ecall. the trace compiler kept the
+    // link pc of the folded j as the value of x0 and turned the addi into x5 = pc + 7
+    {"j before li in a trace", CODE(0xffff8f93, 0x0040006f, 0x00700293, 0x00530333, 0xfe0f98e3, 0x00000073), {[31] = 1000}, NULL,
+     (const uint64_t[32]){[5] = 7, [6] = 7000}},
+    // div x10, x5, x6; rem x11, x5, x6; divw x12, x7, x6; remw x13, x7, x6; div x14, x8, x6; divw x15, x8, x6;
+    // addi x31, x31, -1; bne x31, x0, -28; ecall. the most negative value by -1 was a host division and SIGFPE
+    {"div and rem of the most negative value by -1", CODE(0x0262c533, 0x0262e5b3, 0x0263c63b, 0x0263e6bb, 0x02644733, 0x026447bb, 0xffff8f93, 0xfe0f92e3, 0x00000073),
+     {[5] = 0x8000000000000000ull, [6] = -1, [7] = 0x80000000, [8] = 12345, [31] = 1000}, NULL,
+     (const uint64_t[32]){[5] = 0x8000000000000000ull, [6] = -1, [7] = 0x80000000, [8] = 12345, [10] = 0x8000000000000000ull, [12] = 0xffffffff80000000ull,
+                          [14] = -12345, [15] = -12345}},
+};
+
+static const struct {
+    const char *name;
+    cpu_engine_t engine;
+} engines[] = {{"step", CPU_ENGINE_STEP}, {"threaded", CPU_ENGINE_THREADED}, {"block", CPU_ENGINE_BLOCK}, {"jit", CPU_ENGINE_JIT}};
+#define ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static char dir[] = "/tmp/engines.XXXXXX"; // the images translated ahead of time and their translations
+static cpu_t ref[CPU_LANES];
+static cpu_t lanes[CPU_LANES];
+static cpu_t cpu;
+
+// lane 0 starts with the registers of p, the others with some of x2..x11 changed, so their branches go apart
+static void test_init(cpu_t *c, const test_prog_t *p, cpu_engine_t engine, int lane) {
+    cpu_config_t config = {.engine = engine};
+    if (cpu_init_config(c, &config)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(c->bus.dram.mem, p->code, p->n * 4);
+    if (p->data)
+        memcpy(c->bus.dram.mem + TEST_DATA, p->data, 0x800);
+    memcpy(c->regs, p->regs, sizeof(c->regs));
+    for (int r = 2; lane && r < 12; r++)
+        if ((r + lane) % 3 == 0)
+            c->regs[r] = c->regs[r] * 0x9e3779b97f4a7c15ull + lane;
+}
+
+// 0 when c ended like ref, else what differs is printed
+static int test_diff(const char *engine, const test_prog_t *p, cpu_t *c, cpu_t *ref) {
+    int fail = 0;
+    if (c->stats.instret != ref->stats.instret || c->pc != ref->pc) {
+        printf("FAIL: %s %s: instret %lu pc %lx, cpu_step %lu pc %lx\n", engine, p->name, c->stats.instret, c->pc, ref->stats.instret, ref->pc);
+        fail = 1;
+    }
+    for (int r = 0; r < 32; r++) {
+        if (c->regs[r] != ref->regs[r]) {
+            printf("FAIL: %s %s: x%d %lx, cpu_step %lx\n", engine, p->name, r, c->regs[r], ref->regs[r]);
+            fail = 1;
+        }
+    }
+    if (memcmp(c->bus.dram.mem, ref->bus.dram.mem, ref->bus.dram.size)) {
+        printf("FAIL: %s %s: dram differs\n", engine, p->name);
+        fail = 1;
+    }
+    return fail;
+}
+
+static int test_prog(const test_prog_t *p, int aot) {
+    cpu_t *cpus[CPU_LANES];
+    cpu_result_t results[CPU_LANES];
+    int fail = 0;
+    for (int l = 0; l < CPU_LANES; l++) {
+        test_init(&ref[l], p, CPU_ENGINE_STEP, l);
+        while (ref[l].stats.instret < TEST_MAX && !cpu_step(&ref[l]))
+            ;
+    }
+    for (int r = 0; p->expect && r < 32; r++) {
+        if (ref[0].regs[r] != p->expect[r]) {
+            printf("FAIL: %s: x%d %lx, expected %lx\n", p->name, r, ref[0].regs[r], p->expect[r]);
+            fail = 1;
+        }
+    }
+    for (size_t e = 0; e < ENGINES; e++) {
+        test_init(&cpu, p, engines[e].engine, 0);
+        cpu_run(&cpu, TEST_MAX);
+        fail |= test_diff(engines[e].name, p, &cpu, &ref[0]);
+        cpu_free(&cpu);
+    }
+    if (aot) {
+        char image[sizeof(dir) + 16];
+        char so[sizeof(dir) + 32];
+        snprintf(image, sizeof(image), "%s/prog.bin", dir);
+        snprintf(so, sizeof(so), "%s.aot.so", image);
+        FILE *f = fopen(image, "wb");
+        if (f) {
+            fwrite(p->code, 4, p->n, f);
+            fclose(f);
+        }
+        test_init(&cpu, p, CPU_ENGINE_BLOCK, 0);
+        if (!f || cpu_aot_load(&cpu, image)) {
+            printf("FAIL: aot %s: no translation\n", p->name);
+            fail = 1;
+        } else {
+            cpu_run(&cpu, TEST_MAX);
+            fail |= test_diff("aot", p, &cpu, &ref[0]);
+        }
+        cpu_free(&cpu);
+        remove(so);
+        remove(image);
+    }
+    for (int l = 0; l < CPU_LANES; l++) {
+        test_init(&lanes[l], p, CPU_ENGINE_STEP, l);
+        cpus[l] = &lanes[l];
+    }
+    cpu_run_lanes(cpus, CPU_LANES, TEST_MAX, results);
+    for (int l = 0; l < CPU_LANES; l++) {
+        fail |= test_diff("lanes", p, &lanes[l], &ref[l]);
+        cpu_free(&lanes[l]);
+        cpu_free(&ref[l]);
+    }
+    return fail;
+}
+
+// random programs. x1 is the return address, x2..x11 hold the values, x12 and x13 point into the
+// data, x14 counts down in the loops and x15 is the base of indirect calls. the code runs forward
+// with branches and jumps, except for the loops, which decrement x14 and go back while it is
+// positive, and the calls, to functions after the ecall that ends the program. a quarter of the
+// instructions read x0, which the trace compiler folds like any other constant
+static uint64_t rng;
+
+static uint64_t rnd(uint64_t n) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng % n;
+}
+
+static uint32_t enc_R(uint32_t opcode, uint32_t funct3, uint32_t funct7, uint32_t rd, uint32_t rs1, uint32_t rs2) {
+    return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static uint32_t enc_I(uint32_t opcode, uint32_t funct3, uint32_t rd, uint32_t rs1, int32_t imm) { return (uint32_t)imm << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode; }
+
+static uint32_t enc_S(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+    return ((uint32_t)imm >> 5 & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1f) << 7 | 0x23;
+}
+
+static uint32_t enc_B(uint32_t funct3, uint32_t rs1, uint32_t rs2, int32_t off) {
+    uint32_t u = off;
+    return (u >> 12 & 1) << 31 | (u >> 5 & 0x3f) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (u >> 1 & 0xf) << 8 | (u >> 11 & 1) << 7 | 0x63;
+}
+
+static uint32_t enc_J(uint32_t rd, int32_t off) {
+    uint32_t u = off;
+    return (u >> 20 & 1) << 31 | (u >> 1 & 0x3ff) << 21 | (u >> 11 & 1) << 20 | (u >> 12 & 0xff) << 12 | rd << 7 | 0x6f;
+}
+
+// OP and OP-32 with their funct3 and funct7, M included
+static const uint32_t random_ops[][3] = {
+    {0x33, 0, 0x00}, {0x33, 0, 0x20}, {0x33, 1, 0x00}, {0x33, 2, 0x00}, {0x33, 3, 0x00}, {0x33, 4, 0x00}, {0x33, 5, 0x00}, {0x33, 5, 0x20},
+    {0x33, 6, 0x00}, {0x33, 7, 0x00}, {0x33, 0, 0x01}, {0x33, 1, 0x01}, {0x33, 2, 0x01}, {0x33, 3, 0x01}, {0x33, 4, 0x01}, {0x33, 5, 0x01},
+    {0x33, 6, 0x01}, {0x33, 7, 0x01}, {0x3b, 0, 0x00}, {0x3b, 0, 0x20}, {0x3b, 1, 0x00}, {0x3b, 5, 0x00}, {0x3b, 5, 0x20}, {0x3b, 0, 0x01},
+    {0x3b, 4, 0x01}, {0x3b, 5, 0x01}, {0x3b, 6, 0x01}, {0x3b, 7, 0x01},
+};
+
+// values the edge cases of the ALU and of division are made of
+static const uint64_t random_values[] = {0, 1, -1, 2, 0x7fffffff, 0x80000000, 0xffffffff80000000ull, 0x8000000000000000ull, 0x7fffffffffffffffull};
+
+static uint32_t random_rd(void) { return rnd(16) ? 2 + rnd(10) : 0; }
+
+static uint32_t random_insn(uint32_t rd, uint32_t rs1, uint32_t rs2) {
+    uint64_t k = rnd(100);
+    int32_t imm = rnd(2) ? (int32_t)rnd(4096) - 2048 : (int32_t)rnd(16) - 8;
+    if (k < 35) {
+        const uint32_t *op = random_ops[rnd(sizeof(random_ops) / sizeof(random_ops[0]))];
+        return enc_R(op[0], op[1], op[2], rd, rs1, rs2);
+    }
+    if (k < 55) {
+        uint32_t funct3 = rnd(8);
+        if (funct3 == 1 || funct3 == 5)
+            imm = rnd(64) | (funct3 == 5 && rnd(2) ? 0x400 : 0);
+        return enc_I(0x13, funct3, rd, rs1, imm);
+    }
+    if (k < 62) {
+        uint32_t funct3 = (uint32_t[]){0, 1, 5}[rnd(3)];
+        if (funct3)
+            imm = rnd(32) | (funct3 == 5 && rnd(2) ? 0x400 : 0);
+        return enc_I(0x1b, funct3, rd, rs1, imm);
+    }
+    if (k < 66)
+        return (uint32_t)rnd(1 << 20) << 12 | rd << 7 | (rnd(2) ? 0x37 : 0x17); // LUI, AUIPC
+    if (k < 78)
+        return enc_I(0x03, rnd(7), rd, 12 + rnd(2), (int32_t)rnd(256) - 128);
+    if (k < 88)
+        return enc_S(rnd(4), 12 + rnd(2), rs2, (int32_t)rnd(256) - 128);
+    return 0x0000000f; // fence
+}
+
+static test_prog_t *random_prog(int seed) {
+    static uint32_t code[RANDOM_CODE + 8 * RANDOM_FUNCTIONS];
+    static uint8_t data[0x800];
+    static char name[32];
+    static test_prog_t p = {name, code, sizeof(code) / 4, {0}, data};
+    uint8_t join[RANDOM_CODE] = {0}; // the second word of a loop or of an indirect call, no branch goes there
+    int n = RANDOM_CODE;
+    int loop = -1; // the word after the addi that starts the open loop
+
+    rng = 0x9e3779b97f4a7c15ull * seed;
+    snprintf(name, sizeof(name), "random %d", seed);
+    for (int i = 0; i < n - 1; i++) {
+        uint64_t k = rnd(100);
+        int f = n + 8 * rnd(RANDOM_FUNCTIONS);
+        // loops do not nest and each one sets x14 itself, so every loop runs often enough to become a trace.
+        // they make no calls, a trace cannot return
+        if (k < 5 && loop < 0) {
+            code[i] = enc_I(0x13, 0, 14, 0, 20 + rnd(80)); // addi x14, x0, count
+            loop = i + 1;
+        } else if (k < 8 && loop >= 0 && i > loop && i + 2 < n) {
+            code[i] = enc_I(0x13, 0, 14, 14, -1);              // addi x14, x14, -1
+            code[i + 1] = enc_B(4, 0, 14, 4 * (loop - i - 1)); // blt x0, x14, loop
+            join[++i] = 1;
+            loop = -1;
+        } else if (k < 11 && loop < 0 && i + 2 < n) {
+            code[i] = enc_I(0x17, 0, 15, 0, 0);             // auipc x15, 0
+            code[i + 1] = enc_I(0x67, 0, 1, 15, 4 * (f - i)); // jalr x1, f(x15)
+            join[++i] = 1;
+        } else if (k < 14 && loop < 0) {
+            code[i] = enc_J(1, 4 * (f - i));
+        } else if (k < 25) {
+            code[i] = enc_B((uint32_t[]){0, 1, 4, 5, 6, 7}[rnd(6)], rnd(16), rnd(16), 4 * (int)(1 + rnd(8)));
+        } else if (k < 28) {
+            code[i] = enc_J(0, 4 * (int)(1 + rnd(8)));
+        } else {
+            code[i] = random_insn(random_rd(), rnd(4) ? rnd(16) : 0, rnd(16));
+        }
+    }
+    code[n - 1] = 0x00000073; // ecall
+    // branches and jumps past the end stop at the ecall, none lands on the second word of a pair
+    for (int i = 0; i < n - 1; i++) {
+        uint32_t op = code[i] & 0x7f;
+        uint32_t rd = code[i] >> 7 & 0x1f;
+        int32_t off;
+        if (op == 0x63)
+            off = (int32_t)(code[i] & 0x80000000) >> 19 | (code[i] & 0x80) << 4 | (code[i] >> 20 & 0x7e0) | (code[i] >> 7 & 0x1e);
+        else if (op == 0x6f && !rd)
+            off = (int32_t)(code[i] & 0x80000000) >> 11 | (code[i] & 0xff000) | (code[i] >> 9 & 0x800) | (code[i] >> 20 & 0x7fe);
+        else
+            continue;
+        int t = i + off / 4 < n ? i + off / 4 : n - 1;
+        while (join[t])
+            t += off > 0 ? 1 : -1;
+        code[i] = op == 0x63 ? enc_B(code[i] >> 12 & 7, code[i] >> 15 & 0x1f, code[i] >> 20 & 0x1f, 4 * (t - i)) : enc_J(0, 4 * (t - i));
+    }
+    for (int f = 0; f < RANDOM_FUNCTIONS; f++) {
+        for (int i = 0; i < 7; i++)
+            code[n + 8 * f + i] = random_insn(2 + rnd(10), rnd(16), rnd(16));
+        code[n + 8 * f + 7] = enc_I(0x67, 0, 0, 1, 0); // ret
+    }
+    for (int i = 0; i < 0x800; i++)
+        data[i] = rnd(256);
+    for (int r = 1; r < 32; r++)
+        p.regs[r] = rnd(2) ? random_values[rnd(sizeof(random_values) / sizeof(random_values[0]))] : rng;
+    p.regs[12] = TEST_DATA + 0x100;
+    p.regs[13] = TEST_DATA + 0x400;
+    return &p;
+}
+
+// lui x5, 0x200; addi x5, x5, 0x593; sw x5, 0x20(x0); fence.i; j 0x20; at 0x20 addi a1, x0, 1; ecall. the guest
+// turns the addi into addi a1, x0, 2 and runs it, cpu_restore and a jump to 0x20 have to run the addi of the
+// snapshot again. the snapshot of a hart is not tracked, its restore has to drop all decoded code
+static const uint32_t smc[] = {0x002002b7, 0x59328293, 0x02502023, 0x0000100f, 0x0100006f, 0, 0, 0, 0x00100593, 0x00000073};
+
+static int test_restore(const char *engine, cpu_engine_t e, int hart) {
+    static cpu_t owner;
+    cpu_config_t config = {.engine = e};
+    cpu_t *c = hart ? &cpu : &owner;
+    int fail = 0;
+    if (cpu_init_config(&owner, &config) || (hart && cpu_init_hart(&cpu, &owner, 1))) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(owner.bus.dram.mem, smc, sizeof(smc));
+    cpu_snapshot(c);
+    cpu_run(c, 100);
+    fail |= c->regs[11] != 2;
+    cpu_restore(c);
+    c->pc = 0x20;
+    cpu_run(c, 100);
+    fail |= c->regs[11] != 1;
+    printf("%s: %s %s restore after a store to code\n", fail ? "FAIL" : "PASS", engine, hart ? "hart" : "cpu");
+    if (hart)
+        cpu_free(&cpu);
+    cpu_free(&owner);
+    return fail;
+}
+
+// lw x0, 0(x5); ld x0, 8(x5); lbu x0, 1(x5); add x6, x6, x0; addi x31, x31, -1; bne x31, x0, -20; ecall, with x5 on a
+// device that counts its reads. the loads only write x0, each of them still has to reach the device
+static const uint32_t fifo[] = {0x0002a003, 0x0082b003, 0x0012c003, 0x00030333, 0xffff8f93, 0xfe0f96e3, 0x00000073};
+
+static uint64_t fifo_read(void *ctx, uint64_t off, int size) { return ++*(uint64_t *)ctx; }
+
+static int test_device(const char *engine, cpu_engine_t e) {
+    uint64_t reads = 0;
+    cpu_device_t dev = {.base = DRAM_SIZE, .size = 4096, .read = fifo_read, .ctx = &reads};
+    cpu_config_t config = {.engine = e};
+    if (cpu_init_config(&cpu, &config) || cpu_device_add(&cpu, &dev) < 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memcpy(cpu.bus.dram.mem, fifo, sizeof(fifo));
+    cpu.regs[5] = DRAM_SIZE;
+    cpu.regs[31] = 1000;
+    cpu_run(&cpu, TEST_MAX);
+    int fail = reads != 3000 || cpu.regs[0] || cpu.regs[6];
+    printf("%s: %s load into x0 from a device\n", fail ? "FAIL" : "PASS", engine);
+    cpu_free(&cpu);
+    return fail;
+}
+
+int main(int argc, char **argv) {
+    int fail = 0;
+    int failed = 0;
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "no temporary directory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(progs) / sizeof(progs[0]); i++) {
+        int f = test_prog(&progs[i], 1);
+        if (!f)
+            printf("PASS: %s\n", progs[i].name);
+        fail |= f;
+    }
+    for (int seed = 1; seed <= TEST_RANDOM; seed++)
+        failed += test_prog(random_prog(seed), seed <= TEST_AOT);
+    printf("%s: %d random programs, %d failed\n", failed ? "FAIL" : "PASS", TEST_RANDOM, failed);
+    fail |= failed;
+    for (size_t e = 0; e < ENGINES; e++)
+        for (int hart = 0; hart < 2; hart++)
+            fail |= test_restore(engines[e].name, engines[e].engine, hart);
+    for (size_t e = 0; e < ENGINES; e++)
+        fail |= test_device(engines[e].name, engines[e].engine);
+    rmdir(dir);
+    return fail;
+}
@@ -14,6 +14,7 @@ static inline void ecall(unsigned cmd, const void *ptr, int len) {
 #define ECALL_DEBUG 0
 #define ECALL_ASSERT 1
 #define ECALL_PUTCHAR 2
+#define ECALL_SNAPSHOT 3 // riscv64i -w writes a snapshot file here, riscv64i -r continues after it
 
 void __assert_func(const char *filename, int line, const char *assert_func, const char *expr) {
     printf("%s %d %s FAILED: %s", filename, line, assert_func, expr);
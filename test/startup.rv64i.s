@@ -3,10 +3,15 @@
     .align  4
 
 _start:
-    # Set stack pointer
+    # Set stack pointer, 16 KiB per hart below _stack_top
+    .insn i 0x73, 2, t2, zero, -236     # csrr t2, mhartid
     la  sp, _stack_top
+    slli t3, t2, 14
+    sub sp, sp, t3
+    bnez t2, hart
 
-    # Zero .bss section
+    # Zero .bss section, unless the elf loader did (a0 = 1)
+    bnez a0, exit2
     la  t0, _bss_start
     la  t1, _bss_end
 loop1:
@@ -23,3 +28,14 @@ exit2:
 
     # If main returns, trap with ebreak
     ebreak
+
+    # The other harts call hart_main(mhartid), they start before hart 0 zeroes .bss
+hart:
+    mv  a0, t2
+    call hart_main
+    ebreak
+
+    # Without one of the guest's the other harts stop right away
+    .weak hart_main
+hart_main:
+    ret